@@ -31,497 +31,4707 @@ SOFTWARE.
 
 #include <cmath>
 #include <climits>
+#include <cstddef>
+#include <cstdlib>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
 
 namespace psset
 {
 
-    template <typename T, typename Hash>
+    namespace detail
+    {
+        const unsigned int page_bits = 12;
+        const unsigned int page_size = 1U << page_bits;
+        const unsigned int page_mask = page_size - 1;
+
+        // Batched lookups resolve this many keys per round of prefetches.
+        const std::size_t batch_size = 16;
+
+        const std::size_t cache_line = 64;
+
+        inline void prefetch(const void* p)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_prefetch(p);
+#else
+            (void) p;
+#endif
+        }
+
+        // Atomic access to plain members, for the few paths that share them between threads.
+        // U is an integer, a pointer or, for load, store and compare_exchange, any
+        // trivially copyable type of a lock-free size.
+        template <typename U>
+        U atomic_load_acquire(const U& x)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            U v;
+            __atomic_load(&x, &v, __ATOMIC_ACQUIRE);
+            return v;
+#else
+            return reinterpret_cast<const std::atomic<U>&>(x).load(std::memory_order_acquire);
+#endif
+        }
+
+        template <typename U>
+        void atomic_store_release(U& x, U v)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            __atomic_store(&x, &v, __ATOMIC_RELEASE);
+#else
+            reinterpret_cast<std::atomic<U>&>(x).store(v, std::memory_order_release);
+#endif
+        }
+
+        template <typename U>
+        U atomic_fetch_add(U& x, U v)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return __atomic_fetch_add(&x, v, __ATOMIC_RELAXED);
+#else
+            return reinterpret_cast<std::atomic<U>&>(x).fetch_add(v, std::memory_order_relaxed);
+#endif
+        }
+
+        template <typename U>
+        U atomic_fetch_sub(U& x, U v)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return __atomic_fetch_sub(&x, v, __ATOMIC_RELAXED);
+#else
+            return reinterpret_cast<std::atomic<U>&>(x).fetch_sub(v, std::memory_order_relaxed);
+#endif
+        }
+
+        template <typename U>
+        bool atomic_compare_exchange(U& x, U& expected, U desired) // on failure expected holds the current value
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return __atomic_compare_exchange(&x, &expected, &desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#else
+            return reinterpret_cast<std::atomic<U>&>(x).compare_exchange_strong(expected, desired, std::memory_order_acq_rel,
+                                                                                 std::memory_order_acquire);
+#endif
+        }
+
+        // Shared, read-only page that every untouched part of the sparse index points to.
+        // It is never written to; a page is allocated once a key falls inside it.
+        template <typename Index>
+        Index *invalid_page()
+        {
+            struct page
+            {
+                page()
+                {
+                    std::fill(slots, slots + page_size, std::numeric_limits<Index>::max());
+                }
+
+                Index slots[page_size];
+            };
+
+            static page p;
+            return p.slots;
+        }
+
+        // Dense columns are raw blocks starting on a cache line, so chunks of whole
+        // lines handed to different threads never share one; only the first n slots
+        // hold live objects.
+        template <typename T>
+        T *allocate(std::size_t cap)
+        {
+            static_assert(alignof(T) <= cache_line, "over-aligned types are not supported");
+
+            if (cap == 0)
+                return nullptr;
+
+            void* data = nullptr;
+#if defined(_WIN32)
+            data = _aligned_malloc(cap * sizeof(T), cache_line);
+#else
+            if (posix_memalign(&data, cache_line, cap * sizeof(T)) != 0)
+                data = nullptr;
+#endif
+            if (data == nullptr)
+                throw std::bad_alloc();
+
+            return static_cast<T*>(data);
+        }
+
+        inline void deallocate(void* data)
+        {
+#if defined(_WIN32)
+            _aligned_free(data);
+#else
+            std::free(data);
+#endif
+        }
+
+        template <typename T>
+        void destroy(T* first, T* last)
+        {
+            if (std::is_trivially_destructible<T>::value)
+                return;
+
+            for (; first != last; ++first)
+                first->~T();
+        }
+
+        // Trivially copyable columns are copied bytewise; realloc would give up the alignment.
+        template <typename T, typename Index>
+        void reallocate(T*& data, Index n, Index new_cap, std::true_type)
+        {
+            T* new_data = allocate<T>(new_cap);
+
+            if (n != 0)
+                std::memcpy(static_cast<void*>(new_data), static_cast<const void*>(data), n * sizeof(T));
+
+            deallocate(data);
+            data = new_data;
+        }
+
+        template <typename T, typename Index>
+        void reallocate(T*& data, Index n, Index new_cap, std::false_type)
+        {
+            T* new_data = allocate<T>(new_cap);
+            Index i = 0;
+
+            try
+            {
+                for (; i < n; i++)
+                    new (&new_data[i]) T(std::move(data[i]));
+            }
+            catch (...)
+            {
+                destroy(new_data, new_data + i);
+                deallocate(new_data);
+                throw;
+            }
+
+            destroy(data, data + n);
+            deallocate(data);
+            data = new_data;
+        }
+
+        // Moves the first n elements of a dense column into a new block of new_cap elements.
+        template <typename T, typename Index>
+        void reallocate(T*& data, Index n, Index new_cap)
+        {
+            reallocate(data, n, new_cap, std::is_trivially_copyable<T>());
+        }
+
+        // Positions of keys[0, n) in ascending key order, stable. LSD radix sort,
+        // 8 bits per pass; passes whose byte is the same for every key are skipped.
+        template <typename Index>
+        std::vector<Index> radix_order(std::vector<unsigned int> keys)
+        {
+            const std::size_t n = keys.size();
+            std::vector<Index> order(n);
+            for (std::size_t i = 0; i < n; i++)
+                order[i] = static_cast<Index>(i);
+
+            std::vector<unsigned int> keys_tmp(n);
+            std::vector<Index> order_tmp(n);
+
+            for (unsigned int shift = 0; shift < 32; shift += 8)
+            {
+                std::size_t offsets[257] = {};
+                for (std::size_t i = 0; i < n; i++)
+                    offsets[(keys[i] >> shift & 0xFFU) + 1]++;
+
+                if (std::find(offsets + 1, offsets + 257, n) != offsets + 257)
+                    continue;
+
+                for (std::size_t b = 1; b < 257; b++)
+                    offsets[b] += offsets[b - 1];
+
+                for (std::size_t i = 0; i < n; i++)
+                {
+                    std::size_t to = offsets[keys[i] >> shift & 0xFFU]++;
+                    keys_tmp[to] = keys[i];
+                    order_tmp[to] = order[i];
+                }
+
+                keys.swap(keys_tmp);
+                order.swap(order_tmp);
+            }
+
+            return order;
+        }
+
+        // Moves the element at old position order[i] to position i. swap_at(i, j)
+        // exchanges two positions of every column; each element is swapped into
+        // its final place at most once.
+        template <typename Index, typename Swap>
+        void permute(const std::vector<Index>& order, Swap swap_at)
+        {
+            std::vector<Index> dest(order.size());
+            for (std::size_t i = 0; i < order.size(); i++)
+                dest[order[i]] = static_cast<Index>(i);
+
+            for (std::size_t i = 0; i < dest.size(); i++)
+            {
+                while (dest[i] != i)
+                {
+                    Index j = dest[i];
+                    swap_at(static_cast<Index>(i), j);
+                    std::swap(dest[i], dest[j]);
+                }
+            }
+        }
+
+        // Smallest power of two strictly greater than n, used to grow the dense storage.
+        // Saturates at the sentinel of Index, which is never a valid dense position.
+        template <typename Index>
+        Index next_capacity(Index n)
+        {
+            const Index max = std::numeric_limits<Index>::max();
+
+            if (n >= max / 2)
+                return max;
+
+            Index cap = 1;
+            while (cap <= n)
+                cap = static_cast<Index>(cap << 1U);
+
+            return cap;
+        }
+    }
+
+    // Non-owning view of a contiguous column.
+    template <typename T>
+    class span
+    {
+    public:
+        span(T* data, std::size_t size) : _data(data), _size(size) {}
+
+        T* data() const { return _data; }
+        std::size_t size() const { return _size; }
+        T* begin() const { return _data; }
+        T* end() const { return _data + _size; }
+        std::reverse_iterator<T*> rbegin() const { return std::reverse_iterator<T*>(end()); }
+        std::reverse_iterator<T*> rend() const { return std::reverse_iterator<T*>(begin()); }
+        T& operator[](std::size_t i) const { return _data[i]; }
+
+    private:
+        T* _data;
+        std::size_t _size;
+    };
+
+    // Hash for keys that already are 32-bit indices. Batched membership tests on
+    // sets using it run a vectorized kernel when compiled with AVX2.
+    struct identity_hash
+    {
+        unsigned int operator()(unsigned int k) const
+        {
+            return k;
+        }
+    };
+
+    // Sparse index policies. The initialized policy keeps every sparse slot either
+    // valid or npos, so search() is a single load. The uninitialized policy
+    // (Briggs & Torczon) never initializes the sparse pages and instead validates a
+    // hit against the key stored next to the dense slot, which makes construction,
+    // growth and clear() independent of the key range.
+    struct initialized_sparse
+    {
+        static const bool validated = false;
+    };
+
+    struct uninitialized_sparse
+    {
+        static const bool validated = true;
+    };
+
+    template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    class sparse_map;
+
+    template <typename T, typename Hash, typename Policy = initialized_sparse, typename Index = unsigned int>
     class sparse_set
     {
+        template <typename, typename, typename, typename, typename>
+        friend class sparse_map; // probes and links slots directly to upsert in one lookup
+
+        static_assert(std::is_integral<Index>::value && std::is_unsigned<Index>::value,
+                      "sparse_set index type must be an unsigned integer");
+
     public:
+        using index_type = Index;
+        static constexpr Index npos = std::numeric_limits<Index>::max();
+
         explicit sparse_set(unsigned int cap = 0);
+        sparse_set(const sparse_set&) = delete;
+        sparse_set(sparse_set&& other) noexcept;
+        sparse_set& operator=(const sparse_set&) = delete;
+        sparse_set& operator=(sparse_set&& other) noexcept;
         ~sparse_set();
 
+        void swap(sparse_set& other) noexcept;
+        sparse_set clone() const;
+
         void resize(unsigned int new_cap);
-        void add(T x);
-        void remove(T x);
-        unsigned int search(T x) const;
+        void reserve_keys(unsigned int key_cap);
+        void reserve_elements(Index elem_cap);
+        void add(const T& x);
+        void add(T&& x);
+        template <typename... Args>
+        void emplace(Args&&... args);
+        void add_concurrent(const T& x);
+        void add_concurrent(T&& x);
+        template <typename It>
+        void add_range(It first, It last);
+        template <typename K>
+        void remove(const K& k);
+        template <typename It>
+        void remove_range(It first, It last);
+        template <typename Other>
+        void intersect(const Other& other);
+        template <typename Other>
+        void unite(const Other& other);
+        template <typename Other>
+        void subtract(const Other& other);
+        void swap_positions(Index i, Index j);
+        template <typename Compare>
+        void sort(Compare comp);
+        void sort_by_key();
+        template <typename Other>
+        void sort_as(const Other& other);
+        template <typename K>
+        Index search(const K& k) const;
+        template <typename K>
+        bool contains(const K& k) const;
+        template <typename K>
+        void search_many(const K* keys, std::size_t n, Index* out) const;
+        template <typename K>
+        void contains_many(const K* keys, std::size_t n, bool* out) const;
         void clear();
 
-        unsigned int size() const;
-        T* data();
-        const T* data() const;
+        Index size() const;
+        Index capacity() const;
+        unsigned int key_capacity() const;
+        T* data();
+        const T* data() const;
+        span<const T> keys() const;
+
+        using iterator = T*; // contiguous; writes must not change the result of the hash function
+        using const_iterator = const T*;
+        using reverse_iterator = std::reverse_iterator<iterator>;
+        using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+        iterator begin();
+        const_iterator begin() const;
+        const_iterator cbegin() const;
+        iterator end();
+        const_iterator end() const;
+        const_iterator cend() const;
+        reverse_iterator rbegin();
+        const_reverse_iterator rbegin() const;
+        reverse_iterator rend();
+        const_reverse_iterator rend() const;
+
+    private:
+        void _grow_pages(unsigned int page_count);
+        Index& _slot(unsigned int val);
+        bool _holds(Index idx, unsigned int val) const;
+        void _remove_at(Index idx, unsigned int val);
+        void _relink();
+        std::vector<unsigned int> _hashes() const;
+        void _reserve_one();
+        void _push_back(unsigned int val);
+        void _link(Index& slot, unsigned int val);
+        template <typename... Args>
+        void _emplace_at(Index& slot, unsigned int val, Args&&... args);
+        template <typename U>
+        void _add_concurrent(U&& x);
+        Index& _slot_concurrent(unsigned int val);
+        Index _claim_concurrent();
+        void _publish_concurrent(Index& slot, unsigned int val, Index idx);
+        template <typename It>
+        void _reserve_range(It first, It last, std::forward_iterator_tag);
+        template <typename It>
+        void _reserve_range(It, It, std::input_iterator_tag);
+        template <typename K>
+        void _contains_many(const K* keys, std::size_t n, bool* out, std::false_type) const;
+        void _contains_many(const unsigned int* keys, std::size_t n, bool* out, std::true_type) const;
+
+        Hash _hash;
+        Index _n;
+        Index _capacity; // dense storage, grows with _n
+        unsigned int _page_count; // sparse index, grows with the largest key
+        Index** _pages;
+        T* _dense;
+        unsigned int* _keys; // key of every dense slot, only used by validated policies
+    };
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    constexpr Index sparse_set<T, Hash, Policy, Index>::npos;
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    sparse_set<T, Hash, Policy, Index>::sparse_set(unsigned int cap)
+    {
+        _n = 0;
+        _capacity = 0;
+        _page_count = 0;
+        _pages = nullptr;
+        _dense = nullptr;
+        _keys = nullptr;
+
+        resize(cap);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    sparse_set<T, Hash, Policy, Index>::sparse_set(sparse_set&& other) noexcept
+        : _hash(std::move(other._hash)), _n(other._n), _capacity(other._capacity),
+          _page_count(other._page_count), _pages(other._pages), _dense(other._dense), _keys(other._keys)
+    {
+        other._n = 0;
+        other._capacity = 0;
+        other._page_count = 0;
+        other._pages = nullptr;
+        other._dense = nullptr;
+        other._keys = nullptr;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    sparse_set<T, Hash, Policy, Index> &sparse_set<T, Hash, Policy, Index>::operator=(sparse_set&& other) noexcept
+    {
+        sparse_set tmp(std::move(other));
+        swap(tmp);
+        return *this;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::swap(sparse_set& other) noexcept
+    {
+        using std::swap;
+        swap(_hash, other._hash);
+        swap(_n, other._n);
+        swap(_capacity, other._capacity);
+        swap(_page_count, other._page_count);
+        swap(_pages, other._pages);
+        swap(_dense, other._dense);
+        swap(_keys, other._keys);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    sparse_set<T, Hash, Policy, Index> sparse_set<T, Hash, Policy, Index>::clone() const // copies the live elements only
+    {
+        sparse_set copy;
+        copy._hash = _hash;
+        copy.reserve_elements(_n);
+
+        for (Index i = 0; i < _n; i++)
+            copy.add(_dense[i]);
+
+        return copy;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    sparse_set<T, Hash, Policy, Index>::~sparse_set()
+    {
+        for (unsigned int i = 0; i < _page_count; i++)
+        {
+            if (_pages[i] != detail::invalid_page<Index>())
+                delete [] _pages[i];
+        }
+
+        delete [] _pages;
+        detail::destroy(_dense, _dense + _n);
+        detail::deallocate(_dense);
+        detail::deallocate(_keys);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::resize(unsigned int new_cap) // only ever grows
+    {
+        reserve_keys(new_cap);
+        reserve_elements(static_cast<Index>(std::min<unsigned long long>(new_cap, npos)));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::reserve_keys(unsigned int key_cap)
+    {
+        auto page_count = static_cast<unsigned int>((static_cast<unsigned long long>(key_cap) + detail::page_mask) >> detail::page_bits);
+
+        if (page_count > _page_count)
+            _grow_pages(page_count);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::reserve_elements(Index elem_cap)
+    {
+        if (elem_cap <= _capacity)
+            return;
+
+        detail::reallocate(_dense, _n, elem_cap);
+        if (Policy::validated)
+            detail::reallocate(_keys, _n, elem_cap);
+
+        _capacity = elem_cap;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::add(const T& x)
+    {
+        unsigned int val = _hash(x);
+        Index& slot = _slot(val);
+
+        if (_holds(slot, val))
+            return;
+
+        _emplace_at(slot, val, x);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::add(T&& x)
+    {
+        unsigned int val = _hash(x);
+        Index& slot = _slot(val);
+
+        if (_holds(slot, val))
+            return;
+
+        _emplace_at(slot, val, std::move(x));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename... Args>
+    void sparse_set<T, Hash, Policy, Index>::emplace(Args&&... args)
+    {
+        if (_n == _capacity)
+        {
+            T x(std::forward<Args>(args)...); // args may refer into the dense array growth is about to move
+            unsigned int val = _hash(x);
+            Index& slot = _slot(val);
+
+            if (_holds(slot, val))
+                return;
+
+            _reserve_one();
+            new (&_dense[_n]) T(std::move(x));
+            _link(slot, val);
+            return;
+        }
+
+        new (&_dense[_n]) T(std::forward<Args>(args)...); // built in the first free slot, dropped again if already present
+
+        if (search(_dense[_n]) != npos)
+        {
+            _dense[_n].~T();
+            return;
+        }
+
+        _push_back(_hash(_dense[_n]));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::add_concurrent(const T& x) // see _add_concurrent
+    {
+        static_assert(std::is_nothrow_copy_constructible<T>::value, "add_concurrent cannot give back a claimed slot");
+        _add_concurrent(x);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::add_concurrent(T&& x)
+    {
+        static_assert(std::is_nothrow_move_constructible<T>::value, "add_concurrent cannot give back a claimed slot");
+        _add_concurrent(std::move(x));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename It>
+    void sparse_set<T, Hash, Policy, Index>::add_range(It first, It last) // grows both sides once up front
+    {
+        _reserve_range(first, last, typename std::iterator_traits<It>::iterator_category());
+
+        for (; first != last; ++first)
+        {
+            unsigned int val = _hash(*first);
+            Index& slot = _slot(val);
+
+            if (!_holds(slot, val))
+                _emplace_at(slot, val, *first);
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_set<T, Hash, Policy, Index>::remove(const K& k) // any K the hash accepts, no T is constructed
+    {
+        Index idx = search(k);
+
+        if (idx == npos)
+            return;
+
+        _remove_at(idx, _hash(k));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename It>
+    void sparse_set<T, Hash, Policy, Index>::remove_range(It first, It last)
+    {
+        for (; first != last; ++first)
+            remove(*first);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_set<T, Hash, Policy, Index>::intersect(const Other& other) // other is any sparse_set or sparse_map over the same keys
+    {
+        for (Index i = _n; i-- > 0;) // swap-and-pop only pulls in elements already visited
+        {
+            if (!other.contains(_dense[i]))
+                _remove_at(i, _hash(_dense[i]));
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_set<T, Hash, Policy, Index>::unite(const Other& other)
+    {
+        if (static_cast<const void*>(&other) == this) // add_range would grow the array it reads from
+            return;
+
+        add_range(other.keys().begin(), other.keys().end());
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_set<T, Hash, Policy, Index>::subtract(const Other& other) // walks the smaller side
+    {
+        if (other.size() < _n)
+        {
+            for (const auto& k : other.keys())
+                remove(k);
+
+            return;
+        }
+
+        for (Index i = _n; i-- > 0;)
+        {
+            if (other.contains(_dense[i]))
+                _remove_at(i, _hash(_dense[i]));
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::swap_positions(Index i, Index j) // reorders the dense array, both must be below size()
+    {
+        if (i == j)
+            return;
+
+        using std::swap;
+        swap(_dense[i], _dense[j]);
+
+        if (Policy::validated)
+        {
+            swap(_keys[i], _keys[j]);
+            _slot(_keys[i]) = i;
+            _slot(_keys[j]) = j;
+        }
+        else
+        {
+            _slot(_hash(_dense[i])) = i;
+            _slot(_hash(_dense[j])) = j;
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename Compare>
+    void sparse_set<T, Hash, Policy, Index>::sort(Compare comp)
+    {
+        std::sort(_dense, _dense + _n, comp);
+        _relink();
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::sort_by_key() // ascending hash order, reproducible regardless of insertion history
+    {
+        using std::swap;
+        detail::permute(detail::radix_order<Index>(_hashes()), [this](Index i, Index j) { swap(_dense[i], _dense[j]); });
+        _relink();
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_set<T, Hash, Policy, Index>::sort_as(const Other& other) // keys other contains come first, in its order
+    {
+        Index pos = 0;
+
+        for (const auto& k : other.keys())
+        {
+            Index idx = search(k);
+            if (idx != npos)
+                swap_positions(idx, pos++);
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_relink() // points the sparse slot of every element back at its dense position
+    {
+        for (Index i = 0; i < _n; i++)
+        {
+            unsigned int val = _hash(_dense[i]);
+
+            if (Policy::validated)
+                _keys[i] = val;
+
+            _slot(val) = i;
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    std::vector<unsigned int> sparse_set<T, Hash, Policy, Index>::_hashes() const
+    {
+        std::vector<unsigned int> hashes(_n);
+
+        for (Index i = 0; i < _n; i++)
+            hashes[i] = Policy::validated ? _keys[i] : _hash(_dense[i]);
+
+        return hashes;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_remove_at(Index idx, unsigned int val) // val is the hash of the element at idx
+    {
+        if (idx != _n - 1)
+        {
+            _dense[idx] = std::move(_dense[_n - 1]);
+
+            if (Policy::validated)
+            {
+                _keys[idx] = _keys[_n - 1];
+                _slot(_keys[idx]) = idx;
+            }
+            else
+            {
+                _slot(_hash(_dense[idx])) = idx;
+            }
+        }
+
+        _dense[_n - 1].~T();
+
+        if (!Policy::validated)
+            _slot(val) = npos;
+
+        _n--;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Index sparse_set<T, Hash, Policy, Index>::search(const K& k) const // any K the hash accepts, no T is constructed
+    {
+        unsigned int val = _hash(k);
+        unsigned int page = val >> detail::page_bits;
+
+        if (page >= _page_count)
+            return npos;
+
+        Index idx = _pages[page][val & detail::page_mask];
+
+        if (Policy::validated)
+            return _holds(idx, val) ? idx : npos;
+
+        return idx;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    bool sparse_set<T, Hash, Policy, Index>::contains(const K& k) const
+    {
+        return search(k) != npos;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_set<T, Hash, Policy, Index>::search_many(const K* keys, std::size_t n, Index* out) const // search() for n keys, overlapping their cache misses
+    {
+        unsigned int vals[detail::batch_size];
+        const Index* slots[detail::batch_size];
+
+        for (std::size_t first = 0; first < n; first += detail::batch_size)
+        {
+            std::size_t m = std::min(n - first, detail::batch_size);
+
+            for (std::size_t j = 0; j < m; j++)
+            {
+                vals[j] = _hash(keys[first + j]);
+                unsigned int page = vals[j] >> detail::page_bits;
+                slots[j] = page < _page_count ? &_pages[page][vals[j] & detail::page_mask] : nullptr;
+
+                if (slots[j] != nullptr)
+                    detail::prefetch(slots[j]);
+            }
+
+            for (std::size_t j = 0; j < m; j++)
+            {
+                Index idx = slots[j] != nullptr ? *slots[j] : npos;
+
+                if (Policy::validated && idx < _n)
+                    detail::prefetch(&_keys[idx]);
+
+                out[first + j] = idx;
+            }
+
+            if (Policy::validated)
+            {
+                for (std::size_t j = 0; j < m; j++)
+                {
+                    if (!_holds(out[first + j], vals[j]))
+                        out[first + j] = npos;
+                }
+            }
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_set<T, Hash, Policy, Index>::contains_many(const K* keys, std::size_t n, bool* out) const
+    {
+#if defined(__AVX2__)
+        using vectorized = std::integral_constant<bool,
+                std::is_same<Hash, identity_hash>::value && std::is_same<K, unsigned int>::value && sizeof(Index) == 4>;
+#else
+        using vectorized = std::false_type;
+#endif
+
+        _contains_many(keys, n, out, vectorized());
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_set<T, Hash, Policy, Index>::_contains_many(const K* keys, std::size_t n, bool* out, std::false_type) const
+    {
+        Index idx[detail::batch_size];
+
+        for (std::size_t first = 0; first < n; first += detail::batch_size)
+        {
+            std::size_t m = std::min(n - first, detail::batch_size);
+            search_many(keys + first, m, idx);
+
+            for (std::size_t j = 0; j < m; j++)
+                out[first + j] = idx[j] != npos;
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_contains_many(const unsigned int* keys, std::size_t n, bool* out, std::true_type) const // four keys per step: gather page pointers, then slots
+    {
+#if defined(__AVX2__)
+        if (_n > static_cast<Index>(INT_MAX)) // dense positions are gathered as signed 32-bit offsets
+            return _contains_many(keys, n, out, std::false_type());
+
+        const __m128i page_count = _mm_set1_epi32(static_cast<int>(_page_count));
+        const __m128i page_mask = _mm_set1_epi32(static_cast<int>(detail::page_mask));
+        const __m128i sign = _mm_set1_epi32(INT_MIN);
+        const __m128i live = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(_n)), sign);
+        const __m128i not_found = _mm_set1_epi32(-1);
+
+        std::size_t i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i vals = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+            __m128i pages = _mm_srli_epi32(vals, detail::page_bits);
+            __m128i in_range = _mm_cmpgt_epi32(page_count, pages); // both below 2^21, signed compare is exact
+
+            __m256i page_ptrs = _mm256_mask_i32gather_epi64(_mm256_setzero_si256(), reinterpret_cast<const long long*>(_pages),
+                                                            _mm_and_si128(pages, in_range), _mm256_cvtepi32_epi64(in_range), sizeof(Index*));
+            __m256i slot_ptrs = _mm256_add_epi64(page_ptrs, _mm256_slli_epi64(_mm256_cvtepu32_epi64(_mm_and_si128(vals, page_mask)), 2));
+            __m128i idx = _mm256_mask_i64gather_epi32(not_found, static_cast<const int*>(nullptr), slot_ptrs, in_range, 1);
+
+            __m128i found;
+
+            if (Policy::validated)
+            {
+                __m128i valid = _mm_cmpgt_epi32(live, _mm_xor_si128(idx, sign)); // idx < _n, unsigned
+                __m128i stored = _mm_mask_i32gather_epi32(not_found, reinterpret_cast<const int*>(_keys), idx, valid, sizeof(unsigned int));
+                found = _mm_and_si128(valid, _mm_cmpeq_epi32(stored, vals));
+            }
+            else
+            {
+                found = _mm_andnot_si128(_mm_cmpeq_epi32(idx, not_found), in_range);
+            }
+
+            int bits = _mm_movemask_ps(_mm_castsi128_ps(found));
+
+            for (int j = 0; j < 4; j++)
+                out[i + j] = (bits >> j & 1) != 0;
+        }
+
+        _contains_many(keys + i, n - i, out + i, std::false_type());
+#else
+        _contains_many(keys, n, out, std::false_type());
+#endif
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::clear()
+    {
+        if (!Policy::validated)
+        {
+            for (Index i = 0; i < _n; i++)
+            {
+                _slot(_hash(_dense[i])) = npos;
+            }
+        }
+
+        detail::destroy(_dense, _dense + _n);
+        _n = 0;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    Index sparse_set<T, Hash, Policy, Index>::size() const
+    {
+        return _n;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    Index sparse_set<T, Hash, Policy, Index>::capacity() const
+    {
+        return _capacity;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    unsigned int sparse_set<T, Hash, Policy, Index>::key_capacity() const
+    {
+        return static_cast<unsigned int>(std::min<unsigned long long>(static_cast<unsigned long long>(_page_count) << detail::page_bits, UINT_MAX));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    T *sparse_set<T, Hash, Policy, Index>::data() // not allowed to change result of hash function
+    {
+        return _dense;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    const T *sparse_set<T, Hash, Policy, Index>::data() const // not allowed to change result of hash function
+    {
+        return _dense;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    span<const T> sparse_set<T, Hash, Policy, Index>::keys() const // the elements are the keys
+    {
+        return span<const T>(_dense, _n);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::iterator sparse_set<T, Hash, Policy, Index>::begin()
+    {
+        return _dense;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::const_iterator sparse_set<T, Hash, Policy, Index>::begin() const
+    {
+        return _dense;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::const_iterator sparse_set<T, Hash, Policy, Index>::cbegin() const
+    {
+        return _dense;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::iterator sparse_set<T, Hash, Policy, Index>::end()
+    {
+        return _dense + _n;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::const_iterator sparse_set<T, Hash, Policy, Index>::end() const
+    {
+        return _dense + _n;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::const_iterator sparse_set<T, Hash, Policy, Index>::cend() const
+    {
+        return _dense + _n;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::reverse_iterator sparse_set<T, Hash, Policy, Index>::rbegin()
+    {
+        return reverse_iterator(end());
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::const_reverse_iterator sparse_set<T, Hash, Policy, Index>::rbegin() const
+    {
+        return const_reverse_iterator(end());
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::reverse_iterator sparse_set<T, Hash, Policy, Index>::rend()
+    {
+        return reverse_iterator(begin());
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::const_reverse_iterator sparse_set<T, Hash, Policy, Index>::rend() const
+    {
+        return const_reverse_iterator(begin());
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_grow_pages(unsigned int page_count)
+    {
+        unsigned int new_count = 1;
+        while (new_count < page_count)
+            new_count <<= 1U;
+
+        auto new_pages = new Index*[new_count];
+        std::copy(_pages, _pages + _page_count, new_pages);
+        std::fill(new_pages + _page_count, new_pages + new_count, detail::invalid_page<Index>());
+        delete [] _pages;
+
+        _page_count = new_count;
+        _pages = new_pages;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_reserve_one()
+    {
+        if (_n < _capacity)
+            return;
+
+        if (_capacity == npos)
+            throw std::length_error("sparse_set index type exhausted.");
+
+        reserve_elements(detail::next_capacity(_n));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_push_back(unsigned int val) // links the element already stored at _dense[_n]
+    {
+        _link(_slot(val), val);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_link(Index& slot, unsigned int val) // slot is _slot(val), probed beforehand
+    {
+        if (Policy::validated)
+            _keys[_n] = val;
+
+        slot = _n;
+        _n++;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename... Args>
+    void sparse_set<T, Hash, Policy, Index>::_emplace_at(Index& slot, unsigned int val, Args&&... args) // slot stays valid, growth only moves the dense side
+    {
+        if (_n == _capacity)
+        {
+            T x(std::forward<Args>(args)...); // args may refer into the dense array growth is about to move
+            _reserve_one();
+            new (&_dense[_n]) T(std::move(x));
+        }
+        else
+        {
+            new (&_dense[_n]) T(std::forward<Args>(args)...);
+        }
+
+        _link(slot, val);
+    }
+
+    // Lock-free add from several threads at once. Nothing else may touch the set
+    // meanwhile, x must not be contained and no other thread may add the same key.
+    // reserve_keys() and reserve_elements() must already cover every key and
+    // element added; pages are still materialised on demand.
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename U>
+    void sparse_set<T, Hash, Policy, Index>::_add_concurrent(U&& x)
+    {
+        unsigned int val = _hash(x);
+        Index& slot = _slot_concurrent(val);
+        Index idx = _claim_concurrent();
+
+        new (&_dense[idx]) T(std::forward<U>(x));
+        _publish_concurrent(slot, val, idx);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    Index &sparse_set<T, Hash, Policy, Index>::_slot_concurrent(unsigned int val) // the first thread to install a page wins
+    {
+        unsigned int page = val >> detail::page_bits;
+
+        if (page >= _page_count)
+            throw std::length_error("sparse_set key outside the range reserved for concurrent adds.");
+
+        Index* p = detail::atomic_load_acquire(_pages[page]);
+
+        if (p == detail::invalid_page<Index>())
+        {
+            Index* fresh = new Index[detail::page_size];
+            if (!Policy::validated)
+                std::fill(fresh, fresh + detail::page_size, npos);
+
+            if (detail::atomic_compare_exchange(_pages[page], p, fresh))
+                p = fresh;
+            else
+                delete [] fresh;
+        }
+
+        return p[val & detail::page_mask];
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    Index sparse_set<T, Hash, Policy, Index>::_claim_concurrent() // a dense slot of its own for the calling thread
+    {
+        Index idx = detail::atomic_fetch_add(_n, Index(1));
+
+        if (idx >= _capacity)
+        {
+            detail::atomic_fetch_sub(_n, Index(1)); // _n never drops below the slots handed out
+            throw std::length_error("sparse_set capacity not reserved for concurrent adds.");
+        }
+
+        return idx;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_publish_concurrent(Index& slot, unsigned int val, Index idx) // after the dense side of idx is built
+    {
+        if (Policy::validated)
+            _keys[idx] = val;
+
+        detail::atomic_store_release(slot, idx);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename It>
+    void sparse_set<T, Hash, Policy, Index>::_reserve_range(It first, It last, std::forward_iterator_tag) // sized for the largest key and for every element being new
+    {
+        unsigned long long count = 0;
+        unsigned int max_val = 0;
+
+        for (; first != last; ++first, ++count)
+            max_val = std::max(max_val, static_cast<unsigned int>(_hash(*first)));
+
+        if (count == 0)
+            return;
+
+        unsigned int page = max_val >> detail::page_bits;
+        if (page >= _page_count)
+            _grow_pages(page + 1);
+
+        unsigned long long needed = _n + count;
+
+        if (needed > _capacity) // geometric, so repeated small ranges stay amortized
+            reserve_elements(static_cast<Index>(std::min<unsigned long long>(std::max<unsigned long long>(needed, detail::next_capacity(_capacity)), npos)));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename It>
+    void sparse_set<T, Hash, Policy, Index>::_reserve_range(It, It, std::input_iterator_tag) // single pass, grows as it goes
+    {
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    bool sparse_set<T, Hash, Policy, Index>::_holds(Index idx, unsigned int val) const // idx was read from the sparse slot of val
+    {
+        if (Policy::validated)
+            return idx < _n && _keys[idx] == val;
+
+        return idx != npos;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    Index &sparse_set<T, Hash, Policy, Index>::_slot(unsigned int val) // materialises the page holding val
+    {
+        unsigned int page = val >> detail::page_bits;
+
+        if (page >= _page_count)
+            _grow_pages(page + 1);
+
+        if (_pages[page] == detail::invalid_page<Index>())
+        {
+            _pages[page] = new Index[detail::page_size];
+            if (!Policy::validated)
+                std::fill(_pages[page], _pages[page] + detail::page_size, npos);
+        }
+
+        return _pages[page][val & detail::page_mask];
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void swap(sparse_set<T, Hash, Policy, Index>& lhs, sparse_set<T, Hash, Policy, Index>& rhs) noexcept
+    {
+        lhs.swap(rhs);
+    }
+
+    // Set algebra into a new set; b may be any sparse_set or sparse_map over the same keys.
+    template<typename T, typename Hash, typename Policy, typename Index, typename Other>
+    sparse_set<T, Hash, Policy, Index> intersect(const sparse_set<T, Hash, Policy, Index>& a, const Other& b) // walks the smaller side
+    {
+        sparse_set<T, Hash, Policy, Index> result;
+        result.reserve_elements(static_cast<Index>(std::min<std::size_t>(a.size(), b.size())));
+
+        if (b.size() < a.size())
+        {
+            for (const auto& k : b.keys())
+            {
+                auto idx = a.search(k);
+                if (idx != a.npos)
+                    result.add(a.data()[idx]);
+            }
+        }
+        else
+        {
+            for (const auto& x : a.keys())
+            {
+                if (b.contains(x))
+                    result.add(x);
+            }
+        }
+
+        return result;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index, typename Other>
+    sparse_set<T, Hash, Policy, Index> unite(const sparse_set<T, Hash, Policy, Index>& a, const Other& b)
+    {
+        auto result = a.clone();
+        result.unite(b);
+        return result;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index, typename Other>
+    sparse_set<T, Hash, Policy, Index> subtract(const sparse_set<T, Hash, Policy, Index>& a, const Other& b)
+    {
+        sparse_set<T, Hash, Policy, Index> result;
+        result.reserve_elements(a.size());
+
+        for (const auto& x : a.keys())
+        {
+            if (!b.contains(x))
+                result.add(x);
+        }
+
+        return result;
+    }
+
+}
+
+
+#endif //PSSET_SPARSE_SET_H
+//
+// Created by Pawel Boening on 31.08.18.
+//
+
+#ifndef PSSET_SPARSE_MAP_H
+#define PSSET_SPARSE_MAP_H
+
+
+
+#include <cstddef>
+#include <iterator>
+
+namespace psset
+{
+    template <typename K, typename  V>
+    struct KeyValue
+    {
+        K key;
+        V value;
+
+        template <typename K2, typename V2>
+        operator KeyValue<K2, V2>() const // copies out of the pairs a sparse_map iterator yields
+        {
+            return {key, value};
+        }
+    };
+
+    template <typename K, typename V>
+    KeyValue<K, V> make_keyvalue(K &key, V &value)
+    {
+        return {key, value};
+    }
+
+    // Walks the key and value columns of a sparse_map in lockstep, yielding
+    // KeyValue<const Key&, V&> pairs that refer into both columns. key() and
+    // value() project onto a single column. The reference is such a proxy, so
+    // auto kv = *it still refers into the map; value_type kv = *it copies.
+    template <typename Key, typename V>
+    class kv_iterator
+    {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = KeyValue<Key, typename std::remove_const<V>::type>;
+        using difference_type = std::ptrdiff_t;
+        using reference = KeyValue<const Key&, V&>;
+
+        class pointer // it->key and it->value on the pair the proxy refers to
+        {
+        public:
+            explicit pointer(reference kv) : _kv(kv) {}
+            const reference* operator->() const { return &_kv; }
+
+        private:
+            reference _kv;
+        };
+
+        kv_iterator() : _key(nullptr), _value(nullptr) {}
+        kv_iterator(const Key* key, V* value) : _key(key), _value(value) {}
+
+        template <typename W, typename = typename std::enable_if<std::is_convertible<W*, V*>::value>::type>
+        kv_iterator(const kv_iterator<Key, W>& it) : _key(it._key), _value(it._value) {}
+
+        reference operator*() const { return {*_key, *_value}; }
+        pointer operator->() const { return pointer(**this); }
+        reference operator[](difference_type n) const { return {_key[n], _value[n]}; }
+        const Key& key() const { return *_key; }
+        V& value() const { return *_value; }
+
+        kv_iterator& operator++() { ++_key; ++_value; return *this; }
+        kv_iterator operator++(int) { kv_iterator it = *this; ++*this; return it; }
+        kv_iterator& operator--() { --_key; --_value; return *this; }
+        kv_iterator operator--(int) { kv_iterator it = *this; --*this; return it; }
+        kv_iterator& operator+=(difference_type n) { _key += n; _value += n; return *this; }
+        kv_iterator& operator-=(difference_type n) { _key -= n; _value -= n; return *this; }
+        kv_iterator operator+(difference_type n) const { return kv_iterator(_key + n, _value + n); }
+        kv_iterator operator-(difference_type n) const { return kv_iterator(_key - n, _value - n); }
+        friend kv_iterator operator+(difference_type n, const kv_iterator& it) { return it + n; }
+        difference_type operator-(const kv_iterator& rhs) const { return _key - rhs._key; }
+
+        bool operator==(const kv_iterator& rhs) const { return _key == rhs._key; }
+        bool operator!=(const kv_iterator& rhs) const { return _key != rhs._key; }
+        bool operator<(const kv_iterator& rhs) const { return _key < rhs._key; }
+        bool operator>(const kv_iterator& rhs) const { return _key > rhs._key; }
+        bool operator<=(const kv_iterator& rhs) const { return _key <= rhs._key; }
+        bool operator>=(const kv_iterator& rhs) const { return _key >= rhs._key; }
+
+    private:
+        template <typename, typename>
+        friend class kv_iterator; // the converting constructor copies the pointers, end() must not be dereferenced
+
+        const Key* _key;
+        V* _value;
+    };
+
+    template <typename Key, typename Value, typename Hash, typename Policy = initialized_sparse, typename Index = unsigned int>
+    class sparse_map
+    {
+
+    public:
+        using key_type = Key;
+        using mapped_type = Value;
+        using index_type = Index;
+        static constexpr Index npos = std::numeric_limits<Index>::max();
+
+        explicit sparse_map(unsigned int cap = 0);
+        sparse_map(const sparse_map&) = delete;
+        sparse_map(sparse_map&& other) noexcept;
+        sparse_map& operator=(const sparse_map&) = delete;
+        sparse_map& operator=(sparse_map&& other) noexcept;
+        ~sparse_map();
+
+        void swap(sparse_map& other) noexcept;
+        sparse_map clone() const;
+
+        void resize(unsigned int new_cap);
+        void reserve_keys(unsigned int key_cap);
+        void reserve_elements(Index elem_cap);
+        void add(const Key& k, const Value& v);
+        void add(const Key& k, Value&& v);
+        template <typename... Args>
+        void emplace(const Key& k, Args&&... args);
+        void add_concurrent(const Key& k, const Value& v);
+        void add_concurrent(const Key& k, Value&& v);
+        template <typename KeyIt, typename ValueIt>
+        void add_range(KeyIt key_first, KeyIt key_last, ValueIt value_first);
+        template <typename K>
+        void remove(const K& k);
+        template <typename It>
+        void remove_range(It first, It last);
+        template <typename Other>
+        void intersect(const Other& other);
+        template <typename V, typename P, typename I>
+        void unite(const sparse_map<Key, V, Hash, P, I>& other);
+        template <typename Other>
+        void subtract(const Other& other);
+        void swap_positions(Index i, Index j);
+        template <typename Compare>
+        void sort(Compare comp);
+        void sort_by_key();
+        template <typename Other>
+        void sort_as(const Other& other);
+        template <typename K>
+        Index search(const K& k) const;
+        template <typename K>
+        bool contains(const K& k) const;
+        template <typename K>
+        Value& at(const K& k);
+        template <typename K>
+        const Value& at(const K& k) const;
+        template <typename K>
+        Value* find(const K& k);
+        template <typename K>
+        const Value* find(const K& k) const;
+        template <typename K>
+        void search_many(const K* keys, std::size_t n, Index* out) const;
+        template <typename K>
+        void contains_many(const K* keys, std::size_t n, bool* out) const;
+        template <typename K>
+        void find_many(const K* keys, std::size_t n, Value** out);
+        template <typename K>
+        void find_many(const K* keys, std::size_t n, const Value** out) const;
+        template <typename K>
+        Value fetch_add(const K& k, Value delta);
+        template <typename K>
+        Value fetch_sub(const K& k, Value delta);
+        template <typename K>
+        bool compare_exchange(const K& k, Value& expected, Value desired);
+        template <typename K>
+        Value atomic_load(const K& k) const;
+        template <typename K>
+        void atomic_store(const K& k, Value v);
+        template <typename... Args>
+        std::pair<Value&, bool> try_emplace(const Key& k, Args&&... args);
+        template <typename V>
+        std::pair<Value&, bool> insert_or_assign(const Key& k, V&& v);
+        template <typename... Args>
+        Value& get_or_insert(const Key& k, Args&&... args);
+        Value& operator[](const Key& k);
+        void clear();
+
+        Index size() const;
+        Index capacity() const;
+        unsigned int key_capacity() const;
+        span<const Key> keys() const;
+        span<Value> values();
+        span<const Value> values() const;
+
+        using iterator = kv_iterator<Key, Value>;
+        using const_iterator = kv_iterator<Key, const Value>;
+        using reverse_iterator = std::reverse_iterator<iterator>;
+        using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+        iterator begin();
+        const_iterator begin() const;
+        const_iterator cbegin() const;
+        iterator end();
+        const_iterator end() const;
+        const_iterator cend() const;
+        reverse_iterator rbegin();
+        const_reverse_iterator rbegin() const;
+        reverse_iterator rend();
+        const_reverse_iterator rend() const;
+
+    private:
+        static void _check_atomic();
+        static Value _fetch_add(Value& v, Value delta, std::true_type);
+        static Value _fetch_add(Value& v, Value delta, std::false_type);
+        static Value _fetch_sub(Value& v, Value delta, std::true_type);
+        static Value _fetch_sub(Value& v, Value delta, std::false_type);
+        void _sync_capacity();
+        void _remove_at(Index idx, unsigned int val);
+        void _permute(const std::vector<Index>& order);
+        template <typename... Args>
+        Value& _emplace_at(Index& slot, unsigned int val, const Key& k, Args&&... args);
+
+        sparse_set<Key, Hash, Policy, Index> _sset;
+        Index _capacity; // of the value column, follows _sset.capacity()
+        Value* _values;
+    };
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    constexpr Index sparse_map<Key, Value, Hash, Policy, Index>::npos;
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    sparse_map<Key, Value, Hash, Policy, Index>::sparse_map(unsigned int cap) : _sset(cap), _capacity(0), _values(nullptr)
+    {
+        _sync_capacity();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    sparse_map<Key, Value, Hash, Policy, Index>::sparse_map(sparse_map&& other) noexcept
+        : _sset(std::move(other._sset)), _capacity(other._capacity), _values(other._values)
+    {
+        other._capacity = 0;
+        other._values = nullptr;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    sparse_map<Key, Value, Hash, Policy, Index> &sparse_map<Key, Value, Hash, Policy, Index>::operator=(sparse_map&& other) noexcept
+    {
+        sparse_map tmp(std::move(other));
+        swap(tmp);
+        return *this;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::swap(sparse_map& other) noexcept
+    {
+        using std::swap;
+        _sset.swap(other._sset);
+        swap(_capacity, other._capacity);
+        swap(_values, other._values);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    sparse_map<Key, Value, Hash, Policy, Index> sparse_map<Key, Value, Hash, Policy, Index>::clone() const // copies the live elements only
+    {
+        sparse_map copy; // stays empty until both columns are complete
+        auto keys = _sset.clone(); // same dense order, so the value column lines up
+        Value* values = detail::allocate<Value>(keys.capacity());
+        Index i = 0;
+
+        try
+        {
+            for (; i < size(); i++)
+                new (&values[i]) Value(_values[i]);
+        }
+        catch (...)
+        {
+            detail::destroy(values, values + i);
+            detail::deallocate(values);
+            throw;
+        }
+
+        detail::deallocate(copy._values);
+        copy._sset = std::move(keys);
+        copy._values = values;
+        copy._capacity = copy._sset.capacity();
+
+        return copy;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    sparse_map<Key, Value, Hash, Policy, Index>::~sparse_map()
+    {
+        detail::destroy(_values, _values + size());
+        detail::deallocate(_values);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::resize(unsigned int new_cap)
+    {
+        _sset.resize(new_cap);
+        _sync_capacity();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::reserve_keys(unsigned int key_cap)
+    {
+        _sset.reserve_keys(key_cap);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::reserve_elements(Index elem_cap)
+    {
+        _sset.reserve_elements(elem_cap);
+        _sync_capacity();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::add(const Key& k, const Value& v)
+    {
+        emplace(k, v);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::add(const Key& k, Value&& v)
+    {
+        emplace(k, std::move(v));
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename... Args>
+    void sparse_map<Key, Value, Hash, Policy, Index>::emplace(const Key& k, Args&&... args)
+    {
+        try_emplace(k, std::forward<Args>(args)...);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::add_concurrent(const Key& k, const Value& v) // same contract as sparse_set::add_concurrent
+    {
+        static_assert(std::is_nothrow_copy_constructible<Key>::value && std::is_nothrow_copy_constructible<Value>::value,
+                      "add_concurrent cannot give back a claimed slot");
+
+        unsigned int val = _sset._hash(k);
+        Index& slot = _sset._slot_concurrent(val);
+        Index idx = _sset._claim_concurrent();
+
+        new (&_sset._dense[idx]) Key(k);
+        new (&_values[idx]) Value(v);
+        _sset._publish_concurrent(slot, val, idx);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::add_concurrent(const Key& k, Value&& v)
+    {
+        static_assert(std::is_nothrow_copy_constructible<Key>::value && std::is_nothrow_move_constructible<Value>::value,
+                      "add_concurrent cannot give back a claimed slot");
+
+        unsigned int val = _sset._hash(k);
+        Index& slot = _sset._slot_concurrent(val);
+        Index idx = _sset._claim_concurrent();
+
+        new (&_sset._dense[idx]) Key(k);
+        new (&_values[idx]) Value(std::move(v));
+        _sset._publish_concurrent(slot, val, idx);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename KeyIt, typename ValueIt>
+    void sparse_map<Key, Value, Hash, Policy, Index>::add_range(KeyIt key_first, KeyIt key_last, ValueIt value_first) // values of contained keys are skipped
+    {
+        _sset._reserve_range(key_first, key_last, typename std::iterator_traits<KeyIt>::iterator_category());
+        _sync_capacity();
+
+        for (; key_first != key_last; ++key_first, ++value_first)
+        {
+            unsigned int val = _sset._hash(*key_first);
+            Index& slot = _sset._slot(val);
+
+            if (!_sset._holds(slot, val))
+                _emplace_at(slot, val, *key_first, *value_first);
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_map<Key, Value, Hash, Policy, Index>::remove(const K& k)
+    {
+        auto idx = _sset.search(k);
+
+        if (idx == npos)
+            return;
+
+        _remove_at(idx, _sset._hash(k));
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename It>
+    void sparse_map<Key, Value, Hash, Policy, Index>::remove_range(It first, It last)
+    {
+        for (; first != last; ++first)
+            remove(*first);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_map<Key, Value, Hash, Policy, Index>::intersect(const Other& other) // keeps the entries whose key other contains
+    {
+        const Key* keys = _sset.data();
+
+        for (Index i = size(); i-- > 0;)
+        {
+            if (!other.contains(keys[i]))
+                _remove_at(i, _sset._hash(keys[i]));
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename V, typename P, typename I>
+    void sparse_map<Key, Value, Hash, Policy, Index>::unite(const sparse_map<Key, V, Hash, P, I>& other) // contained keys keep their value
+    {
+        if (static_cast<const void*>(&other) == this) // add_range would grow the columns it reads from
+            return;
+
+        add_range(other.keys().begin(), other.keys().end(), other.values().begin());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_map<Key, Value, Hash, Policy, Index>::subtract(const Other& other)
+    {
+        if (other.size() < size())
+        {
+            for (const auto& k : other.keys())
+                remove(k);
+
+            return;
+        }
+
+        const Key* keys = _sset.data();
+
+        for (Index i = size(); i-- > 0;)
+        {
+            if (other.contains(keys[i]))
+                _remove_at(i, _sset._hash(keys[i]));
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::swap_positions(Index i, Index j) // moves both columns, both must be below size()
+    {
+        if (i == j)
+            return;
+
+        using std::swap;
+        swap(_values[i], _values[j]);
+        _sset.swap_positions(i, j);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename Compare>
+    void sparse_map<Key, Value, Hash, Policy, Index>::sort(Compare comp) // comp orders keys, values follow them
+    {
+        std::vector<Index> order(size());
+        for (Index i = 0; i < size(); i++)
+            order[i] = i;
+
+        const Key* keys = _sset.data();
+        std::sort(order.begin(), order.end(), [&](Index a, Index b) { return comp(keys[a], keys[b]); });
+
+        _permute(order);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::sort_by_key() // ascending hash order, reproducible regardless of insertion history
+    {
+        _permute(detail::radix_order<Index>(_sset._hashes()));
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_map<Key, Value, Hash, Policy, Index>::sort_as(const Other& other) // keys other contains come first, in its order
+    {
+        Index pos = 0;
+
+        for (const auto& k : other.keys())
+        {
+            Index idx = search(k);
+            if (idx != npos)
+                swap_positions(idx, pos++);
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Index sparse_map<Key, Value, Hash, Policy, Index>::search(const K& k) const // hashes k directly, no Key or Value is constructed
+    {
+        return _sset.search(k);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    bool sparse_map<Key, Value, Hash, Policy, Index>::contains(const K& k) const
+    {
+        return _sset.search(k) != npos;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Value &sparse_map<Key, Value, Hash, Policy, Index>::at(const K& k)
+    {
+        auto idx = search(k);
+
+        if (idx >= size())
+            throw std::out_of_range("key not found in smap.");
+
+        return _values[idx];
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    const Value &sparse_map<Key, Value, Hash, Policy, Index>::at(const K& k) const
+    {
+        auto idx = search(k);
+
+        if (idx >= size())
+            throw std::out_of_range("key not found in smap.");
+
+        return _values[idx];
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Value *sparse_map<Key, Value, Hash, Policy, Index>::find(const K& k) // nullptr if k is not contained
+    {
+        auto idx = search(k);
+
+        return idx == npos ? nullptr : &_values[idx];
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    const Value *sparse_map<Key, Value, Hash, Policy, Index>::find(const K& k) const // nullptr if k is not contained
+    {
+        auto idx = search(k);
+
+        return idx == npos ? nullptr : &_values[idx];
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_map<Key, Value, Hash, Policy, Index>::search_many(const K* keys, std::size_t n, Index* out) const
+    {
+        _sset.search_many(keys, n, out);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_map<Key, Value, Hash, Policy, Index>::contains_many(const K* keys, std::size_t n, bool* out) const
+    {
+        _sset.contains_many(keys, n, out);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_map<Key, Value, Hash, Policy, Index>::find_many(const K* keys, std::size_t n, Value** out) // find() for n keys, prefetching the values of a batch before handing them out
+    {
+        Index idx[detail::batch_size];
+
+        for (std::size_t first = 0; first < n; first += detail::batch_size)
+        {
+            std::size_t m = std::min(n - first, detail::batch_size);
+            _sset.search_many(keys + first, m, idx);
+
+            for (std::size_t j = 0; j < m; j++)
+            {
+                if (idx[j] != npos)
+                    detail::prefetch(&_values[idx[j]]);
+            }
+
+            for (std::size_t j = 0; j < m; j++)
+                out[first + j] = idx[j] == npos ? nullptr : &_values[idx[j]];
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_map<Key, Value, Hash, Policy, Index>::find_many(const K* keys, std::size_t n, const Value** out) const
+    {
+        Index idx[detail::batch_size];
+
+        for (std::size_t first = 0; first < n; first += detail::batch_size)
+        {
+            std::size_t m = std::min(n - first, detail::batch_size);
+            _sset.search_many(keys + first, m, idx);
+
+            for (std::size_t j = 0; j < m; j++)
+            {
+                if (idx[j] != npos)
+                    detail::prefetch(&_values[idx[j]]);
+            }
+
+            for (std::size_t j = 0; j < m; j++)
+                out[first + j] = idx[j] == npos ? nullptr : &_values[idx[j]];
+        }
+    }
+
+    // Atomic updates of single values. They may run from any number of threads
+    // together with each other and with lookups, as long as no thread adds or
+    // removes keys meanwhile; every access to a value shared this way must go
+    // through them.
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::fetch_add(const K& k, Value delta) // relaxed, returns the previous value
+    {
+        static_assert(std::is_arithmetic<Value>::value && !std::is_same<Value, bool>::value, "fetch_add needs an arithmetic value type");
+        _check_atomic();
+
+        return _fetch_add(at(k), delta, std::is_integral<Value>());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::fetch_sub(const K& k, Value delta)
+    {
+        static_assert(std::is_arithmetic<Value>::value && !std::is_same<Value, bool>::value, "fetch_sub needs an arithmetic value type");
+        _check_atomic();
+
+        return _fetch_sub(at(k), delta, std::is_integral<Value>());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    bool sparse_map<Key, Value, Hash, Policy, Index>::compare_exchange(const K& k, Value& expected, Value desired) // compares the object representation
+    {
+        _check_atomic();
+        return detail::atomic_compare_exchange(at(k), expected, desired);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::atomic_load(const K& k) const
+    {
+        _check_atomic();
+        return detail::atomic_load_acquire(at(k));
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_map<Key, Value, Hash, Policy, Index>::atomic_store(const K& k, Value v)
+    {
+        _check_atomic();
+        detail::atomic_store_release(at(k), v);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::_check_atomic()
+    {
+        static_assert(std::is_trivially_copyable<Value>::value, "atomic updates need a trivially copyable value type");
+        static_assert(sizeof(Value) <= sizeof(unsigned long long) && (sizeof(Value) & (sizeof(Value) - 1)) == 0,
+                      "atomic updates need a value type of a lock-free size");
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::_fetch_add(Value& v, Value delta, std::true_type)
+    {
+        return detail::atomic_fetch_add(v, delta);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::_fetch_add(Value& v, Value delta, std::false_type) // floating point, retried until no other thread got in between
+    {
+        Value old = detail::atomic_load_acquire(v);
+
+        while (!detail::atomic_compare_exchange(v, old, static_cast<Value>(old + delta)))
+        {
+        }
+
+        return old;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::_fetch_sub(Value& v, Value delta, std::true_type)
+    {
+        return detail::atomic_fetch_sub(v, delta);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::_fetch_sub(Value& v, Value delta, std::false_type)
+    {
+        return _fetch_add(v, -delta, std::false_type());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename... Args>
+    std::pair<Value&, bool> sparse_map<Key, Value, Hash, Policy, Index>::try_emplace(const Key& k, Args&&... args) // args are left untouched if k is contained
+    {
+        unsigned int val = _sset._hash(k);
+        Index& slot = _sset._slot(val);
+
+        if (_sset._holds(slot, val))
+            return std::pair<Value&, bool>(_values[slot], false);
+
+        return std::pair<Value&, bool>(_emplace_at(slot, val, k, std::forward<Args>(args)...), true);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename V>
+    std::pair<Value&, bool> sparse_map<Key, Value, Hash, Policy, Index>::insert_or_assign(const Key& k, V&& v)
+    {
+        unsigned int val = _sset._hash(k);
+        Index& slot = _sset._slot(val);
+
+        if (_sset._holds(slot, val))
+        {
+            _values[slot] = std::forward<V>(v);
+            return std::pair<Value&, bool>(_values[slot], false);
+        }
+
+        return std::pair<Value&, bool>(_emplace_at(slot, val, k, std::forward<V>(v)), true);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename... Args>
+    Value &sparse_map<Key, Value, Hash, Policy, Index>::get_or_insert(const Key& k, Args&&... args)
+    {
+        return try_emplace(k, std::forward<Args>(args)...).first;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Value &sparse_map<Key, Value, Hash, Policy, Index>::operator[](const Key& k) // value-initializes missing entries
+    {
+        return try_emplace(k).first;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::clear()
+    {
+        detail::destroy(_values, _values + size());
+        _sset.clear();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Index sparse_map<Key, Value, Hash, Policy, Index>::size() const
+    {
+        return _sset.size();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Index sparse_map<Key, Value, Hash, Policy, Index>::capacity() const
+    {
+        return _sset.capacity();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    unsigned int sparse_map<Key, Value, Hash, Policy, Index>::key_capacity() const
+    {
+        return _sset.key_capacity();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    span<const Key> sparse_map<Key, Value, Hash, Policy, Index>::keys() const // not allowed to change result of hash function
+    {
+        return span<const Key>(_sset.data(), size());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    span<Value> sparse_map<Key, Value, Hash, Policy, Index>::values()
+    {
+        return span<Value>(_values, size());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    span<const Value> sparse_map<Key, Value, Hash, Policy, Index>::values() const
+    {
+        return span<const Value>(_values, size());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::iterator sparse_map<Key, Value, Hash, Policy, Index>::begin()
+    {
+        return iterator(_sset.data(), _values);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::const_iterator sparse_map<Key, Value, Hash, Policy, Index>::begin() const
+    {
+        return const_iterator(_sset.data(), _values);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::iterator sparse_map<Key, Value, Hash, Policy, Index>::end()
+    {
+        return iterator(_sset.data() + size(), _values + size());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::const_iterator sparse_map<Key, Value, Hash, Policy, Index>::end() const
+    {
+        return const_iterator(_sset.data() + size(), _values + size());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::const_iterator sparse_map<Key, Value, Hash, Policy, Index>::cbegin() const
+    {
+        return begin();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::const_iterator sparse_map<Key, Value, Hash, Policy, Index>::cend() const
+    {
+        return end();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::reverse_iterator sparse_map<Key, Value, Hash, Policy, Index>::rbegin()
+    {
+        return reverse_iterator(end());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::const_reverse_iterator sparse_map<Key, Value, Hash, Policy, Index>::rbegin() const
+    {
+        return const_reverse_iterator(end());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::reverse_iterator sparse_map<Key, Value, Hash, Policy, Index>::rend()
+    {
+        return reverse_iterator(begin());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::const_reverse_iterator sparse_map<Key, Value, Hash, Policy, Index>::rend() const
+    {
+        return const_reverse_iterator(begin());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::_sync_capacity()
+    {
+        if (_sset.capacity() == _capacity)
+            return;
+
+        detail::reallocate(_values, size(), _sset.capacity());
+        _capacity = _sset.capacity();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::_remove_at(Index idx, unsigned int val) // val is the hash of the key at idx
+    {
+        if (idx != size() - 1)
+            _values[idx] = std::move(_values[size() - 1]); // mirrors the swap-and-pop of the key set
+        _values[size() - 1].~Value();
+        _sset._remove_at(idx, val);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::_permute(const std::vector<Index>& order) // position i takes the entry at order[i]
+    {
+        using std::swap;
+        Key* keys = _sset._dense;
+
+        detail::permute(order, [&](Index i, Index j) {
+            swap(keys[i], keys[j]);
+            swap(_values[i], _values[j]);
+        });
+
+        _sset._relink();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename... Args>
+    Value &sparse_map<Key, Value, Hash, Policy, Index>::_emplace_at(Index& slot, unsigned int val, const Key& k, Args&&... args) // slot is the probed miss of k
+    {
+        if (size() == _capacity)
+        {
+            if (_capacity == npos)
+                throw std::length_error("sparse_map index type exhausted.");
+
+            Key key(k); // k and args may refer into the columns growth is about to move
+            Value value(std::forward<Args>(args)...);
+            reserve_elements(detail::next_capacity(size()));
+
+            return _emplace_at(slot, val, key, std::move(value));
+        }
+
+        Index idx = size();
+        new (&_values[idx]) Value(std::forward<Args>(args)...);
+
+        try
+        {
+            _sset._emplace_at(slot, val, k);
+        }
+        catch (...)
+        {
+            _values[idx].~Value();
+            throw;
+        }
+
+        return _values[idx];
+    }
+
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void swap(sparse_map<Key, Value, Hash, Policy, Index>& lhs, sparse_map<Key, Value, Hash, Policy, Index>& rhs) noexcept
+    {
+        lhs.swap(rhs);
+    }
+
+    // Set algebra into a new map. Values are taken from a; b may be any sparse_set or sparse_map over the same keys.
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index, typename Other>
+    sparse_map<Key, Value, Hash, Policy, Index> intersect(const sparse_map<Key, Value, Hash, Policy, Index>& a, const Other& b) // walks the smaller side
+    {
+        sparse_map<Key, Value, Hash, Policy, Index> result;
+        result.reserve_elements(static_cast<Index>(std::min<std::size_t>(a.size(), b.size())));
+
+        if (b.size() < a.size())
+        {
+            for (const auto& k : b.keys())
+            {
+                if (const Value* v = a.find(k))
+                    result.add(k, *v);
+            }
+        }
+        else
+        {
+            for (auto kv : a)
+            {
+                if (b.contains(kv.key))
+                    result.add(kv.key, kv.value);
+            }
+        }
+
+        return result;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index, typename V, typename P, typename I>
+    sparse_map<Key, Value, Hash, Policy, Index> unite(const sparse_map<Key, Value, Hash, Policy, Index>& a, const sparse_map<Key, V, Hash, P, I>& b)
+    {
+        auto result = a.clone();
+        result.unite(b);
+        return result;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index, typename Other>
+    sparse_map<Key, Value, Hash, Policy, Index> subtract(const sparse_map<Key, Value, Hash, Policy, Index>& a, const Other& b)
+    {
+        sparse_map<Key, Value, Hash, Policy, Index> result;
+        result.reserve_elements(a.size());
+
+        for (auto kv : a)
+        {
+            if (!b.contains(kv.key))
+                result.add(kv.key, kv.value);
+        }
+
+        return result;
+    }
+
+}
+
+
+#endif //PSSET_SPARSE_MAP_H
+//
+// Created by Pawel Boening on 2019-02-10.
+//
+
+#ifndef PSSET_SPARSE_FACTORY_H
+#define PSSET_SPARSE_FACTORY_H
+
+
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace psset
+{
+
+    namespace detail
+    {
+        // Handles a thread moves between its cache and the global free list at once.
+        const unsigned int handle_batch = 64;
+
+        // Ids that tell apart objects reusing a local_slot.
+        inline unsigned long instance_id()
+        {
+            static std::atomic<unsigned long> next(1);
+            return next.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Gives a live object a small number of its own, reused once it dies, at
+        // which every thread files its state for that object. A thread's table
+        // grows to the most objects alive at once and never evicts; the id tells
+        // an entry left by a dead object from one of the current holder.
+        class local_slot
+        {
+        public:
+            local_slot();
+            local_slot(const local_slot&) = delete;
+            local_slot& operator=(const local_slot&) = delete;
+            ~local_slot();
+
+            void* find() const; // the calling thread's entry, nullptr before insert()
+            void insert(void* entry) const;
+
+        private:
+            struct entry
+            {
+                unsigned long id;
+                void* value;
+            };
+
+            struct registry
+            {
+                std::mutex m;
+                std::vector<std::size_t> unused;
+                std::size_t count = 0;
+            };
+
+            static registry& _registry();
+            static std::vector<entry>& _entries();
+
+            std::size_t _index;
+            unsigned long _id;
+        };
+
+        inline local_slot::local_slot() : _id(instance_id())
+        {
+            registry& r = _registry();
+            std::lock_guard<std::mutex> lock(r.m);
+
+            if (r.unused.empty())
+            {
+                _index = r.count++;
+                return;
+            }
+
+            _index = r.unused.back();
+            r.unused.pop_back();
+        }
+
+        inline local_slot::~local_slot()
+        {
+            registry& r = _registry();
+            std::lock_guard<std::mutex> lock(r.m);
+            r.unused.push_back(_index);
+        }
+
+        inline void *local_slot::find() const
+        {
+            const std::vector<entry>& entries = _entries();
+
+            if (_index < entries.size() && entries[_index].id == _id)
+                return entries[_index].value;
+
+            return nullptr;
+        }
+
+        inline void local_slot::insert(void* value) const
+        {
+            std::vector<entry>& entries = _entries();
+
+            if (_index >= entries.size())
+                entries.resize(_index + 1, entry{0, nullptr});
+
+            entries[_index] = entry{_id, value};
+        }
+
+        inline local_slot::registry &local_slot::_registry()
+        {
+            static registry r;
+            return r;
+        }
+
+        inline std::vector<local_slot::entry> &local_slot::_entries()
+        {
+            static thread_local std::vector<entry> entries;
+            return entries;
+        }
+    }
+
+    // Hands out handles to any number of threads at once. A thread works from a
+    // cache of its own: handles it released, then a batch taken from the global
+    // free list, then a block of fresh indices. The free list is a lock-free
+    // stack of batches whose head carries a tag against ABA. acquire() and
+    // release() serve the one thread that owns the allocator from a cache held
+    // in the allocator itself, without a thread-local lookup.
+    class handle_allocator
+    {
+    public:
+        using handle = unsigned long;
+
+        handle_allocator();
+        handle_allocator(const handle_allocator&) = delete;
+        handle_allocator& operator=(const handle_allocator&) = delete;
+        ~handle_allocator();
+
+        // Owner thread only, never while another thread calls the _concurrent ones.
+        handle acquire();
+        void release(handle h);
+
+        // Any number of threads at once.
+        handle acquire_concurrent();
+        void release_concurrent(handle h);
+
+        // At a sync point only.
+        void flush();
+
+        handle bound() const;
+        std::size_t caches() const;
+
+    private:
+        struct node
+        {
+            handle handles[detail::handle_batch];
+            unsigned int count;
+            std::atomic<unsigned int> next;
+        };
+
+        struct cache
+        {
+            std::vector<handle> recycled;
+            handle fresh = 0;
+            handle fresh_end = 0;
+        };
+
+        // Node chunk c holds 2^c * first_chunk nodes, so a few chunks cover any count.
+        static const unsigned int first_chunk_bits = 6;
+        static const unsigned int chunk_count = 32 - first_chunk_bits;
+
+        cache& _local();
+        handle _acquire(cache& c);
+        void _release(cache& c, handle h);
+        void _drain(cache& c);
+        void _give_back(handle* first, unsigned int count);
+        unsigned int _pop(std::atomic<unsigned long long>& head);
+        void _push(std::atomic<unsigned long long>& head, unsigned int n);
+        unsigned int _new_node();
+        node& _node(unsigned int n);
+
+        std::atomic<handle> _next; // first index never handed out
+        std::atomic<unsigned long long> _full; // batches of released handles, tag << 32 | node
+        std::atomic<unsigned long long> _empty; // nodes to reuse
+        std::atomic<unsigned int> _node_count;
+        std::atomic<node*> _chunks[chunk_count];
+
+        cache _owner;
+        detail::local_slot _slot; // where threads keep their cache for this allocator
+        mutable std::mutex _m; // guards _caches while a thread registers its cache
+        std::vector<std::unique_ptr<cache>> _caches;
+    };
+
+    inline handle_allocator::handle_allocator()
+        : _next(0), _full(0), _empty(0), _node_count(0)
+    {
+        for (auto& chunk : _chunks)
+            chunk.store(nullptr, std::memory_order_relaxed);
+    }
+
+    inline handle_allocator::~handle_allocator()
+    {
+        for (auto& chunk : _chunks)
+            delete [] chunk.load(std::memory_order_relaxed);
+    }
+
+    inline handle_allocator::handle handle_allocator::acquire()
+    {
+        return _acquire(_owner);
+    }
+
+    inline void handle_allocator::release(handle h)
+    {
+        _release(_owner, h);
+    }
+
+    inline handle_allocator::handle handle_allocator::acquire_concurrent()
+    {
+        return _acquire(_local());
+    }
+
+    inline void handle_allocator::release_concurrent(handle h)
+    {
+        _release(_local(), h);
+    }
+
+    inline void handle_allocator::flush() // empties every cache into the global free list
+    {
+        std::lock_guard<std::mutex> lock(_m);
+
+        _drain(_owner);
+        for (auto& c : _caches)
+            _drain(*c);
+    }
+
+    inline handle_allocator::handle handle_allocator::bound() const // no handle has an index at or above this one
+    {
+        return _next.load(std::memory_order_relaxed);
+    }
+
+    inline std::size_t handle_allocator::caches() const // threads that used the allocator concurrently so far
+    {
+        std::lock_guard<std::mutex> lock(_m);
+        return _caches.size();
+    }
+
+    inline handle_allocator::cache &handle_allocator::_local() // the calling thread's cache, registered on first use
+    {
+        if (void* c = _slot.find())
+            return *static_cast<cache*>(c);
+
+        cache* c;
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _caches.emplace_back(new cache);
+            c = _caches.back().get();
+        }
+
+        _slot.insert(c);
+        return *c;
+    }
+
+    inline handle_allocator::handle handle_allocator::_acquire(cache& c)
+    {
+        if (c.recycled.empty())
+        {
+            unsigned int n = _pop(_full);
+
+            if (n != 0)
+            {
+                node& batch = _node(n);
+                c.recycled.assign(batch.handles, batch.handles + batch.count);
+                _push(_empty, n);
+            }
+        }
+
+        if (!c.recycled.empty())
+        {
+            handle h = c.recycled.back();
+            c.recycled.pop_back();
+            return h;
+        }
+
+        if (c.fresh == c.fresh_end)
+        {
+            c.fresh = _next.fetch_add(detail::handle_batch, std::memory_order_relaxed);
+            c.fresh_end = c.fresh + detail::handle_batch;
+        }
+
+        return c.fresh++;
+    }
+
+    inline void handle_allocator::_release(cache& c, handle h) // a full cache passes a batch on to the global free list
+    {
+        c.recycled.push_back(h);
+
+        if (c.recycled.size() >= 2 * detail::handle_batch)
+        {
+            _give_back(c.recycled.data() + c.recycled.size() - detail::handle_batch, detail::handle_batch);
+            c.recycled.resize(c.recycled.size() - detail::handle_batch);
+        }
+    }
+
+    inline void handle_allocator::_drain(cache& c)
+    {
+        for (; c.fresh != c.fresh_end; c.fresh++)
+            c.recycled.push_back(c.fresh);
+
+        for (std::size_t i = 0; i < c.recycled.size(); i += detail::handle_batch)
+            _give_back(c.recycled.data() + i, static_cast<unsigned int>(std::min<std::size_t>(detail::handle_batch, c.recycled.size() - i)));
+
+        c.recycled.clear();
+    }
+
+    inline void handle_allocator::_give_back(handle* first, unsigned int count)
+    {
+        unsigned int n = _pop(_empty);
+        if (n == 0)
+            n = _new_node();
+
+        node& batch = _node(n);
+        std::copy(first, first + count, batch.handles);
+        batch.count = count;
+
+        _push(_full, n);
+    }
+
+    inline unsigned int handle_allocator::_pop(std::atomic<unsigned long long>& head) // 0 if the list is empty
+    {
+        unsigned long long h = head.load(std::memory_order_acquire);
+
+        for (;;)
+        {
+            auto n = static_cast<unsigned int>(h);
+            if (n == 0)
+                return 0;
+
+            unsigned long long next = _node(n).next.load(std::memory_order_relaxed); // stale if n moved on, the tag fails the exchange then
+            if (head.compare_exchange_weak(h, ((h >> 32U) + 1) << 32U | next, std::memory_order_acquire, std::memory_order_acquire))
+                return n;
+        }
+    }
+
+    inline void handle_allocator::_push(std::atomic<unsigned long long>& head, unsigned int n)
+    {
+        unsigned long long h = head.load(std::memory_order_relaxed);
+
+        for (;;)
+        {
+            _node(n).next.store(static_cast<unsigned int>(h), std::memory_order_relaxed);
+            if (head.compare_exchange_weak(h, ((h >> 32U) + 1) << 32U | n, std::memory_order_release, std::memory_order_relaxed))
+                return;
+        }
+    }
+
+    inline unsigned int handle_allocator::_new_node() // node numbers start at 1, 0 ends a list
+    {
+        unsigned int n = _node_count.fetch_add(1, std::memory_order_relaxed) + 1;
+        unsigned int pos = n + (1U << first_chunk_bits) - 1;
+
+        unsigned int c = 0;
+        while ((pos >> (c + first_chunk_bits + 1)) != 0)
+            c++;
+
+        if (_chunks[c].load(std::memory_order_acquire) == nullptr)
+        {
+            node* fresh = new node[std::size_t(1) << (c + first_chunk_bits)];
+            node* expected = nullptr;
+
+            if (!_chunks[c].compare_exchange_strong(expected, fresh, std::memory_order_acq_rel))
+                delete [] fresh;
+        }
+
+        return n;
+    }
+
+    inline handle_allocator::node &handle_allocator::_node(unsigned int n)
+    {
+        unsigned int pos = n + (1U << first_chunk_bits) - 1;
+
+        unsigned int c = 0;
+        while ((pos >> (c + first_chunk_bits + 1)) != 0)
+            c++;
+
+        return _chunks[c].load(std::memory_order_acquire)[pos - (1U << (c + first_chunk_bits))];
+    }
+    template<typename Value, typename Index = unsigned int>
+    class sparse_factory
+    {
+    public:
+        using ValueId = unsigned long;
+
+        struct ValueIdHash
+        {
+            unsigned int operator()(ValueId const &e) const
+            {
+                return e & 0x00000000FFFFFFFF;
+            }
+        };
+
+    public:
+        sparse_factory();
+
+        ValueId create();
+        ValueId create_concurrent();
+        void reserve(Index n, unsigned int threads = std::thread::hardware_concurrency());
+        const Value &at(ValueId p) const;
+        Value &at(ValueId p);
+        bool exists(ValueId p) const;
+        void remove(ValueId p);
+
+        Index size() const;
+
+        using iterator = typename psset::sparse_map<ValueId, Value, ValueIdHash, initialized_sparse, Index>::iterator;
+        using const_iterator = typename psset::sparse_map<ValueId, Value, ValueIdHash, initialized_sparse, Index>::const_iterator;
+        iterator begin();
+        iterator end();
+        const_iterator begin() const;
+        const_iterator end() const;
+
+    private:
+        ValueId _inc_version(ValueId e) const;
+
+        std::unique_ptr<handle_allocator> _handles; // held by pointer, threads cache its address
+        psset::sparse_map<ValueId, Value, ValueIdHash, initialized_sparse, Index> _used;
+    };
+
+    template<typename Value, typename Index>
+    sparse_factory<Value, Index>::sparse_factory() : _handles(new handle_allocator)
+    {
+    }
+
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::ValueId sparse_factory<Value, Index>::create()
+    {
+        ValueId value_id = _handles->acquire();
+
+        try
+        {
+            _used.add(value_id, Value());
+        }
+        catch (...)
+        {
+            _handles->release(value_id);
+            throw;
+        }
+
+        return value_id;
+    }
+
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::ValueId sparse_factory<Value, Index>::create_concurrent() // any number of threads at once, after reserve()
+    {
+        ValueId value_id = _handles->acquire_concurrent();
+
+        try
+        {
+            _used.add_concurrent(value_id, Value());
+        }
+        catch (...)
+        {
+            _handles->release_concurrent(value_id);
+            throw;
+        }
+
+        return value_id;
+    }
+
+    template<typename Value, typename Index>
+    void sparse_factory<Value, Index>::reserve(Index n, unsigned int threads) // room for n more create_concurrent() calls from up to threads threads
+    {
+        // Every thread may leave most of a block of fresh indices unused.
+        unsigned long long callers = std::max<unsigned long long>(std::max<unsigned long long>(threads, _handles->caches()), 1);
+        unsigned long long slack = static_cast<unsigned long long>(detail::handle_batch) * callers;
+        unsigned long long key_cap = _handles->bound() + n + slack;
+
+        _handles->flush(); // released handles come back before fresh blocks are cut
+        _used.reserve_keys(static_cast<unsigned int>(std::min<unsigned long long>(key_cap, UINT_MAX)));
+        _used.reserve_elements(static_cast<Index>(std::min<unsigned long long>(static_cast<unsigned long long>(_used.size()) + n, _used.npos)));
+    }
+
+    template<typename Value, typename Index>
+    const Value &sparse_factory<Value, Index>::at(sparse_factory::ValueId p) const
+    {
+        return _used.at(p);
+    }
+
+    template<typename Value, typename Index>
+    Value &sparse_factory<Value, Index>::at(sparse_factory::ValueId p)
+    {
+        return _used.at(p);
+    }
+
+    template<typename Value, typename Index>
+    bool sparse_factory<Value, Index>::exists(sparse_factory::ValueId p) const
+    {
+        auto idx = _used.search(p);
+
+        if (idx >= _used.size())
+            return false;
+
+        return _used.keys()[idx] == p;
+    }
+
+    template<typename Value, typename Index>
+    void sparse_factory<Value, Index>::remove(sparse_factory::ValueId p)
+    {
+        if (exists(p))
+        {
+            _used.remove(p);
+            _handles->release(_inc_version(p));
+        }
+    }
+
+    template<typename Value, typename Index>
+    Index sparse_factory<Value, Index>::size() const
+    {
+        return _used.size();
+    }
+
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::iterator sparse_factory<Value, Index>::begin()
+    {
+        return _used.begin();
+    }
+
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::iterator sparse_factory<Value, Index>::end()
+    {
+        return _used.end();
+    }
+
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::const_iterator sparse_factory<Value, Index>::begin() const
+    {
+        return _used.begin();
+    }
+
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::const_iterator sparse_factory<Value, Index>::end() const
+    {
+        return _used.end();
+    }
+
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::ValueId sparse_factory<Value, Index>::_inc_version(typename sparse_factory<Value, Index>::ValueId p) const
+    {
+        return (p & 0x00000000FFFFFFFF) | ((p + 0x0000000100000000) & 0xFFFFFFFF00000000);
+    }
+
+}
+
+
+#endif //PSSET_SPARSE_FACTORY_H
+//
+// Join views over several sparse_maps sharing a key space.
+//
+
+#ifndef PSSET_SPARSE_VIEW_H
+#define PSSET_SPARSE_VIEW_H
+
+
+
+#include <cstddef>
+#include <iterator>
+#include <tuple>
+
+namespace psset
+{
+
+    namespace detail
+    {
+        template <std::size_t... I>
+        struct index_sequence {};
+
+        template <std::size_t N, std::size_t... I>
+        struct make_index_sequence : make_index_sequence<N - 1, N - 1, I...> {};
+
+        template <std::size_t... I>
+        struct make_index_sequence<0, I...> : index_sequence<I...> {};
+
+        // Value type of a pool as seen through the view, const if the pool is.
+        template <typename Map>
+        using pool_value_t = typename std::conditional<std::is_const<Map>::value,
+                const typename Map::mapped_type, typename Map::mapped_type>::type;
+
+        template <typename Map, typename... Maps>
+        struct first_pool
+        {
+            using type = Map;
+        };
+    }
+
+    // Tags the types of the pools whose keys are filtered out of a view.
+    template <typename... Pools>
+    struct exclude_t {};
+
+    template <typename Exclude, typename... Maps>
+    class view;
+
+    // Visits every key contained in all of Maps and in none of the excluded pools.
+    // The smallest map drives the walk and the others are probed; maps must not
+    // gain or lose keys while a walk is in progress.
+    template <typename... Excluded, typename... Maps>
+    class view<exclude_t<Excluded...>, Maps...>
+    {
+        static_assert(sizeof...(Maps) > 0, "a view needs at least one map");
+
+        using pools_seq = detail::make_index_sequence<sizeof...(Maps)>;
+        using excluded_seq = detail::make_index_sequence<sizeof...(Excluded)>;
+        using pointers = std::tuple<detail::pool_value_t<Maps>*...>;
+
+    public:
+        using key_type = typename detail::first_pool<Maps...>::type::key_type;
+        using value_type = std::tuple<const key_type&, detail::pool_value_t<Maps>&...>;
+
+        class iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = typename view::value_type;
+            using difference_type = std::ptrdiff_t;
+            using pointer = void;
+            using reference = value_type;
+
+            iterator(const view* v, std::size_t driver, span<const key_type> keys, std::size_t i)
+                : _view(v), _driver(driver), _keys(keys), _i(i)
+            {
+                _seek();
+            }
+
+            reference operator*() const { return _deref(pools_seq()); }
+            iterator& operator++() { ++_i; _seek(); return *this; }
+            iterator operator++(int) { iterator it = *this; ++*this; return it; }
+            bool operator==(const iterator& rhs) const { return _i == rhs._i; }
+            bool operator!=(const iterator& rhs) const { return _i != rhs._i; }
+
+        private:
+            void _seek()
+            {
+                while (_i < _keys.size() && !_view->_match(_keys[_i], _i, _driver, _ptrs, pools_seq()))
+                    ++_i;
+            }
+
+            template <std::size_t... I>
+            reference _deref(detail::index_sequence<I...>) const
+            {
+                return reference(_keys[_i], *std::get<I>(_ptrs)...);
+            }
+
+            const view* _view;
+            std::size_t _driver;
+            span<const key_type> _keys;
+            std::size_t _i;
+            pointers _ptrs;
+        };
+
+        explicit view(Maps&... maps, const Excluded&... excluded);
+
+        template <typename... More>
+        view<exclude_t<Excluded..., More...>, Maps...> exclude(const More&... pools) const;
+
+        template <typename F>
+        void each(F f) const;
+        template <typename F>
+        void each(F f, std::size_t first, std::size_t last) const;
+
+        std::size_t size_hint() const;
+
+        iterator begin() const;
+        iterator end() const;
+
+    private:
+        template <std::size_t... I, typename... More, std::size_t... J>
+        view<exclude_t<Excluded..., More...>, Maps...> _exclude(detail::index_sequence<I...>, detail::index_sequence<J...>,
+                                                                 const More&... pools) const;
+        template <typename F, std::size_t... I>
+        void _each(F& f, std::size_t first, std::size_t last, detail::index_sequence<I...>) const;
+        template <std::size_t... I>
+        std::size_t _driver(detail::index_sequence<I...>) const;
+        template <std::size_t... I>
+        span<const key_type> _keys(std::size_t driver, detail::index_sequence<I...>) const;
+        template <std::size_t... I>
+        bool _match(const key_type& k, std::size_t i, std::size_t driver, pointers& ptrs, detail::index_sequence<I...>) const;
+        template <std::size_t... J>
+        bool _excluded(const key_type& k, detail::index_sequence<J...>) const;
+        template <std::size_t I>
+        typename std::tuple_element<I, pointers>::type _fetch(const key_type& k, std::size_t i, std::size_t driver) const;
+
+        std::tuple<Maps&...> _pools;
+        std::tuple<const Excluded&...> _exclude_pools;
+    };
+
+    template <typename... Excluded, typename... Maps>
+    view<exclude_t<Excluded...>, Maps...>::view(Maps&... maps, const Excluded&... excluded)
+        : _pools(maps...), _exclude_pools(excluded...)
+    {
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <typename... More>
+    view<exclude_t<Excluded..., More...>, Maps...> view<exclude_t<Excluded...>, Maps...>::exclude(const More&... pools) const // any sparse_set or sparse_map over the same keys
+    {
+        return _exclude(pools_seq(), excluded_seq(), pools...);
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <std::size_t... I, typename... More, std::size_t... J>
+    view<exclude_t<Excluded..., More...>, Maps...> view<exclude_t<Excluded...>, Maps...>::_exclude(detail::index_sequence<I...>, detail::index_sequence<J...>,
+                                                                                                    const More&... pools) const
+    {
+        return view<exclude_t<Excluded..., More...>, Maps...>(std::get<I>(_pools)..., std::get<J>(_exclude_pools)..., pools...);
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <typename F>
+    void view<exclude_t<Excluded...>, Maps...>::each(F f) const // f(key, values...), one reference per map
+    {
+        _each(f, 0, size_hint(), pools_seq());
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <typename F>
+    void view<exclude_t<Excluded...>, Maps...>::each(F f, std::size_t first, std::size_t last) const // only positions [first, last) of the driving map
+    {
+        _each(f, first, last, pools_seq());
+    }
+
+    template <typename... Excluded, typename... Maps>
+    std::size_t view<exclude_t<Excluded...>, Maps...>::size_hint() const // upper bound, the size of the driving map
+    {
+        return _keys(_driver(pools_seq()), pools_seq()).size();
+    }
+
+    template <typename... Excluded, typename... Maps>
+    typename view<exclude_t<Excluded...>, Maps...>::iterator view<exclude_t<Excluded...>, Maps...>::begin() const
+    {
+        std::size_t driver = _driver(pools_seq());
+        return iterator(this, driver, _keys(driver, pools_seq()), 0);
+    }
+
+    template <typename... Excluded, typename... Maps>
+    typename view<exclude_t<Excluded...>, Maps...>::iterator view<exclude_t<Excluded...>, Maps...>::end() const
+    {
+        std::size_t driver = _driver(pools_seq());
+        span<const key_type> keys = _keys(driver, pools_seq());
+        return iterator(this, driver, keys, keys.size());
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <typename F, std::size_t... I>
+    void view<exclude_t<Excluded...>, Maps...>::_each(F& f, std::size_t first, std::size_t last, detail::index_sequence<I...> seq) const
+    {
+        std::size_t driver = _driver(seq);
+        span<const key_type> keys = _keys(driver, seq);
+        pointers ptrs;
+
+        last = std::min(last, keys.size());
+
+        for (std::size_t i = first; i < last; i++)
+        {
+            if (_match(keys[i], i, driver, ptrs, seq))
+                f(keys[i], *std::get<I>(ptrs)...);
+        }
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <std::size_t... I>
+    std::size_t view<exclude_t<Excluded...>, Maps...>::_driver(detail::index_sequence<I...>) const // position of the smallest map
+    {
+        const std::size_t sizes[] = {static_cast<std::size_t>(std::get<I>(_pools).size())...};
+        return static_cast<std::size_t>(std::min_element(sizes, sizes + sizeof...(I)) - sizes);
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <std::size_t... I>
+    span<const typename view<exclude_t<Excluded...>, Maps...>::key_type> view<exclude_t<Excluded...>, Maps...>::_keys(std::size_t driver, detail::index_sequence<I...>) const
+    {
+        const span<const key_type> keys[] = {std::get<I>(_pools).keys()...};
+        return keys[driver];
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <std::size_t... I>
+    bool view<exclude_t<Excluded...>, Maps...>::_match(const key_type& k, std::size_t i, std::size_t driver, pointers& ptrs, detail::index_sequence<I...>) const // stops probing at the first miss
+    {
+        bool found = true;
+        const int expand[] = {0, (found = found && (std::get<I>(ptrs) = _fetch<I>(k, i, driver)) != nullptr, 0)...};
+        (void) expand;
+
+        return found && !_excluded(k, excluded_seq());
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <std::size_t... J>
+    bool view<exclude_t<Excluded...>, Maps...>::_excluded(const key_type& k, detail::index_sequence<J...>) const
+    {
+        bool hit = false;
+        const int expand[] = {0, (hit = hit || std::get<J>(_exclude_pools).contains(k), 0)...};
+        (void) expand;
+
+        return hit;
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <std::size_t I>
+    typename std::tuple_element<I, typename view<exclude_t<Excluded...>, Maps...>::pointers>::type
+    view<exclude_t<Excluded...>, Maps...>::_fetch(const key_type& k, std::size_t i, std::size_t driver) const // the driving map is read by position, the others are probed
+    {
+        auto& pool = std::get<I>(_pools);
+        return I == driver ? &pool.values()[i] : pool.find(k);
+    }
+
+    template <typename Map, typename... Maps>
+    view<exclude_t<>, Map, Maps...> make_view(Map& map, Maps&... maps)
+    {
+        return view<exclude_t<>, Map, Maps...>(map, maps...);
+    }
+
+}
+
+
+#endif //PSSET_SPARSE_VIEW_H
+//
+// Owning groups that keep several sparse_maps co-packed.
+//
+
+#ifndef PSSET_SPARSE_GROUP_H
+#define PSSET_SPARSE_GROUP_H
+
+
+
+#include <cstddef>
+#include <tuple>
+#include <utility>
+
+namespace psset
+{
+
+    // Keeps the keys contained in all of Maps at the front of every map, in the
+    // same order, so that position i < size() refers to the same key in each of
+    // them. While grouped, keys must be added to and removed from the maps
+    // through the group; it only ever reorders them with swap_positions().
+    template <typename... Maps>
+    class group
+    {
+        static_assert(sizeof...(Maps) > 1, "a group needs at least two maps");
+
+        using pools_seq = detail::make_index_sequence<sizeof...(Maps)>;
+
+    public:
+        using key_type = typename detail::first_pool<Maps...>::type::key_type;
+
+        template <std::size_t I>
+        using mapped_type = typename std::tuple_element<I, std::tuple<Maps...>>::type::mapped_type;
+
+        explicit group(Maps&... maps);
+
+        template <std::size_t I, typename... Args>
+        void add(const key_type& k, Args&&... args);
+        template <std::size_t I>
+        void remove(const key_type& k);
+        bool contains(const key_type& k) const;
+
+        template <typename F>
+        void each(F f) const;
+
+        std::size_t size() const;
+        span<const key_type> keys() const;
+        template <std::size_t I>
+        span<mapped_type<I>> values() const;
+
+    private:
+        template <std::size_t... I>
+        void _pack(const key_type& k, detail::index_sequence<I...>);
+        template <std::size_t... I>
+        void _unpack(const key_type& k, detail::index_sequence<I...>);
+        template <typename F, std::size_t... I>
+        void _each(F& f, detail::index_sequence<I...>) const;
+
+        std::tuple<Maps&...> _pools;
+        std::size_t _size;
+    };
+
+    template <typename... Maps>
+    group<Maps...>::group(Maps&... maps) : _pools(maps...), _size(0) // packs the keys the maps already share
+    {
+        auto driver = make_view(maps...);
+
+        for (auto it = driver.begin(); it != driver.end(); ++it)
+            _pack(std::get<0>(*it), pools_seq()); // the swaps only touch positions the walk has passed
+    }
+
+    template <typename... Maps>
+    template <std::size_t I, typename... Args>
+    void group<Maps...>::add(const key_type& k, Args&&... args) // adds to map I, joins the group once every map holds k
+    {
+        if (std::get<I>(_pools).try_emplace(k, std::forward<Args>(args)...).second)
+            _pack(k, pools_seq());
+    }
+
+    template <typename... Maps>
+    template <std::size_t I>
+    void group<Maps...>::remove(const key_type& k) // removes from map I, leaving the group first
+    {
+        if (contains(k))
+            _unpack(k, pools_seq());
+
+        std::get<I>(_pools).remove(k);
+    }
+
+    template <typename... Maps>
+    bool group<Maps...>::contains(const key_type& k) const
+    {
+        return std::get<0>(_pools).search(k) < _size; // npos is never below size()
+    }
+
+    template <typename... Maps>
+    template <typename F>
+    void group<Maps...>::each(F f) const // f(key, values...), a linear scan of every map
+    {
+        _each(f, pools_seq());
+    }
+
+    template <typename... Maps>
+    std::size_t group<Maps...>::size() const
+    {
+        return _size;
+    }
+
+    template <typename... Maps>
+    span<const typename group<Maps...>::key_type> group<Maps...>::keys() const
+    {
+        return span<const key_type>(std::get<0>(_pools).keys().data(), _size);
+    }
+
+    template <typename... Maps>
+    template <std::size_t I>
+    span<typename group<Maps...>::template mapped_type<I>> group<Maps...>::values() const
+    {
+        return span<mapped_type<I>>(std::get<I>(_pools).values().data(), _size);
+    }
+
+    template <typename... Maps>
+    template <std::size_t... I>
+    void group<Maps...>::_pack(const key_type& key, detail::index_sequence<I...>) // swaps key to position size() in every map if all hold it
+    {
+        const key_type k = key; // key may refer into a dense array the swaps reorder
+        const std::size_t idx[] = {static_cast<std::size_t>(std::get<I>(_pools).search(k))...};
+        const std::size_t npos[] = {static_cast<std::size_t>(std::get<I>(_pools).npos)...};
+
+        for (std::size_t i = 0; i < sizeof...(I); i++)
+        {
+            if (idx[i] == npos[i] || idx[i] < _size)
+                return;
+        }
+
+        const int expand[] = {0, (std::get<I>(_pools).swap_positions(idx[I], _size), 0)...};
+        (void) expand;
+
+        _size++;
+    }
+
+    template <typename... Maps>
+    template <std::size_t... I>
+    void group<Maps...>::_unpack(const key_type& key, detail::index_sequence<I...>) // swaps key to the last grouped position and shrinks the group
+    {
+        const key_type k = key;
+        _size--;
+
+        const int expand[] = {0, (std::get<I>(_pools).swap_positions(std::get<I>(_pools).search(k), _size), 0)...};
+        (void) expand;
+    }
+
+    template <typename... Maps>
+    template <typename F, std::size_t... I>
+    void group<Maps...>::_each(F& f, detail::index_sequence<I...>) const
+    {
+        const key_type* keys = std::get<0>(_pools).keys().data();
+        auto values = std::make_tuple(std::get<I>(_pools).values().data()...);
+
+        for (std::size_t i = 0; i < _size; i++)
+            f(keys[i], std::get<I>(values)[i]...);
+    }
+
+    template <typename... Maps>
+    group<Maps...> make_group(Maps&... maps)
+    {
+        return group<Maps...>(maps...);
+    }
+
+}
+
+
+#endif //PSSET_SPARSE_GROUP_H
+//
+// Parallel iteration over the dense storage of sets, maps and views.
+//
+
+#ifndef PSSET_SPARSE_PARALLEL_H
+#define PSSET_SPARSE_PARALLEL_H
+
+
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace psset
+{
+
+    namespace detail
+    {
+        // Elements per chunk handed to one thread, before rounding to whole cache lines.
+        const std::size_t parallel_grain = 1024;
+
+        // Chunk length for elements of the given size: at least parallel_grain and a
+        // whole number of cache lines. Columns start on a line (see allocate), so
+        // neighbouring chunks do not write to the same line of the column.
+        inline std::size_t chunk_length(std::size_t elem_size)
+        {
+            std::size_t a = elem_size, b = cache_line;
+            while (b != 0)
+            {
+                std::size_t r = a % b;
+                a = b;
+                b = r;
+            }
+
+            std::size_t line_elems = cache_line / a;
+            return (parallel_grain + line_elems - 1) / line_elems * line_elems;
+        }
+
+        inline bool& inside_pool()
+        {
+            static thread_local bool inside = false;
+            return inside;
+        }
+    }
+
+    // Fixed set of worker threads for parallel_for. Every call splits [0, n) into
+    // chunks, deals them out in contiguous runs to the workers and the calling
+    // thread, and lets a thread that ran out steal chunks from the back of the
+    // others' runs. Calls made from inside a running loop execute serially.
+    class thread_pool
+    {
+    public:
+        explicit thread_pool(unsigned int workers = default_workers());
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+        ~thread_pool();
+
+        static unsigned int default_workers();
+        static thread_pool& shared();
+
+        unsigned int size() const;
+
+        template <typename F>
+        void parallel_for(std::size_t n, std::size_t chunk, F fn);
+
+    private:
+        struct run
+        {
+            std::mutex m;
+            std::size_t front;
+            std::size_t back;
+            char pad[detail::cache_line]; // keeps the runs of different threads off one line
+        };
+
+        void _work(unsigned int id);
+        void _drain(unsigned int id);
+        bool _pop(unsigned int id, std::size_t& chunk);
+        bool _steal(unsigned int id, std::size_t& chunk);
+
+        std::vector<std::thread> _threads;
+        std::unique_ptr<run[]> _runs; // one per worker, the last one belongs to the caller
+
+        std::mutex _submit; // one loop at a time
+        std::mutex _m;
+        std::condition_variable _wake;
+        std::condition_variable _done;
+        unsigned long _generation;
+        unsigned int _busy;
+        bool _stop;
+
+        std::function<void(std::size_t)> _chunk;
+        std::exception_ptr _error;
+    };
+
+    inline thread_pool::thread_pool(unsigned int workers)
+        : _runs(new run[workers + 1]), _generation(0), _busy(0), _stop(false)
+    {
+        _threads.reserve(workers);
+
+        for (unsigned int i = 0; i < workers; i++)
+            _threads.emplace_back(&thread_pool::_work, this, i);
+    }
+
+    inline thread_pool::~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _stop = true;
+        }
+
+        _wake.notify_all();
+
+        for (auto& t : _threads)
+            t.join();
+    }
+
+    inline unsigned int thread_pool::default_workers() // the calling thread is the last participant
+    {
+        unsigned int hw = std::thread::hardware_concurrency();
+        return hw > 1 ? hw - 1 : 0;
+    }
+
+    inline thread_pool &thread_pool::shared()
+    {
+        static thread_pool pool;
+        return pool;
+    }
+
+    inline unsigned int thread_pool::size() const
+    {
+        return static_cast<unsigned int>(_threads.size());
+    }
+
+    template <typename F>
+    void thread_pool::parallel_for(std::size_t n, std::size_t chunk, F fn) // fn(first, last) for consecutive ranges covering [0, n)
+    {
+        if (n == 0)
+            return;
+
+        chunk = std::max<std::size_t>(chunk, 1);
+        std::size_t chunks = (n + chunk - 1) / chunk;
+
+        if (_threads.empty() || chunks == 1 || detail::inside_pool())
+        {
+            fn(std::size_t(0), n);
+            return;
+        }
+
+        std::lock_guard<std::mutex> submit(_submit);
+
+        _chunk = [&](std::size_t c) { fn(c * chunk, std::min(n, (c + 1) * chunk)); };
+        _error = nullptr;
+
+        const std::size_t parts = _threads.size() + 1;
+        for (std::size_t i = 0; i < parts; i++)
+        {
+            _runs[i].front = chunks * i / parts;
+            _runs[i].back = chunks * (i + 1) / parts;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _generation++;
+            _busy = size();
+        }
+
+        _wake.notify_all();
+        _drain(size());
+
+        {
+            std::unique_lock<std::mutex> lock(_m);
+            _done.wait(lock, [this] { return _busy == 0; });
+        }
+
+        _chunk = nullptr;
+
+        if (_error)
+            std::rethrow_exception(_error);
+    }
+
+    inline void thread_pool::_work(unsigned int id)
+    {
+        unsigned long seen = 0;
+
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(_m);
+                _wake.wait(lock, [&] { return _stop || _generation != seen; });
+
+                if (_stop)
+                    return;
+
+                seen = _generation;
+            }
+
+            _drain(id);
+
+            {
+                std::lock_guard<std::mutex> lock(_m);
+                if (--_busy == 0)
+                    _done.notify_one();
+            }
+        }
+    }
+
+    inline void thread_pool::_drain(unsigned int id) // own run first, then steals until every run is empty
+    {
+        detail::inside_pool() = true;
+        std::size_t c;
+
+        while (_pop(id, c) || _steal(id, c))
+        {
+            try
+            {
+                _chunk(c);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(_m);
+                if (!_error)
+                    _error = std::current_exception();
+            }
+        }
+
+        detail::inside_pool() = false;
+    }
+
+    inline bool thread_pool::_pop(unsigned int id, std::size_t& chunk)
+    {
+        std::lock_guard<std::mutex> lock(_runs[id].m);
+
+        if (_runs[id].front == _runs[id].back)
+            return false;
+
+        chunk = _runs[id].front++;
+        return true;
+    }
+
+    inline bool thread_pool::_steal(unsigned int id, std::size_t& chunk)
+    {
+        const std::size_t parts = _threads.size() + 1;
+
+        for (std::size_t k = 1; k < parts; k++)
+        {
+            run& victim = _runs[(id + k) % parts];
+            std::lock_guard<std::mutex> lock(victim.m);
+
+            if (victim.front != victim.back)
+            {
+                chunk = --victim.back;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // fn(element) for every element of a set. Elements must keep their hash.
+    template <typename T, typename Hash, typename Policy, typename Index, typename F>
+    void parallel_for_each(sparse_set<T, Hash, Policy, Index>& set, F fn, thread_pool& pool = thread_pool::shared())
+    {
+        T* data = set.data();
+
+        pool.parallel_for(set.size(), detail::chunk_length(sizeof(T)), [&](std::size_t first, std::size_t last) {
+            for (std::size_t i = first; i < last; i++)
+                fn(data[i]);
+        });
+    }
+
+    // fn(key, value) for every entry of a map, chunked by the value column.
+    template <typename Key, typename Value, typename Hash, typename Policy, typename Index, typename F>
+    void parallel_for_each(sparse_map<Key, Value, Hash, Policy, Index>& map, F fn, thread_pool& pool = thread_pool::shared())
+    {
+        const Key* keys = map.keys().data();
+        Value* values = map.values().data();
+
+        pool.parallel_for(map.size(), detail::chunk_length(sizeof(Value)), [&](std::size_t first, std::size_t last) {
+            for (std::size_t i = first; i < last; i++)
+                fn(keys[i], values[i]);
+        });
+    }
+
+    // view::each() with the positions of the driving map split across threads.
+    template <typename... Excluded, typename... Maps, typename F>
+    void parallel_for_each(const view<exclude_t<Excluded...>, Maps...>& v, F fn, thread_pool& pool = thread_pool::shared())
+    {
+        pool.parallel_for(v.size_hint(), detail::parallel_grain, [&](std::size_t first, std::size_t last) {
+            v.each(fn, first, last);
+        });
+    }
+
+}
+
+
+#endif //PSSET_SPARSE_PARALLEL_H
+//
+// Single-writer / multi-reader sparse map with RCU-style publication.
+//
+
+#ifndef PSSET_SPARSE_CONCURRENT_H
+#define PSSET_SPARSE_CONCURRENT_H
+
+
+
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+namespace psset
+{
+
+    namespace detail
+    {
+        // Reader counters are spread over this many cache lines; a thread always uses the same one.
+        const unsigned int reader_stripes = 16;
+
+        inline unsigned int reader_stripe()
+        {
+            static std::atomic<unsigned int> next(0);
+            static thread_local unsigned int stripe = next.fetch_add(1, std::memory_order_relaxed) % reader_stripes;
+            return stripe;
+        }
+
+        // Writes compact the current block once it holds more dead slots than live ones, and at least this many.
+        const unsigned int compact_holes = 64;
+
+        struct alignas(cache_line) reader_counter
+        {
+            std::atomic<unsigned long> count;
+        };
+    }
+
+    // A sparse_map that one writer thread mutates while any number of reader
+    // threads look entries up without taking locks.
+    //
+    // Dense slots are written once, before they are published through the
+    // sparse index, and never change afterwards: remove() only clears the sparse
+    // slot and insert_or_assign() appends a new slot and repoints it. Growth, and
+    // compaction once dead slots outnumber live ones, copy the live entries into a new block, publish it with an
+    // atomic pointer and retire the old block. Readers count themselves under
+    // one of two epoch parities in striped counters. A retired block is freed
+    // after both parities have been seen empty since it was retired: a reader
+    // that pinned it registered before the new block went out, so it kept one
+    // of the two counts up until it left. The writer flips the epoch while a
+    // block waits on the current parity, so new readers let that one drain.
+    //
+    // The sparse index is a flat array sized to the largest key, and Hash must be
+    // callable from several threads at once.
+    template <typename Key, typename Value, typename Hash, typename Index = unsigned int>
+    class concurrent_sparse_map
+    {
+        static_assert(std::is_integral<Index>::value && std::is_unsigned<Index>::value,
+                      "concurrent_sparse_map index type must be an unsigned integer");
+
+        struct block;
+
+    public:
+        using key_type = Key;
+        using mapped_type = Value;
+        using index_type = Index;
+        static constexpr Index npos = std::numeric_limits<Index>::max();
+
+        // Pins the current block for as long as it lives; references handed out stay valid until then.
+        class reader
+        {
+        public:
+            explicit reader(const concurrent_sparse_map& map);
+            reader(reader&& other) noexcept;
+            reader(const reader&) = delete;
+            reader& operator=(const reader&) = delete;
+            reader& operator=(reader&&) = delete;
+            ~reader();
+
+            template <typename K>
+            const Value* find(const K& k) const;
+            template <typename K>
+            bool contains(const K& k) const;
+            template <typename K>
+            const Value& at(const K& k) const;
+            template <typename F>
+            void for_each(F f) const;
+
+        private:
+            const concurrent_sparse_map* _map;
+            const block* _block;
+            unsigned int _parity;
+            unsigned int _stripe;
+        };
+
+        concurrent_sparse_map();
+        concurrent_sparse_map(const concurrent_sparse_map&) = delete;
+        concurrent_sparse_map& operator=(const concurrent_sparse_map&) = delete;
+        ~concurrent_sparse_map();
+
+        // Writer thread only.
+        void add(const Key& k, const Value& v);
+        void insert_or_assign(const Key& k, const Value& v);
+        template <typename K>
+        void remove(const K& k);
+        void reclaim();
+
+        // Any thread.
+        reader read() const;
+        template <typename K>
+        bool contains(const K& k) const;
+        template <typename K>
+        bool try_get(const K& k, Value& out) const;
+        template <typename K>
+        Value at(const K& k) const;
+        Index size() const;
+
+    private:
+        struct block
+        {
+            unsigned long long key_cap;
+            Index capacity;
+            std::atomic<Index> n;
+            std::atomic<Index>* sparse;
+            Key* keys;
+            Value* values;
+
+            template <typename K>
+            Index search(const Hash& hash, const K& k) const;
+        };
+
+        struct retired
+        {
+            block* b;
+            bool drained[2]; // parity seen without readers since b was retired
+        };
+
+        static block* _make_block(unsigned long long key_cap, Index capacity);
+        static void _free_block(block* b);
+
+        void _append(const Key& k, unsigned int val, const Value& v);
+        block* _grow(unsigned int val);
+        void _add_hole();
+        void _retire(block* b);
+        unsigned long _readers(unsigned int parity) const;
+
+        Hash _hash;
+        std::atomic<block*> _block;
+        std::atomic<Index> _size;
+        Index _holes; // dead dense slots of the current block, writer only
+        std::vector<retired> _retired; // writer only
+
+        mutable std::atomic<unsigned int> _epoch;
+        mutable detail::reader_counter _readers_in[2][detail::reader_stripes];
+    };
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    constexpr Index concurrent_sparse_map<Key, Value, Hash, Index>::npos;
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    Index concurrent_sparse_map<Key, Value, Hash, Index>::block::search(const Hash& hash, const K& k) const
+    {
+        unsigned int val = hash(k);
+
+        if (val >= key_cap)
+            return npos;
+
+        return sparse[val].load(std::memory_order_acquire); // pairs with the release in _append, the slot is complete
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    concurrent_sparse_map<Key, Value, Hash, Index>::reader::reader(const concurrent_sparse_map& map) : _map(&map)
+    {
+        _stripe = detail::reader_stripe();
+
+        for (;;)
+        {
+            unsigned int epoch = map._epoch.load();
+            _parity = epoch & 1U;
+            map._readers_in[_parity][_stripe].count.fetch_add(1);
+
+            if (map._epoch.load() == epoch) // a writer flipping from here on waits for this reader
+                break;
+
+            map._readers_in[_parity][_stripe].count.fetch_sub(1);
+        }
+
+        _block = map._block.load();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    concurrent_sparse_map<Key, Value, Hash, Index>::reader::reader(reader&& other) noexcept
+        : _map(other._map), _block(other._block), _parity(other._parity), _stripe(other._stripe)
+    {
+        other._map = nullptr;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    concurrent_sparse_map<Key, Value, Hash, Index>::reader::~reader()
+    {
+        if (_map != nullptr)
+            _map->_readers_in[_parity][_stripe].count.fetch_sub(1);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    const Value *concurrent_sparse_map<Key, Value, Hash, Index>::reader::find(const K& k) const // nullptr if k is not contained
+    {
+        Index idx = _block->search(_map->_hash, k);
+
+        return idx == npos ? nullptr : &_block->values[idx];
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    bool concurrent_sparse_map<Key, Value, Hash, Index>::reader::contains(const K& k) const
+    {
+        return _block->search(_map->_hash, k) != npos;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    const Value &concurrent_sparse_map<Key, Value, Hash, Index>::reader::at(const K& k) const
+    {
+        const Value* v = find(k);
+
+        if (v == nullptr)
+            throw std::out_of_range("key not found in concurrent smap.");
+
+        return *v;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename F>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::reader::for_each(F f) const // f(key, value) for the entries live in the pinned block
+    {
+        Index n = _block->n.load(std::memory_order_acquire);
+
+        for (Index i = 0; i < n; i++)
+        {
+            if (_block->search(_map->_hash, _block->keys[i]) == i)
+                f(_block->keys[i], _block->values[i]);
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    concurrent_sparse_map<Key, Value, Hash, Index>::concurrent_sparse_map()
+        : _block(_make_block(0, 0)), _size(0), _holes(0), _epoch(0)
+    {
+        for (auto& parity : _readers_in)
+        {
+            for (auto& counter : parity)
+                counter.count.store(0);
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    concurrent_sparse_map<Key, Value, Hash, Index>::~concurrent_sparse_map() // no reader may be left
+    {
+        for (auto& r : _retired)
+            _free_block(r.b);
+
+        _free_block(_block.load());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::add(const Key& k, const Value& v) // keeps the value of a contained key
+    {
+        if (_block.load(std::memory_order_relaxed)->search(_hash, k) != npos)
+            return;
+
+        _append(k, _hash(k), v);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::insert_or_assign(const Key& k, const Value& v) // readers see the old or the new value, never a mix
+    {
+        _append(k, _hash(k), v);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::remove(const K& k) // the dense slot stays readable until the next compaction
+    {
+        block* b = _block.load(std::memory_order_relaxed);
+        Index idx = b->search(_hash, k);
+
+        if (idx == npos)
+            return;
+
+        b->sparse[_hash(k)].store(npos, std::memory_order_release);
+        _size.store(_size.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        _add_hole();
+
+        if (!_retired.empty())
+            reclaim();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::reclaim() // frees retired blocks no reader can see anymore, also run by every write
+    {
+        std::size_t kept = 0;
+
+        bool waiting = false;
+
+        for (unsigned int parity = 0; parity < 2; parity++)
+        {
+            if (_readers(parity) != 0)
+                continue;
+
+            for (auto& r : _retired)
+                r.drained[parity] = true;
+        }
+
+        unsigned int epoch = _epoch.load();
+
+        for (std::size_t i = 0; i < _retired.size(); i++)
+        {
+            if (_retired[i].drained[0] && _retired[i].drained[1])
+            {
+                _free_block(_retired[i].b);
+                continue;
+            }
+
+            waiting = waiting || !_retired[i].drained[epoch & 1U];
+            _retired[kept++] = _retired[i];
+        }
+
+        _retired.resize(kept);
 
-        using iterator = T*;
-        iterator begin();
-        const iterator begin() const;
-        iterator end();
-        const iterator end() const;
+        if (waiting)
+            _epoch.store(epoch + 1); // new readers count under the other parity, this one can drain
+    }
 
-    private:
-        Hash _hash;
-        unsigned int _n;
-        unsigned int _capacity;
-        unsigned int* _sparse;
-        T* _dense;
-    };
+    template<typename Key, typename Value, typename Hash, typename Index>
+    typename concurrent_sparse_map<Key, Value, Hash, Index>::reader concurrent_sparse_map<Key, Value, Hash, Index>::read() const
+    {
+        return reader(*this);
+    }
 
-    template<typename T, typename Hash>
-    sparse_set<T, Hash>::sparse_set(unsigned int cap)
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    bool concurrent_sparse_map<Key, Value, Hash, Index>::contains(const K& k) const
     {
-        _n = 0;
-        _capacity = cap;
+        return reader(*this).contains(k);
+    }
 
-        _sparse = new unsigned int[_capacity];
-        for (int i = 0; i < _capacity; i++)
-        {
-            _sparse[i] = UINT_MAX;
-        }
-        _dense = new T[_capacity];
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    bool concurrent_sparse_map<Key, Value, Hash, Index>::try_get(const K& k, Value& out) const // copies the value out while the block is pinned
+    {
+        reader r(*this);
+        const Value* v = r.find(k);
+
+        if (v == nullptr)
+            return false;
+
+        out = *v;
+        return true;
     }
 
-    template<typename T, typename Hash>
-    sparse_set<T, Hash>::~sparse_set()
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    Value concurrent_sparse_map<Key, Value, Hash, Index>::at(const K& k) const
     {
-        delete [] _sparse;
-        delete [] _dense;
+        return reader(*this).at(k);
     }
 
-    template<typename T, typename Hash>
-    void sparse_set<T, Hash>::resize(unsigned int new_cap)
+    template<typename Key, typename Value, typename Hash, typename Index>
+    Index concurrent_sparse_map<Key, Value, Hash, Index>::size() const // exact on the writer, a recent value elsewhere
     {
-        auto * new_sparse = new unsigned int[new_cap];
-        for (int i = 0; i < new_cap; i++)
+        return _size.load(std::memory_order_relaxed);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    typename concurrent_sparse_map<Key, Value, Hash, Index>::block *concurrent_sparse_map<Key, Value, Hash, Index>::_make_block(unsigned long long key_cap, Index capacity)
+    {
+        block* b = new block;
+        b->key_cap = key_cap;
+        b->capacity = capacity;
+        b->n.store(0, std::memory_order_relaxed);
+        b->sparse = nullptr;
+        b->keys = nullptr;
+        b->values = nullptr;
+
+        try
         {
-            new_sparse[i] = UINT_MAX;
+            b->sparse = new std::atomic<Index>[key_cap];
+            for (unsigned long long i = 0; i < key_cap; i++)
+                b->sparse[i].store(npos, std::memory_order_relaxed);
+
+            b->keys = detail::allocate<Key>(capacity);
+            b->values = detail::allocate<Value>(capacity);
+        }
+        catch (...)
+        {
+            _free_block(b);
+            throw;
         }
-        T* new_dense = new T[new_cap];
 
-        unsigned int min_cap = std::min(_capacity, new_cap);
-        std::copy(_sparse, _sparse + min_cap, new_sparse);
-        std::copy(_dense, _dense + min_cap, new_dense);
+        return b;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::_free_block(block* b) // dead slots are destroyed here, not on removal
+    {
+        Index n = b->n.load(std::memory_order_relaxed);
 
-        delete [] _sparse;
-        delete [] _dense;
+        if (b->keys != nullptr)
+            detail::destroy(b->keys, b->keys + n);
+        if (b->values != nullptr)
+            detail::destroy(b->values, b->values + n);
 
-        if (_n > new_cap)
-            _n = new_cap;
-        _capacity = new_cap;
-        _sparse = new_sparse;
-        _dense = new_dense;
+        detail::deallocate(b->keys);
+        detail::deallocate(b->values);
+        delete [] b->sparse;
+        delete b;
     }
 
-    template<typename T, typename Hash>
-    void sparse_set<T, Hash>::add(T x)
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::_append(const Key& k, unsigned int val, const Value& v)
     {
-        unsigned int val = _hash(x);
+        block* b = _block.load(std::memory_order_relaxed);
+
+        if (val >= b->key_cap || b->n.load(std::memory_order_relaxed) == b->capacity)
+            b = _grow(val);
 
-        if (val >= _capacity) {
-            resize(static_cast<unsigned int>(std::pow(2, std::ceil(std::log2(val + 1)))));
+        Index n = b->n.load(std::memory_order_relaxed);
+        new (&b->keys[n]) Key(k);
+
+        try
+        {
+            new (&b->values[n]) Value(v);
+        }
+        catch (...)
+        {
+            b->keys[n].~Key();
+            throw;
         }
 
-        if (search(x) != UINT_MAX)
-            return;
+        b->n.store(n + 1, std::memory_order_release);
 
-        _dense[_n] = x;
-        _sparse[val] = _n;
-        _n++;
+        if (b->sparse[val].exchange(n, std::memory_order_acq_rel) == npos) // publishes the slot
+            _size.store(_size.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        else
+            _add_hole();
+
+        if (!_retired.empty())
+            reclaim();
     }
 
-    template<typename T, typename Hash>
-    void sparse_set<T, Hash>::remove(T x)
+    template<typename Key, typename Value, typename Hash, typename Index>
+    typename concurrent_sparse_map<Key, Value, Hash, Index>::block *concurrent_sparse_map<Key, Value, Hash, Index>::_grow(unsigned int val) // copies the live entries into a new block and publishes it
     {
-        unsigned int val = _hash(x);
+        block* old = _block.load(std::memory_order_relaxed);
 
-        if (search(x) == UINT_MAX)
-            return;
+        unsigned long long key_cap = std::max(old->key_cap, 1ULL);
+        while (key_cap <= val)
+            key_cap <<= 1U;
 
-        _dense[_sparse[val]] = _dense[_n - 1];
-        _sparse[_hash(_dense[_n - 1])] = _sparse[val];
-        _sparse[val] = UINT_MAX;
+        Index live = _size.load(std::memory_order_relaxed);
+        Index headroom = static_cast<Index>(std::min<unsigned long long>(live + live / 2ULL, npos - 1));
+        Index capacity = detail::next_capacity(headroom); // updates append, so a full copy must leave room for many of them
+        if (old->n.load(std::memory_order_relaxed) < old->capacity)
+            capacity = std::max(capacity, old->capacity); // only the key range grew
 
-        _n--;
-    }
+        if (capacity == live)
+            throw std::length_error("concurrent_sparse_map index type exhausted.");
 
-    template<typename T, typename Hash>
-    unsigned int sparse_set<T, Hash>::search(T x) const
-    {
-        unsigned int val = _hash(x);
+        block* b = _make_block(key_cap, capacity);
+        Index n = 0;
 
-        if (val >= _capacity)
-            return UINT_MAX;
+        try
+        {
+            for (Index i = 0; i < old->n.load(std::memory_order_relaxed); i++)
+            {
+                unsigned int key_val = _hash(old->keys[i]);
 
-        if (_sparse[val] < _n)
-            return _sparse[val];
+                if (old->sparse[key_val].load(std::memory_order_relaxed) != i)
+                    continue;
 
-        return UINT_MAX;
-    }
+                new (&b->keys[n]) Key(old->keys[i]); // copied, readers may still be reading the old slot
+                new (&b->values[n]) Value(old->values[i]);
+                b->n.store(n + 1, std::memory_order_relaxed);
+                b->sparse[key_val].store(n, std::memory_order_relaxed);
+                n++;
+            }
+        }
+        catch (...)
+        {
+            _free_block(b);
+            throw;
+        }
 
-    template<typename T, typename Hash>
-    void sparse_set<T, Hash>::clear()
-    {
-        _n = 0;
-    }
+        _block.store(b); // publishes the whole block
+        _holes = 0;
+        _retire(old);
 
-    template<typename T, typename Hash>
-    unsigned int sparse_set<T, Hash>::size() const
-    {
-        return _n;
+        return b;
     }
 
-    template<typename T, typename Hash>
-    T *sparse_set<T, Hash>::data() // not allowed to change result of hash function
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::_add_hole()
     {
-        return _dense;
-    }
+        _holes++;
 
-    template<typename T, typename Hash>
-    const T *sparse_set<T, Hash>::data() const // not allowed to change result of hash function
-    {
-        return _dense;
+        if (_holes >= detail::compact_holes && _holes > _size.load(std::memory_order_relaxed))
+            _grow(0); // same key range, only the live entries are copied
     }
 
-    template<typename T, typename Hash>
-    typename sparse_set<T, Hash>::iterator sparse_set<T, Hash>::begin()
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::_retire(block* b)
     {
-        return &_dense[0];
+        _retired.push_back({b, {false, false}}); // only counts seen from here on prove the readers of b gone
+        reclaim();
     }
 
-    template<typename T, typename Hash>
-    const typename sparse_set<T, Hash>::iterator sparse_set<T, Hash>::begin() const
+    template<typename Key, typename Value, typename Hash, typename Index>
+    unsigned long concurrent_sparse_map<Key, Value, Hash, Index>::_readers(unsigned int parity) const
     {
-        return &_dense[0];
-    }
+        unsigned long readers = 0;
 
-    template<typename T, typename Hash>
-    typename sparse_set<T, Hash>::iterator sparse_set<T, Hash>::end()
-    {
-        return &_dense[size()];
-    }
+        for (const auto& counter : _readers_in[parity])
+            readers += counter.count.load();
 
-    template<typename T, typename Hash>
-    const typename sparse_set<T, Hash>::iterator sparse_set<T, Hash>::end() const
-    {
-        return &_dense[size()];
+        return readers;
     }
 
 }
 
 
-#endif //PSSET_SPARSE_SET_H
+#endif //PSSET_SPARSE_CONCURRENT_H
 //
-// Created by Pawel Boening on 31.08.18.
+// Sparse map split into independently locked shards.
 //
 
-#ifndef PSSET_SPARSE_MAP_H
-#define PSSET_SPARSE_MAP_H
+#ifndef PSSET_SPARSE_SHARDED_H
+#define PSSET_SPARSE_SHARDED_H
 
 
 
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <utility>
+
 namespace psset
 {
-    template <typename K, typename  V>
-    struct KeyValue
-    {
-        K key;
-        V value;
 
-        template <typename H>
-        struct KeyHash
+    namespace detail
+    {
+        // Test-and-test-and-set lock for critical sections of a few lookups.
+        class spin_lock
         {
-            unsigned int operator()(KeyValue<K, V> const& e) const
+        public:
+            spin_lock() : _locked(false) {}
+
+            void lock()
+            {
+                for (;;)
+                {
+                    if (!_locked.exchange(true, std::memory_order_acquire))
+                        return;
+
+                    while (_locked.load(std::memory_order_relaxed))
+                        std::this_thread::yield();
+                }
+            }
+
+            bool try_lock()
+            {
+                return !_locked.load(std::memory_order_relaxed) && !_locked.exchange(true, std::memory_order_acquire);
+            }
+
+            void unlock()
             {
-                return _hash(e.key);
+                _locked.store(false, std::memory_order_release);
             }
 
-            H _hash;
+        private:
+            std::atomic<bool> _locked;
         };
-    };
 
-    template <typename K, typename V>
-    KeyValue<K, V> make_keyvalue(K &key, V &value)
-    {
-        return {key, value};
+        // Drops the shard bits, so each shard indexes a dense range of its own.
+        template <typename Hash, unsigned int Bits>
+        struct shard_hash
+        {
+            template <typename K>
+            unsigned int operator()(const K& k) const
+            {
+                return Hash()(k) >> Bits;
+            }
+        };
+
+        constexpr unsigned int log2(unsigned int n)
+        {
+            return n <= 1 ? 0 : 1 + log2(n >> 1U);
+        }
     }
 
-    template <typename Key, typename Value, typename Hash>
-    class sparse_map
+    // Splits the key space over Shards sparse_maps by the low bits of the hash,
+    // so that consecutive keys land in different shards. Each shard has its own
+    // lock and sits on cache lines of its own; operations on keys in different
+    // shards never touch the same memory.
+    template <typename Key, typename Value, typename Hash, unsigned int Shards = 16,
+              typename Policy = initialized_sparse, typename Index = unsigned int>
+    class sharded_sparse_map
     {
+        static_assert(Shards > 0 && (Shards & (Shards - 1)) == 0, "the shard count must be a power of two");
+
+        static constexpr unsigned int shard_bits = detail::log2(Shards);
 
     public:
-        explicit sparse_map(unsigned int cap = 0);
+        using key_type = Key;
+        using mapped_type = Value;
+        using shard_type = sparse_map<Key, Value, detail::shard_hash<Hash, shard_bits>, Policy, Index>;
 
-        void resize(unsigned int new_cap);
-        void add(Key k, Value v);
-        void remove(Key k);
-        unsigned int search(Key k) const;
-        Value& at(Key k);
-        const Value& at(Key k) const;
+        sharded_sparse_map() = default;
+        sharded_sparse_map(const sharded_sparse_map&) = delete;
+        sharded_sparse_map& operator=(const sharded_sparse_map&) = delete;
+
+        void add(const Key& k, const Value& v);
+        template <typename... Args>
+        bool try_emplace(const Key& k, Args&&... args);
+        template <typename V>
+        void insert_or_assign(const Key& k, V&& v);
+        template <typename K>
+        void remove(const K& k);
         void clear();
 
-        unsigned int size() const;
-        KeyValue<Key, Value>* data();
-        const KeyValue<Key, Value>* data() const;
+        template <typename K>
+        bool contains(const K& k) const;
+        template <typename K>
+        bool try_get(const K& k, Value& out) const;
+        template <typename K, typename F>
+        bool visit(const K& k, F f);
 
-        using iterator = KeyValue<Key, Value>*;
-        iterator begin();
-        const iterator begin() const;
-        iterator end();
-        const iterator end() const;
+        template <typename F>
+        void for_each(F f);
+        template <typename F>
+        void for_each_shard(std::size_t s, F f);
+
+        template <typename K>
+        static std::size_t shard_of(const K& k);
+        static constexpr std::size_t shard_count() { return Shards; }
+
+        std::size_t size() const;
+        bool empty() const;
 
     private:
-        sparse_set<KeyValue<Key, Value>,  typename KeyValue<Key, Value>::template KeyHash<Hash>> _sset;
+        struct shard
+        {
+            mutable detail::spin_lock lock;
+            shard_type map;
+            char pad[detail::cache_line]; // keeps the next shard's lock off this one's lines
+        };
+
+        using guard = std::lock_guard<detail::spin_lock>;
+
+        shard _shards[Shards];
     };
 
-    template<typename Key, typename Value, typename Hash>
-    sparse_map<Key, Value, Hash>::sparse_map(unsigned int cap) : _sset(cap)
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    void sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::add(const Key& k, const Value& v) // ignored if k is already contained
     {
+        shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        s.map.add(k, v);
     }
 
-    template<typename Key, typename Value, typename Hash>
-    void sparse_map<Key, Value, Hash>::resize(unsigned int new_cap)
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename... Args>
+    bool sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::try_emplace(const Key& k, Args&&... args) // true if k was added
     {
-        return _sset.resize(new_cap);
+        shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        return s.map.try_emplace(k, std::forward<Args>(args)...).second;
     }
 
-    template<typename Key, typename Value, typename Hash>
-    void sparse_map<Key, Value, Hash>::add(Key k, Value v)
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename V>
+    void sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::insert_or_assign(const Key& k, V&& v)
     {
-        auto p = make_keyvalue(k, v);
-        return _sset.add(p);
+        shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        s.map.insert_or_assign(k, std::forward<V>(v));
     }
 
-    template<typename Key, typename Value, typename Hash>
-    void sparse_map<Key, Value, Hash>::remove(Key k)
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename K>
+    void sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::remove(const K& k)
     {
-        Value v;
-        auto p = make_keyvalue(k, v);
-        return _sset.remove(p);
+        shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        s.map.remove(k);
     }
 
-    template<typename Key, typename Value, typename Hash>
-    unsigned int sparse_map<Key, Value, Hash>::search(Key k) const
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    void sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::clear() // one shard at a time
     {
-        Value v;
-        auto p = make_keyvalue(k, v);
-        return _sset.search(p);
+        for (auto& s : _shards)
+        {
+            guard lock(s.lock);
+            s.map.clear();
+        }
     }
 
-    template<typename Key, typename Value, typename Hash>
-    Value &sparse_map<Key, Value, Hash>::at(Key k)
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename K>
+    bool sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::contains(const K& k) const
     {
-        auto idx = search(k);
-
-        if (idx >= size())
-            throw std::out_of_range("key not found in smap.");
-
-        return _sset.data()[idx].value;
+        const shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        return s.map.contains(k);
     }
 
-    template<typename Key, typename Value, typename Hash>
-    const Value &sparse_map<Key, Value, Hash>::at(Key k) const
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename K>
+    bool sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::try_get(const K& k, Value& out) const // copies the value out under the shard lock
     {
-        auto idx = search(k);
+        const shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        const Value* v = s.map.find(k);
 
-        if (idx >= size())
-            throw std::out_of_range("key not found in smap.");
+        if (v == nullptr)
+            return false;
 
-        return _sset.data()[idx].value;
-    }
-    template<typename Key, typename Value, typename Hash>
-    void sparse_map<Key, Value, Hash>::clear()
-    {
-        _sset.clear();
+        out = *v;
+        return true;
     }
 
-    template<typename Key, typename Value, typename Hash>
-    unsigned int sparse_map<Key, Value, Hash>::size() const
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename K, typename F>
+    bool sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::visit(const K& k, F f) // f(value) under the shard lock, false if k is not contained
     {
-        return _sset.size();
+        shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        Value* v = s.map.find(k);
+
+        if (v == nullptr)
+            return false;
+
+        f(*v);
+        return true;
     }
 
-    template<typename Key, typename Value, typename Hash>
-    KeyValue<Key, Value> *sparse_map<Key, Value, Hash>::data() // not allowed to change result of hash function
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename F>
+    void sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::for_each(F f) // f(key, value), shard by shard
     {
-        return _sset.data();
+        for (std::size_t s = 0; s < Shards; s++)
+            for_each_shard(s, f);
     }
 
-    template<typename Key, typename Value, typename Hash>
-    const KeyValue<Key, Value> *sparse_map<Key, Value, Hash>::data() const // not allowed to change result of hash function
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename F>
+    void sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::for_each_shard(std::size_t s, F f) // holds the lock of shard s for the whole walk
     {
-        return _sset.data();
+        guard lock(_shards[s].lock);
+
+        shard_type& map = _shards[s].map;
+        const Key* keys = map.keys().data();
+        Value* values = map.values().data();
+
+        for (Index i = 0; i < map.size(); i++)
+            f(keys[i], values[i]);
     }
 
-    template<typename Key, typename Value, typename Hash>
-    typename sparse_map<Key, Value, Hash>::iterator sparse_map<Key, Value, Hash>::begin()
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename K>
+    std::size_t sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::shard_of(const K& k)
     {
-        return _sset.begin();
+        return Hash()(k) & (Shards - 1);
     }
 
-    template<typename Key, typename Value, typename Hash>
-    const typename sparse_map<Key, Value, Hash>::iterator sparse_map<Key, Value, Hash>::begin() const
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    std::size_t sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::size() const // each shard is read at a different moment
     {
-        return _sset.begin();
+        std::size_t n = 0;
+
+        for (const auto& s : _shards)
+        {
+            guard lock(s.lock);
+            n += s.map.size();
+        }
+
+        return n;
     }
 
-    template<typename Key, typename Value, typename Hash>
-    typename sparse_map<Key, Value, Hash>::iterator sparse_map<Key, Value, Hash>::end()
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    bool sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::empty() const
     {
-        return _sset.end();
+        return size() == 0;
     }
 
-    template<typename Key, typename Value, typename Hash>
-    const typename sparse_map<Key, Value, Hash>::iterator sparse_map<Key, Value, Hash>::end() const
+    // fn(key, value) for every entry, one shard per task.
+    template <typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index, typename F>
+    void parallel_for_each(sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>& map, F fn, thread_pool& pool = thread_pool::shared())
     {
-        return _sset.end();
+        pool.parallel_for(Shards, 1, [&](std::size_t first, std::size_t last) {
+            for (std::size_t s = first; s < last; s++)
+                map.for_each_shard(s, fn);
+        });
     }
 
-
 }
 
 
-#endif //PSSET_SPARSE_MAP_H
+#endif //PSSET_SPARSE_SHARDED_H
 //
-// Created by Pawel Boening on 2019-02-10.
+// Deferred add/remove/assign commands recorded from worker threads.
 //
 
-#ifndef PSSET_SPARSE_FACTORY_H
-#define PSSET_SPARSE_FACTORY_H
+#ifndef PSSET_SPARSE_COMMAND_H
+#define PSSET_SPARSE_COMMAND_H
 
 
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace psset
 {
-    template<typename Value>
-    class sparse_factory
+
+    namespace detail
     {
-    public:
-        using ValueId = unsigned long;
+        // Payload bytes per arena block; larger payloads get a block of their own.
+        const std::size_t arena_block = 16384;
 
-        struct ValueIdHash
+        struct insert_op
         {
-            unsigned int operator()(ValueId const &e) const
+            template <typename Target, typename Payload>
+            static void apply(Target& t, Payload& p) { t.add(std::move(p)); }
+        };
+
+        struct emplace_op
+        {
+            template <typename Target, typename Payload>
+            static void apply(Target& t, Payload& p) { t.try_emplace(p.first, std::move(p.second)); }
+        };
+
+        struct assign_op
+        {
+            template <typename Target, typename Payload>
+            static void apply(Target& t, Payload& p) { t.insert_or_assign(p.first, std::move(p.second)); }
+        };
+
+        struct erase_op
+        {
+            template <typename Target, typename Payload>
+            static void apply(Target& t, Payload& p) { t.remove(p); }
+        };
+
+        struct factory_assign_op
+        {
+            template <typename Target, typename Payload>
+            static void apply(Target& t, Payload& p)
             {
-                return e & 0x00000000FFFFFFFF;
+                if (t.exists(p.first))
+                    t.at(p.first) = std::move(p.second);
             }
         };
+    }
 
+    // Records add, remove and assign operations on sets, maps and factories from
+    // any number of threads and applies them later, at a point where no thread
+    // touches those containers. Every thread writes into an arena of its own, so
+    // recording takes no lock after a thread's first command. flush() orders the
+    // commands by target and key, keeping the recorded order for each key of a
+    // thread, and applies them one target at a time.
+    class command_buffer
+    {
     public:
-        ValueId create();
-        const Value &at(ValueId p) const;
-        Value &at(ValueId p);
-        bool exists(ValueId p) const;
-        void remove(ValueId p);
+        command_buffer();
+        command_buffer(const command_buffer&) = delete;
+        command_buffer& operator=(const command_buffer&) = delete;
+        ~command_buffer();
 
-        unsigned int size() const;
+        template <typename T, typename Hash, typename Policy, typename Index>
+        void add(sparse_set<T, Hash, Policy, Index>& set, T x);
+        template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+        void add(sparse_map<Key, Value, Hash, Policy, Index>& map, const Key& k, Value v);
+        template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+        void assign(sparse_map<Key, Value, Hash, Policy, Index>& map, const Key& k, Value v);
+        template <typename Value, typename Index>
+        void assign(sparse_factory<Value, Index>& factory, typename sparse_factory<Value, Index>::ValueId id, Value v);
 
-        using iterator = psset::KeyValue<ValueId, Value> *;
-        iterator begin();
-        iterator end();
-        const iterator begin() const;
-        const iterator end() const;
+        template <typename T, typename Hash, typename Policy, typename Index>
+        void remove(sparse_set<T, Hash, Policy, Index>& set, const T& k);
+        template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+        void remove(sparse_map<Key, Value, Hash, Policy, Index>& map, const Key& k);
+        template <typename Value, typename Index>
+        void remove(sparse_factory<Value, Index>& factory, typename sparse_factory<Value, Index>::ValueId id);
+
+        // At a sync point only.
+        void flush();
+        void clear();
+        std::size_t size() const;
+        bool empty() const;
 
     private:
-        ValueId _inc_version(ValueId e) const;
+        struct command
+        {
+            void* target;
+            unsigned int key;
+            void (*apply)(void* target, void* payload);
+            void (*destroy)(void* payload);
+            void* payload;
+        };
 
-        ValueId _index_counter = 0;
-        psset::sparse_map<ValueId, Value, ValueIdHash> _used;
-        std::vector<ValueId> _unused;
+        struct block
+        {
+            std::unique_ptr<char[]> data;
+            std::size_t size;
+        };
+
+        struct arena
+        {
+            std::vector<command> commands;
+            std::vector<block> blocks;
+            std::size_t current = 0;
+            std::size_t used = 0;
+
+            void* allocate(std::size_t size, std::size_t align);
+            void reset();
+        };
+
+        template <typename Op, typename Target, typename Payload>
+        static void _apply(void* target, void* payload);
+        template <typename Payload>
+        static void _destroy(void* payload);
+
+        template <typename Op, typename Target, typename Payload>
+        void _record(Target& target, unsigned int key, Payload&& payload);
+        arena& _local();
+        void _discard(std::vector<command>& commands, std::size_t first);
+
+        detail::local_slot _slot; // where threads keep their arena for this buffer
+        std::mutex _m; // guards _arenas while a thread registers its arena
+        std::vector<std::unique_ptr<arena>> _arenas;
     };
 
-    template<typename Value>
-    typename sparse_factory<Value>::ValueId sparse_factory<Value>::create()
+    inline command_buffer::command_buffer()
     {
-        ValueId value_id;
+    }
 
-        if (_unused.empty())
-        {
-            value_id = _index_counter++;
-        }
-        else
-        {
-            value_id = _unused.back();
-            _unused.pop_back();
-        }
+    inline command_buffer::~command_buffer()
+    {
+        clear();
+    }
 
-        _used.add(value_id, Value());
+    template <typename T, typename Hash, typename Policy, typename Index>
+    void command_buffer::add(sparse_set<T, Hash, Policy, Index>& set, T x)
+    {
+        unsigned int key = Hash()(x);
+        _record<detail::insert_op>(set, key, std::move(x));
+    }
 
-        return value_id;
+    template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void command_buffer::add(sparse_map<Key, Value, Hash, Policy, Index>& map, const Key& k, Value v) // keeps the value of a contained key, like try_emplace
+    {
+        _record<detail::emplace_op>(map, Hash()(k), std::make_pair(k, std::move(v)));
     }
 
-    template<typename Value>
-    const Value &sparse_factory<Value>::at(sparse_factory::ValueId p) const
+    template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void command_buffer::assign(sparse_map<Key, Value, Hash, Policy, Index>& map, const Key& k, Value v) // insert_or_assign
     {
-        return _used.at(p);
+        _record<detail::assign_op>(map, Hash()(k), std::make_pair(k, std::move(v)));
     }
 
-    template<typename Value>
-    Value &sparse_factory<Value>::at(sparse_factory::ValueId p)
+    template <typename Value, typename Index>
+    void command_buffer::assign(sparse_factory<Value, Index>& factory, typename sparse_factory<Value, Index>::ValueId id, Value v) // dropped if id is gone by then
     {
-        return _used.at(p);
+        using hash = typename sparse_factory<Value, Index>::ValueIdHash;
+        _record<detail::factory_assign_op>(factory, hash()(id), std::make_pair(id, std::move(v)));
     }
 
-    template<typename Value>
-    bool sparse_factory<Value>::exists(sparse_factory::ValueId p) const
+    template <typename T, typename Hash, typename Policy, typename Index>
+    void command_buffer::remove(sparse_set<T, Hash, Policy, Index>& set, const T& k)
     {
-        auto idx = _used.search(p);
+        _record<detail::erase_op>(set, Hash()(k), T(k));
+    }
 
-        if (idx >= _used.size())
-            return false;
+    template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void command_buffer::remove(sparse_map<Key, Value, Hash, Policy, Index>& map, const Key& k)
+    {
+        _record<detail::erase_op>(map, Hash()(k), Key(k));
+    }
 
-        return _used.data()[idx].key == p;
+    template <typename Value, typename Index>
+    void command_buffer::remove(sparse_factory<Value, Index>& factory, typename sparse_factory<Value, Index>::ValueId id)
+    {
+        using hash = typename sparse_factory<Value, Index>::ValueIdHash;
+        _record<detail::erase_op>(factory, hash()(id), id);
     }
 
-    template<typename Value>
-    void sparse_factory<Value>::remove(sparse_factory::ValueId p)
+    inline void command_buffer::flush() // commands left after a throwing one are dropped
     {
-        if (exists(p))
+        std::vector<command> commands;
+        commands.reserve(size());
+
+        for (auto& a : _arenas) // registration order keeps a thread's arenas in recording order
+            commands.insert(commands.end(), a->commands.begin(), a->commands.end());
+
+        std::stable_sort(commands.begin(), commands.end(), [](const command& a, const command& b) {
+            if (a.target != b.target)
+                return std::less<void*>()(a.target, b.target);
+            return a.key < b.key;
+        });
+
+        for (std::size_t i = 0; i < commands.size(); i++)
         {
-            _used.remove(p);
-            _unused.push_back(_inc_version(p));
+            try
+            {
+                commands[i].apply(commands[i].target, commands[i].payload);
+            }
+            catch (...)
+            {
+                _discard(commands, i);
+                throw;
+            }
+
+            commands[i].destroy(commands[i].payload);
         }
+
+        for (auto& a : _arenas)
+            a->reset();
     }
 
-    template<typename Value>
-    unsigned int sparse_factory<Value>::size() const
+    inline void command_buffer::clear() // drops every pending command, the arenas are kept for reuse
     {
-        return _used.size();
+        for (auto& a : _arenas)
+        {
+            for (auto& c : a->commands)
+                c.destroy(c.payload);
+
+            a->reset();
+        }
     }
 
-    template<typename Value>
-    typename sparse_factory<Value>::iterator sparse_factory<Value>::begin()
+    inline std::size_t command_buffer::size() const
     {
-        return _used.begin();
+        std::size_t n = 0;
+
+        for (const auto& a : _arenas)
+            n += a->commands.size();
+
+        return n;
     }
 
-    template<typename Value>
-    typename sparse_factory<Value>::iterator sparse_factory<Value>::end()
+    inline bool command_buffer::empty() const
     {
-        return _used.end();
+        return size() == 0;
     }
 
-    template<typename Value>
-    const typename sparse_factory<Value>::iterator sparse_factory<Value>::begin() const
+    inline void *command_buffer::arena::allocate(std::size_t size, std::size_t align) // bump allocation, blocks survive reset()
     {
-        return _used.begin();
+        for (;;)
+        {
+            if (current < blocks.size())
+            {
+                std::size_t offset = (used + align - 1) & ~(align - 1);
+
+                if (offset + size <= blocks[current].size)
+                {
+                    used = offset + size;
+                    return blocks[current].data.get() + offset;
+                }
+
+                current++;
+                used = 0;
+                continue;
+            }
+
+            std::size_t block_size = std::max(detail::arena_block, size);
+            blocks.push_back({std::unique_ptr<char[]>(new char[block_size]), block_size});
+            used = 0;
+        }
     }
 
-    template<typename Value>
-    const typename sparse_factory<Value>::iterator sparse_factory<Value>::end() const
+    inline void command_buffer::arena::reset()
     {
-        return _used.end();
+        commands.clear();
+        current = 0;
+        used = 0;
     }
 
-    template<typename Value>
-    typename sparse_factory<Value>::ValueId sparse_factory<Value>::_inc_version(typename sparse_factory<ValueId>::ValueId p) const
+    template <typename Op, typename Target, typename Payload>
+    void command_buffer::_apply(void* target, void* payload)
     {
-        return (p & 0x00000000FFFFFFFF) | ((p + 0x0000000100000000) & 0xFFFFFFFF00000000);
+        Op::apply(*static_cast<Target*>(target), *static_cast<Payload*>(payload));
+    }
+
+    template <typename Payload>
+    void command_buffer::_destroy(void* payload)
+    {
+        static_cast<Payload*>(payload)->~Payload();
+    }
+
+    template <typename Op, typename Target, typename Payload>
+    void command_buffer::_record(Target& target, unsigned int key, Payload&& payload)
+    {
+        using stored = typename std::decay<Payload>::type;
+        static_assert(alignof(stored) <= alignof(std::max_align_t), "over-aligned payloads are not supported");
+
+        arena& a = _local();
+        if (a.commands.size() == a.commands.capacity()) // nothing can throw once the payload is built
+            a.commands.reserve(2 * a.commands.capacity() + 1);
+
+        void* mem = a.allocate(sizeof(stored), alignof(stored));
+        new (mem) stored(std::forward<Payload>(payload));
+
+        a.commands.push_back({&target, key, &_apply<Op, Target, stored>, &_destroy<stored>, mem});
+    }
+
+    inline command_buffer::arena &command_buffer::_local() // the calling thread's arena, registered on first use
+    {
+        if (void* a = _slot.find())
+            return *static_cast<arena*>(a);
+
+        arena* a;
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _arenas.emplace_back(new arena);
+            a = _arenas.back().get();
+        }
+
+        _slot.insert(a);
+        return *a;
+    }
+
+    inline void command_buffer::_discard(std::vector<command>& commands, std::size_t first)
+    {
+        for (std::size_t i = first; i < commands.size(); i++)
+            commands[i].destroy(commands[i].payload);
+
+        for (auto& a : _arenas)
+            a->reset();
     }
 
 }
 
 
-#endif //PSSET_SPARSE_FACTORY_H
+#endif //PSSET_SPARSE_COMMAND_H
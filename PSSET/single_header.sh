@@ -2,7 +2,7 @@
 
 OUTFILE="psset.h"
 TMPFILE="tmp"
-HEADERS=("sparse_set.h" "sparse_map.h" "sparse_factory.h")
+HEADERS=("sparse_set.h" "sparse_map.h" "sparse_factory.h" "sparse_view.h" "sparse_group.h" "sparse_parallel.h" "sparse_concurrent.h" "sparse_sharded.h" "sparse_command.h")
 
 rm $OUTFILE
 
@@ -12,5 +12,5 @@ echo "*/" >> $OUTFILE
 
 for VALUE in "${HEADERS[@]}"
 do
-    sed -e '/#include "'${HEADERS[0]}'"/d' -e '/#include "'${HEADERS[1]}'"/d' -e '/#include "'${HEADERS[2]}'"/d' $VALUE >> $OUTFILE
+    sed -e '/#include "'${HEADERS[0]}'"/d' -e '/#include "'${HEADERS[1]}'"/d' -e '/#include "'${HEADERS[2]}'"/d' -e '/#include "'${HEADERS[3]}'"/d' -e '/#include "'${HEADERS[4]}'"/d' -e '/#include "'${HEADERS[5]}'"/d' -e '/#include "'${HEADERS[6]}'"/d' -e '/#include "'${HEADERS[7]}'"/d' -e '/#include "'${HEADERS[8]}'"/d' $VALUE >> $OUTFILE
 done
@@ -0,0 +1,342 @@
+//
+// Deferred add/remove/assign commands recorded from worker threads.
+//
+
+#ifndef PSSET_SPARSE_COMMAND_H
+#define PSSET_SPARSE_COMMAND_H
+
+
+#include "sparse_factory.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace psset
+{
+
+    namespace detail
+    {
+        // Payload bytes per arena block; larger payloads get a block of their own.
+        const std::size_t arena_block = 16384;
+
+        struct insert_op
+        {
+            template <typename Target, typename Payload>
+            static void apply(Target& t, Payload& p) { t.add(std::move(p)); }
+        };
+
+        struct emplace_op
+        {
+            template <typename Target, typename Payload>
+            static void apply(Target& t, Payload& p) { t.try_emplace(p.first, std::move(p.second)); }
+        };
+
+        struct assign_op
+        {
+            template <typename Target, typename Payload>
+            static void apply(Target& t, Payload& p) { t.insert_or_assign(p.first, std::move(p.second)); }
+        };
+
+        struct erase_op
+        {
+            template <typename Target, typename Payload>
+            static void apply(Target& t, Payload& p) { t.remove(p); }
+        };
+
+        struct factory_assign_op
+        {
+            template <typename Target, typename Payload>
+            static void apply(Target& t, Payload& p)
+            {
+                if (t.exists(p.first))
+                    t.at(p.first) = std::move(p.second);
+            }
+        };
+    }
+
+    // Records add, remove and assign operations on sets, maps and factories from
+    // any number of threads and applies them later, at a point where no thread
+    // touches those containers. Every thread writes into an arena of its own, so
+    // recording takes no lock after a thread's first command. flush() orders the
+    // commands by target and key, keeping the recorded order for each key of a
+    // thread, and applies them one target at a time.
+    class command_buffer
+    {
+    public:
+        command_buffer();
+        command_buffer(const command_buffer&) = delete;
+        command_buffer& operator=(const command_buffer&) = delete;
+        ~command_buffer();
+
+        template <typename T, typename Hash, typename Policy, typename Index>
+        void add(sparse_set<T, Hash, Policy, Index>& set, T x);
+        template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+        void add(sparse_map<Key, Value, Hash, Policy, Index>& map, const Key& k, Value v);
+        template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+        void assign(sparse_map<Key, Value, Hash, Policy, Index>& map, const Key& k, Value v);
+        template <typename Value, typename Index>
+        void assign(sparse_factory<Value, Index>& factory, typename sparse_factory<Value, Index>::ValueId id, Value v);
+
+        template <typename T, typename Hash, typename Policy, typename Index>
+        void remove(sparse_set<T, Hash, Policy, Index>& set, const T& k);
+        template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+        void remove(sparse_map<Key, Value, Hash, Policy, Index>& map, const Key& k);
+        template <typename Value, typename Index>
+        void remove(sparse_factory<Value, Index>& factory, typename sparse_factory<Value, Index>::ValueId id);
+
+        // At a sync point only.
+        void flush();
+        void clear();
+        std::size_t size() const;
+        bool empty() const;
+
+    private:
+        struct command
+        {
+            void* target;
+            unsigned int key;
+            void (*apply)(void* target, void* payload);
+            void (*destroy)(void* payload);
+            void* payload;
+        };
+
+        struct block
+        {
+            std::unique_ptr<char[]> data;
+            std::size_t size;
+        };
+
+        struct arena
+        {
+            std::vector<command> commands;
+            std::vector<block> blocks;
+            std::size_t current = 0;
+            std::size_t used = 0;
+
+            void* allocate(std::size_t size, std::size_t align);
+            void reset();
+        };
+
+        template <typename Op, typename Target, typename Payload>
+        static void _apply(void* target, void* payload);
+        template <typename Payload>
+        static void _destroy(void* payload);
+
+        template <typename Op, typename Target, typename Payload>
+        void _record(Target& target, unsigned int key, Payload&& payload);
+        arena& _local();
+        void _discard(std::vector<command>& commands, std::size_t first);
+
+        detail::local_slot _slot; // where threads keep their arena for this buffer
+        std::mutex _m; // guards _arenas while a thread registers its arena
+        std::vector<std::unique_ptr<arena>> _arenas;
+    };
+
+    inline command_buffer::command_buffer()
+    {
+    }
+
+    inline command_buffer::~command_buffer()
+    {
+        clear();
+    }
+
+    template <typename T, typename Hash, typename Policy, typename Index>
+    void command_buffer::add(sparse_set<T, Hash, Policy, Index>& set, T x)
+    {
+        unsigned int key = Hash()(x);
+        _record<detail::insert_op>(set, key, std::move(x));
+    }
+
+    template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void command_buffer::add(sparse_map<Key, Value, Hash, Policy, Index>& map, const Key& k, Value v) // keeps the value of a contained key, like try_emplace
+    {
+        _record<detail::emplace_op>(map, Hash()(k), std::make_pair(k, std::move(v)));
+    }
+
+    template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void command_buffer::assign(sparse_map<Key, Value, Hash, Policy, Index>& map, const Key& k, Value v) // insert_or_assign
+    {
+        _record<detail::assign_op>(map, Hash()(k), std::make_pair(k, std::move(v)));
+    }
+
+    template <typename Value, typename Index>
+    void command_buffer::assign(sparse_factory<Value, Index>& factory, typename sparse_factory<Value, Index>::ValueId id, Value v) // dropped if id is gone by then
+    {
+        using hash = typename sparse_factory<Value, Index>::ValueIdHash;
+        _record<detail::factory_assign_op>(factory, hash()(id), std::make_pair(id, std::move(v)));
+    }
+
+    template <typename T, typename Hash, typename Policy, typename Index>
+    void command_buffer::remove(sparse_set<T, Hash, Policy, Index>& set, const T& k)
+    {
+        _record<detail::erase_op>(set, Hash()(k), T(k));
+    }
+
+    template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void command_buffer::remove(sparse_map<Key, Value, Hash, Policy, Index>& map, const Key& k)
+    {
+        _record<detail::erase_op>(map, Hash()(k), Key(k));
+    }
+
+    template <typename Value, typename Index>
+    void command_buffer::remove(sparse_factory<Value, Index>& factory, typename sparse_factory<Value, Index>::ValueId id)
+    {
+        using hash = typename sparse_factory<Value, Index>::ValueIdHash;
+        _record<detail::erase_op>(factory, hash()(id), id);
+    }
+
+    inline void command_buffer::flush() // commands left after a throwing one are dropped
+    {
+        std::vector<command> commands;
+        commands.reserve(size());
+
+        for (auto& a : _arenas) // registration order keeps a thread's arenas in recording order
+            commands.insert(commands.end(), a->commands.begin(), a->commands.end());
+
+        std::stable_sort(commands.begin(), commands.end(), [](const command& a, const command& b) {
+            if (a.target != b.target)
+                return std::less<void*>()(a.target, b.target);
+            return a.key < b.key;
+        });
+
+        for (std::size_t i = 0; i < commands.size(); i++)
+        {
+            try
+            {
+                commands[i].apply(commands[i].target, commands[i].payload);
+            }
+            catch (...)
+            {
+                _discard(commands, i);
+                throw;
+            }
+
+            commands[i].destroy(commands[i].payload);
+        }
+
+        for (auto& a : _arenas)
+            a->reset();
+    }
+
+    inline void command_buffer::clear() // drops every pending command, the arenas are kept for reuse
+    {
+        for (auto& a : _arenas)
+        {
+            for (auto& c : a->commands)
+                c.destroy(c.payload);
+
+            a->reset();
+        }
+    }
+
+    inline std::size_t command_buffer::size() const
+    {
+        std::size_t n = 0;
+
+        for (const auto& a : _arenas)
+            n += a->commands.size();
+
+        return n;
+    }
+
+    inline bool command_buffer::empty() const
+    {
+        return size() == 0;
+    }
+
+    inline void *command_buffer::arena::allocate(std::size_t size, std::size_t align) // bump allocation, blocks survive reset()
+    {
+        for (;;)
+        {
+            if (current < blocks.size())
+            {
+                std::size_t offset = (used + align - 1) & ~(align - 1);
+
+                if (offset + size <= blocks[current].size)
+                {
+                    used = offset + size;
+                    return blocks[current].data.get() + offset;
+                }
+
+                current++;
+                used = 0;
+                continue;
+            }
+
+            std::size_t block_size = std::max(detail::arena_block, size);
+            blocks.push_back({std::unique_ptr<char[]>(new char[block_size]), block_size});
+            used = 0;
+        }
+    }
+
+    inline void command_buffer::arena::reset()
+    {
+        commands.clear();
+        current = 0;
+        used = 0;
+    }
+
+    template <typename Op, typename Target, typename Payload>
+    void command_buffer::_apply(void* target, void* payload)
+    {
+        Op::apply(*static_cast<Target*>(target), *static_cast<Payload*>(payload));
+    }
+
+    template <typename Payload>
+    void command_buffer::_destroy(void* payload)
+    {
+        static_cast<Payload*>(payload)->~Payload();
+    }
+
+    template <typename Op, typename Target, typename Payload>
+    void command_buffer::_record(Target& target, unsigned int key, Payload&& payload)
+    {
+        using stored = typename std::decay<Payload>::type;
+        static_assert(alignof(stored) <= alignof(std::max_align_t), "over-aligned payloads are not supported");
+
+        arena& a = _local();
+        if (a.commands.size() == a.commands.capacity()) // nothing can throw once the payload is built
+            a.commands.reserve(2 * a.commands.capacity() + 1);
+
+        void* mem = a.allocate(sizeof(stored), alignof(stored));
+        new (mem) stored(std::forward<Payload>(payload));
+
+        a.commands.push_back({&target, key, &_apply<Op, Target, stored>, &_destroy<stored>, mem});
+    }
+
+    inline command_buffer::arena &command_buffer::_local() // the calling thread's arena, registered on first use
+    {
+        if (void* a = _slot.find())
+            return *static_cast<arena*>(a);
+
+        arena* a;
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _arenas.emplace_back(new arena);
+            a = _arenas.back().get();
+        }
+
+        _slot.insert(a);
+        return *a;
+    }
+
+    inline void command_buffer::_discard(std::vector<command>& commands, std::size_t first)
+    {
+        for (std::size_t i = first; i < commands.size(); i++)
+            commands[i].destroy(commands[i].payload);
+
+        for (auto& a : _arenas)
+            a->reset();
+    }
+
+}
+
+
+#endif //PSSET_SPARSE_COMMAND_H
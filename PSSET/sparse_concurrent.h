@@ -0,0 +1,534 @@
+//
+// Single-writer / multi-reader sparse map with RCU-style publication.
+//
+
+#ifndef PSSET_SPARSE_CONCURRENT_H
+#define PSSET_SPARSE_CONCURRENT_H
+
+
+#include "sparse_set.h"
+
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+namespace psset
+{
+
+    namespace detail
+    {
+        // Reader counters are spread over this many cache lines; a thread always uses the same one.
+        const unsigned int reader_stripes = 16;
+
+        inline unsigned int reader_stripe()
+        {
+            static std::atomic<unsigned int> next(0);
+            static thread_local unsigned int stripe = next.fetch_add(1, std::memory_order_relaxed) % reader_stripes;
+            return stripe;
+        }
+
+        // Writes compact the current block once it holds more dead slots than live ones, and at least this many.
+        const unsigned int compact_holes = 64;
+
+        struct alignas(cache_line) reader_counter
+        {
+            std::atomic<unsigned long> count;
+        };
+    }
+
+    // A sparse_map that one writer thread mutates while any number of reader
+    // threads look entries up without taking locks.
+    //
+    // Dense slots are written once, before they are published through the
+    // sparse index, and never change afterwards: remove() only clears the sparse
+    // slot and insert_or_assign() appends a new slot and repoints it. Growth, and
+    // compaction once dead slots outnumber live ones, copy the live entries into a new block, publish it with an
+    // atomic pointer and retire the old block. Readers count themselves under
+    // one of two epoch parities in striped counters. A retired block is freed
+    // after both parities have been seen empty since it was retired: a reader
+    // that pinned it registered before the new block went out, so it kept one
+    // of the two counts up until it left. The writer flips the epoch while a
+    // block waits on the current parity, so new readers let that one drain.
+    //
+    // The sparse index is a flat array sized to the largest key, and Hash must be
+    // callable from several threads at once.
+    template <typename Key, typename Value, typename Hash, typename Index = unsigned int>
+    class concurrent_sparse_map
+    {
+        static_assert(std::is_integral<Index>::value && std::is_unsigned<Index>::value,
+                      "concurrent_sparse_map index type must be an unsigned integer");
+
+        struct block;
+
+    public:
+        using key_type = Key;
+        using mapped_type = Value;
+        using index_type = Index;
+        static constexpr Index npos = std::numeric_limits<Index>::max();
+
+        // Pins the current block for as long as it lives; references handed out stay valid until then.
+        class reader
+        {
+        public:
+            explicit reader(const concurrent_sparse_map& map);
+            reader(reader&& other) noexcept;
+            reader(const reader&) = delete;
+            reader& operator=(const reader&) = delete;
+            reader& operator=(reader&&) = delete;
+            ~reader();
+
+            template <typename K>
+            const Value* find(const K& k) const;
+            template <typename K>
+            bool contains(const K& k) const;
+            template <typename K>
+            const Value& at(const K& k) const;
+            template <typename F>
+            void for_each(F f) const;
+
+        private:
+            const concurrent_sparse_map* _map;
+            const block* _block;
+            unsigned int _parity;
+            unsigned int _stripe;
+        };
+
+        concurrent_sparse_map();
+        concurrent_sparse_map(const concurrent_sparse_map&) = delete;
+        concurrent_sparse_map& operator=(const concurrent_sparse_map&) = delete;
+        ~concurrent_sparse_map();
+
+        // Writer thread only.
+        void add(const Key& k, const Value& v);
+        void insert_or_assign(const Key& k, const Value& v);
+        template <typename K>
+        void remove(const K& k);
+        void reclaim();
+
+        // Any thread.
+        reader read() const;
+        template <typename K>
+        bool contains(const K& k) const;
+        template <typename K>
+        bool try_get(const K& k, Value& out) const;
+        template <typename K>
+        Value at(const K& k) const;
+        Index size() const;
+
+    private:
+        struct block
+        {
+            unsigned long long key_cap;
+            Index capacity;
+            std::atomic<Index> n;
+            std::atomic<Index>* sparse;
+            Key* keys;
+            Value* values;
+
+            template <typename K>
+            Index search(const Hash& hash, const K& k) const;
+        };
+
+        struct retired
+        {
+            block* b;
+            bool drained[2]; // parity seen without readers since b was retired
+        };
+
+        static block* _make_block(unsigned long long key_cap, Index capacity);
+        static void _free_block(block* b);
+
+        void _append(const Key& k, unsigned int val, const Value& v);
+        block* _grow(unsigned int val);
+        void _add_hole();
+        void _retire(block* b);
+        unsigned long _readers(unsigned int parity) const;
+
+        Hash _hash;
+        std::atomic<block*> _block;
+        std::atomic<Index> _size;
+        Index _holes; // dead dense slots of the current block, writer only
+        std::vector<retired> _retired; // writer only
+
+        mutable std::atomic<unsigned int> _epoch;
+        mutable detail::reader_counter _readers_in[2][detail::reader_stripes];
+    };
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    constexpr Index concurrent_sparse_map<Key, Value, Hash, Index>::npos;
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    Index concurrent_sparse_map<Key, Value, Hash, Index>::block::search(const Hash& hash, const K& k) const
+    {
+        unsigned int val = hash(k);
+
+        if (val >= key_cap)
+            return npos;
+
+        return sparse[val].load(std::memory_order_acquire); // pairs with the release in _append, the slot is complete
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    concurrent_sparse_map<Key, Value, Hash, Index>::reader::reader(const concurrent_sparse_map& map) : _map(&map)
+    {
+        _stripe = detail::reader_stripe();
+
+        for (;;)
+        {
+            unsigned int epoch = map._epoch.load();
+            _parity = epoch & 1U;
+            map._readers_in[_parity][_stripe].count.fetch_add(1);
+
+            if (map._epoch.load() == epoch) // a writer flipping from here on waits for this reader
+                break;
+
+            map._readers_in[_parity][_stripe].count.fetch_sub(1);
+        }
+
+        _block = map._block.load();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    concurrent_sparse_map<Key, Value, Hash, Index>::reader::reader(reader&& other) noexcept
+        : _map(other._map), _block(other._block), _parity(other._parity), _stripe(other._stripe)
+    {
+        other._map = nullptr;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    concurrent_sparse_map<Key, Value, Hash, Index>::reader::~reader()
+    {
+        if (_map != nullptr)
+            _map->_readers_in[_parity][_stripe].count.fetch_sub(1);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    const Value *concurrent_sparse_map<Key, Value, Hash, Index>::reader::find(const K& k) const // nullptr if k is not contained
+    {
+        Index idx = _block->search(_map->_hash, k);
+
+        return idx == npos ? nullptr : &_block->values[idx];
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    bool concurrent_sparse_map<Key, Value, Hash, Index>::reader::contains(const K& k) const
+    {
+        return _block->search(_map->_hash, k) != npos;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    const Value &concurrent_sparse_map<Key, Value, Hash, Index>::reader::at(const K& k) const
+    {
+        const Value* v = find(k);
+
+        if (v == nullptr)
+            throw std::out_of_range("key not found in concurrent smap.");
+
+        return *v;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename F>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::reader::for_each(F f) const // f(key, value) for the entries live in the pinned block
+    {
+        Index n = _block->n.load(std::memory_order_acquire);
+
+        for (Index i = 0; i < n; i++)
+        {
+            if (_block->search(_map->_hash, _block->keys[i]) == i)
+                f(_block->keys[i], _block->values[i]);
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    concurrent_sparse_map<Key, Value, Hash, Index>::concurrent_sparse_map()
+        : _block(_make_block(0, 0)), _size(0), _holes(0), _epoch(0)
+    {
+        for (auto& parity : _readers_in)
+        {
+            for (auto& counter : parity)
+                counter.count.store(0);
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    concurrent_sparse_map<Key, Value, Hash, Index>::~concurrent_sparse_map() // no reader may be left
+    {
+        for (auto& r : _retired)
+            _free_block(r.b);
+
+        _free_block(_block.load());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::add(const Key& k, const Value& v) // keeps the value of a contained key
+    {
+        if (_block.load(std::memory_order_relaxed)->search(_hash, k) != npos)
+            return;
+
+        _append(k, _hash(k), v);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::insert_or_assign(const Key& k, const Value& v) // readers see the old or the new value, never a mix
+    {
+        _append(k, _hash(k), v);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::remove(const K& k) // the dense slot stays readable until the next compaction
+    {
+        block* b = _block.load(std::memory_order_relaxed);
+        Index idx = b->search(_hash, k);
+
+        if (idx == npos)
+            return;
+
+        b->sparse[_hash(k)].store(npos, std::memory_order_release);
+        _size.store(_size.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        _add_hole();
+
+        if (!_retired.empty())
+            reclaim();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::reclaim() // frees retired blocks no reader can see anymore, also run by every write
+    {
+        std::size_t kept = 0;
+
+        bool waiting = false;
+
+        for (unsigned int parity = 0; parity < 2; parity++)
+        {
+            if (_readers(parity) != 0)
+                continue;
+
+            for (auto& r : _retired)
+                r.drained[parity] = true;
+        }
+
+        unsigned int epoch = _epoch.load();
+
+        for (std::size_t i = 0; i < _retired.size(); i++)
+        {
+            if (_retired[i].drained[0] && _retired[i].drained[1])
+            {
+                _free_block(_retired[i].b);
+                continue;
+            }
+
+            waiting = waiting || !_retired[i].drained[epoch & 1U];
+            _retired[kept++] = _retired[i];
+        }
+
+        _retired.resize(kept);
+
+        if (waiting)
+            _epoch.store(epoch + 1); // new readers count under the other parity, this one can drain
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    typename concurrent_sparse_map<Key, Value, Hash, Index>::reader concurrent_sparse_map<Key, Value, Hash, Index>::read() const
+    {
+        return reader(*this);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    bool concurrent_sparse_map<Key, Value, Hash, Index>::contains(const K& k) const
+    {
+        return reader(*this).contains(k);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    bool concurrent_sparse_map<Key, Value, Hash, Index>::try_get(const K& k, Value& out) const // copies the value out while the block is pinned
+    {
+        reader r(*this);
+        const Value* v = r.find(k);
+
+        if (v == nullptr)
+            return false;
+
+        out = *v;
+        return true;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    template<typename K>
+    Value concurrent_sparse_map<Key, Value, Hash, Index>::at(const K& k) const
+    {
+        return reader(*this).at(k);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    Index concurrent_sparse_map<Key, Value, Hash, Index>::size() const // exact on the writer, a recent value elsewhere
+    {
+        return _size.load(std::memory_order_relaxed);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    typename concurrent_sparse_map<Key, Value, Hash, Index>::block *concurrent_sparse_map<Key, Value, Hash, Index>::_make_block(unsigned long long key_cap, Index capacity)
+    {
+        block* b = new block;
+        b->key_cap = key_cap;
+        b->capacity = capacity;
+        b->n.store(0, std::memory_order_relaxed);
+        b->sparse = nullptr;
+        b->keys = nullptr;
+        b->values = nullptr;
+
+        try
+        {
+            b->sparse = new std::atomic<Index>[key_cap];
+            for (unsigned long long i = 0; i < key_cap; i++)
+                b->sparse[i].store(npos, std::memory_order_relaxed);
+
+            b->keys = detail::allocate<Key>(capacity);
+            b->values = detail::allocate<Value>(capacity);
+        }
+        catch (...)
+        {
+            _free_block(b);
+            throw;
+        }
+
+        return b;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::_free_block(block* b) // dead slots are destroyed here, not on removal
+    {
+        Index n = b->n.load(std::memory_order_relaxed);
+
+        if (b->keys != nullptr)
+            detail::destroy(b->keys, b->keys + n);
+        if (b->values != nullptr)
+            detail::destroy(b->values, b->values + n);
+
+        detail::deallocate(b->keys);
+        detail::deallocate(b->values);
+        delete [] b->sparse;
+        delete b;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::_append(const Key& k, unsigned int val, const Value& v)
+    {
+        block* b = _block.load(std::memory_order_relaxed);
+
+        if (val >= b->key_cap || b->n.load(std::memory_order_relaxed) == b->capacity)
+            b = _grow(val);
+
+        Index n = b->n.load(std::memory_order_relaxed);
+        new (&b->keys[n]) Key(k);
+
+        try
+        {
+            new (&b->values[n]) Value(v);
+        }
+        catch (...)
+        {
+            b->keys[n].~Key();
+            throw;
+        }
+
+        b->n.store(n + 1, std::memory_order_release);
+
+        if (b->sparse[val].exchange(n, std::memory_order_acq_rel) == npos) // publishes the slot
+            _size.store(_size.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        else
+            _add_hole();
+
+        if (!_retired.empty())
+            reclaim();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    typename concurrent_sparse_map<Key, Value, Hash, Index>::block *concurrent_sparse_map<Key, Value, Hash, Index>::_grow(unsigned int val) // copies the live entries into a new block and publishes it
+    {
+        block* old = _block.load(std::memory_order_relaxed);
+
+        unsigned long long key_cap = std::max(old->key_cap, 1ULL);
+        while (key_cap <= val)
+            key_cap <<= 1U;
+
+        Index live = _size.load(std::memory_order_relaxed);
+        Index headroom = static_cast<Index>(std::min<unsigned long long>(live + live / 2ULL, npos - 1));
+        Index capacity = detail::next_capacity(headroom); // updates append, so a full copy must leave room for many of them
+        if (old->n.load(std::memory_order_relaxed) < old->capacity)
+            capacity = std::max(capacity, old->capacity); // only the key range grew
+
+        if (capacity == live)
+            throw std::length_error("concurrent_sparse_map index type exhausted.");
+
+        block* b = _make_block(key_cap, capacity);
+        Index n = 0;
+
+        try
+        {
+            for (Index i = 0; i < old->n.load(std::memory_order_relaxed); i++)
+            {
+                unsigned int key_val = _hash(old->keys[i]);
+
+                if (old->sparse[key_val].load(std::memory_order_relaxed) != i)
+                    continue;
+
+                new (&b->keys[n]) Key(old->keys[i]); // copied, readers may still be reading the old slot
+                new (&b->values[n]) Value(old->values[i]);
+                b->n.store(n + 1, std::memory_order_relaxed);
+                b->sparse[key_val].store(n, std::memory_order_relaxed);
+                n++;
+            }
+        }
+        catch (...)
+        {
+            _free_block(b);
+            throw;
+        }
+
+        _block.store(b); // publishes the whole block
+        _holes = 0;
+        _retire(old);
+
+        return b;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::_add_hole()
+    {
+        _holes++;
+
+        if (_holes >= detail::compact_holes && _holes > _size.load(std::memory_order_relaxed))
+            _grow(0); // same key range, only the live entries are copied
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    void concurrent_sparse_map<Key, Value, Hash, Index>::_retire(block* b)
+    {
+        _retired.push_back({b, {false, false}}); // only counts seen from here on prove the readers of b gone
+        reclaim();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Index>
+    unsigned long concurrent_sparse_map<Key, Value, Hash, Index>::_readers(unsigned int parity) const
+    {
+        unsigned long readers = 0;
+
+        for (const auto& counter : _readers_in[parity])
+            readers += counter.count.load();
+
+        return readers;
+    }
+
+}
+
+
+#endif //PSSET_SPARSE_CONCURRENT_H
@@ -7,11 +7,384 @@
 
 
 #include "sparse_map.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 namespace psset
 {
-    template<typename Value>
+
+    namespace detail
+    {
+        // Handles a thread moves between its cache and the global free list at once.
+        const unsigned int handle_batch = 64;
+
+        // Ids that tell apart objects reusing a local_slot.
+        inline unsigned long instance_id()
+        {
+            static std::atomic<unsigned long> next(1);
+            return next.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Gives a live object a small number of its own, reused once it dies, at
+        // which every thread files its state for that object. A thread's table
+        // grows to the most objects alive at once and never evicts; the id tells
+        // an entry left by a dead object from one of the current holder.
+        class local_slot
+        {
+        public:
+            local_slot();
+            local_slot(const local_slot&) = delete;
+            local_slot& operator=(const local_slot&) = delete;
+            ~local_slot();
+
+            void* find() const; // the calling thread's entry, nullptr before insert()
+            void insert(void* entry) const;
+
+        private:
+            struct entry
+            {
+                unsigned long id;
+                void* value;
+            };
+
+            struct registry
+            {
+                std::mutex m;
+                std::vector<std::size_t> unused;
+                std::size_t count = 0;
+            };
+
+            static registry& _registry();
+            static std::vector<entry>& _entries();
+
+            std::size_t _index;
+            unsigned long _id;
+        };
+
+        inline local_slot::local_slot() : _id(instance_id())
+        {
+            registry& r = _registry();
+            std::lock_guard<std::mutex> lock(r.m);
+
+            if (r.unused.empty())
+            {
+                _index = r.count++;
+                return;
+            }
+
+            _index = r.unused.back();
+            r.unused.pop_back();
+        }
+
+        inline local_slot::~local_slot()
+        {
+            registry& r = _registry();
+            std::lock_guard<std::mutex> lock(r.m);
+            r.unused.push_back(_index);
+        }
+
+        inline void *local_slot::find() const
+        {
+            const std::vector<entry>& entries = _entries();
+
+            if (_index < entries.size() && entries[_index].id == _id)
+                return entries[_index].value;
+
+            return nullptr;
+        }
+
+        inline void local_slot::insert(void* value) const
+        {
+            std::vector<entry>& entries = _entries();
+
+            if (_index >= entries.size())
+                entries.resize(_index + 1, entry{0, nullptr});
+
+            entries[_index] = entry{_id, value};
+        }
+
+        inline local_slot::registry &local_slot::_registry()
+        {
+            static registry r;
+            return r;
+        }
+
+        inline std::vector<local_slot::entry> &local_slot::_entries()
+        {
+            static thread_local std::vector<entry> entries;
+            return entries;
+        }
+    }
+
+    // Hands out handles to any number of threads at once. A thread works from a
+    // cache of its own: handles it released, then a batch taken from the global
+    // free list, then a block of fresh indices. The free list is a lock-free
+    // stack of batches whose head carries a tag against ABA. acquire() and
+    // release() serve the one thread that owns the allocator from a cache held
+    // in the allocator itself, without a thread-local lookup.
+    class handle_allocator
+    {
+    public:
+        using handle = unsigned long;
+
+        handle_allocator();
+        handle_allocator(const handle_allocator&) = delete;
+        handle_allocator& operator=(const handle_allocator&) = delete;
+        ~handle_allocator();
+
+        // Owner thread only, never while another thread calls the _concurrent ones.
+        handle acquire();
+        void release(handle h);
+
+        // Any number of threads at once.
+        handle acquire_concurrent();
+        void release_concurrent(handle h);
+
+        // At a sync point only.
+        void flush();
+
+        handle bound() const;
+        std::size_t caches() const;
+
+    private:
+        struct node
+        {
+            handle handles[detail::handle_batch];
+            unsigned int count;
+            std::atomic<unsigned int> next;
+        };
+
+        struct cache
+        {
+            std::vector<handle> recycled;
+            handle fresh = 0;
+            handle fresh_end = 0;
+        };
+
+        // Node chunk c holds 2^c * first_chunk nodes, so a few chunks cover any count.
+        static const unsigned int first_chunk_bits = 6;
+        static const unsigned int chunk_count = 32 - first_chunk_bits;
+
+        cache& _local();
+        handle _acquire(cache& c);
+        void _release(cache& c, handle h);
+        void _drain(cache& c);
+        void _give_back(handle* first, unsigned int count);
+        unsigned int _pop(std::atomic<unsigned long long>& head);
+        void _push(std::atomic<unsigned long long>& head, unsigned int n);
+        unsigned int _new_node();
+        node& _node(unsigned int n);
+
+        std::atomic<handle> _next; // first index never handed out
+        std::atomic<unsigned long long> _full; // batches of released handles, tag << 32 | node
+        std::atomic<unsigned long long> _empty; // nodes to reuse
+        std::atomic<unsigned int> _node_count;
+        std::atomic<node*> _chunks[chunk_count];
+
+        cache _owner;
+        detail::local_slot _slot; // where threads keep their cache for this allocator
+        mutable std::mutex _m; // guards _caches while a thread registers its cache
+        std::vector<std::unique_ptr<cache>> _caches;
+    };
+
+    inline handle_allocator::handle_allocator()
+        : _next(0), _full(0), _empty(0), _node_count(0)
+    {
+        for (auto& chunk : _chunks)
+            chunk.store(nullptr, std::memory_order_relaxed);
+    }
+
+    inline handle_allocator::~handle_allocator()
+    {
+        for (auto& chunk : _chunks)
+            delete [] chunk.load(std::memory_order_relaxed);
+    }
+
+    inline handle_allocator::handle handle_allocator::acquire()
+    {
+        return _acquire(_owner);
+    }
+
+    inline void handle_allocator::release(handle h)
+    {
+        _release(_owner, h);
+    }
+
+    inline handle_allocator::handle handle_allocator::acquire_concurrent()
+    {
+        return _acquire(_local());
+    }
+
+    inline void handle_allocator::release_concurrent(handle h)
+    {
+        _release(_local(), h);
+    }
+
+    inline void handle_allocator::flush() // empties every cache into the global free list
+    {
+        std::lock_guard<std::mutex> lock(_m);
+
+        _drain(_owner);
+        for (auto& c : _caches)
+            _drain(*c);
+    }
+
+    inline handle_allocator::handle handle_allocator::bound() const // no handle has an index at or above this one
+    {
+        return _next.load(std::memory_order_relaxed);
+    }
+
+    inline std::size_t handle_allocator::caches() const // threads that used the allocator concurrently so far
+    {
+        std::lock_guard<std::mutex> lock(_m);
+        return _caches.size();
+    }
+
+    inline handle_allocator::cache &handle_allocator::_local() // the calling thread's cache, registered on first use
+    {
+        if (void* c = _slot.find())
+            return *static_cast<cache*>(c);
+
+        cache* c;
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _caches.emplace_back(new cache);
+            c = _caches.back().get();
+        }
+
+        _slot.insert(c);
+        return *c;
+    }
+
+    inline handle_allocator::handle handle_allocator::_acquire(cache& c)
+    {
+        if (c.recycled.empty())
+        {
+            unsigned int n = _pop(_full);
+
+            if (n != 0)
+            {
+                node& batch = _node(n);
+                c.recycled.assign(batch.handles, batch.handles + batch.count);
+                _push(_empty, n);
+            }
+        }
+
+        if (!c.recycled.empty())
+        {
+            handle h = c.recycled.back();
+            c.recycled.pop_back();
+            return h;
+        }
+
+        if (c.fresh == c.fresh_end)
+        {
+            c.fresh = _next.fetch_add(detail::handle_batch, std::memory_order_relaxed);
+            c.fresh_end = c.fresh + detail::handle_batch;
+        }
+
+        return c.fresh++;
+    }
+
+    inline void handle_allocator::_release(cache& c, handle h) // a full cache passes a batch on to the global free list
+    {
+        c.recycled.push_back(h);
+
+        if (c.recycled.size() >= 2 * detail::handle_batch)
+        {
+            _give_back(c.recycled.data() + c.recycled.size() - detail::handle_batch, detail::handle_batch);
+            c.recycled.resize(c.recycled.size() - detail::handle_batch);
+        }
+    }
+
+    inline void handle_allocator::_drain(cache& c)
+    {
+        for (; c.fresh != c.fresh_end; c.fresh++)
+            c.recycled.push_back(c.fresh);
+
+        for (std::size_t i = 0; i < c.recycled.size(); i += detail::handle_batch)
+            _give_back(c.recycled.data() + i, static_cast<unsigned int>(std::min<std::size_t>(detail::handle_batch, c.recycled.size() - i)));
+
+        c.recycled.clear();
+    }
+
+    inline void handle_allocator::_give_back(handle* first, unsigned int count)
+    {
+        unsigned int n = _pop(_empty);
+        if (n == 0)
+            n = _new_node();
+
+        node& batch = _node(n);
+        std::copy(first, first + count, batch.handles);
+        batch.count = count;
+
+        _push(_full, n);
+    }
+
+    inline unsigned int handle_allocator::_pop(std::atomic<unsigned long long>& head) // 0 if the list is empty
+    {
+        unsigned long long h = head.load(std::memory_order_acquire);
+
+        for (;;)
+        {
+            auto n = static_cast<unsigned int>(h);
+            if (n == 0)
+                return 0;
+
+            unsigned long long next = _node(n).next.load(std::memory_order_relaxed); // stale if n moved on, the tag fails the exchange then
+            if (head.compare_exchange_weak(h, ((h >> 32U) + 1) << 32U | next, std::memory_order_acquire, std::memory_order_acquire))
+                return n;
+        }
+    }
+
+    inline void handle_allocator::_push(std::atomic<unsigned long long>& head, unsigned int n)
+    {
+        unsigned long long h = head.load(std::memory_order_relaxed);
+
+        for (;;)
+        {
+            _node(n).next.store(static_cast<unsigned int>(h), std::memory_order_relaxed);
+            if (head.compare_exchange_weak(h, ((h >> 32U) + 1) << 32U | n, std::memory_order_release, std::memory_order_relaxed))
+                return;
+        }
+    }
+
+    inline unsigned int handle_allocator::_new_node() // node numbers start at 1, 0 ends a list
+    {
+        unsigned int n = _node_count.fetch_add(1, std::memory_order_relaxed) + 1;
+        unsigned int pos = n + (1U << first_chunk_bits) - 1;
+
+        unsigned int c = 0;
+        while ((pos >> (c + first_chunk_bits + 1)) != 0)
+            c++;
+
+        if (_chunks[c].load(std::memory_order_acquire) == nullptr)
+        {
+            node* fresh = new node[std::size_t(1) << (c + first_chunk_bits)];
+            node* expected = nullptr;
+
+            if (!_chunks[c].compare_exchange_strong(expected, fresh, std::memory_order_acq_rel))
+                delete [] fresh;
+        }
+
+        return n;
+    }
+
+    inline handle_allocator::node &handle_allocator::_node(unsigned int n)
+    {
+        unsigned int pos = n + (1U << first_chunk_bits) - 1;
+
+        unsigned int c = 0;
+        while ((pos >> (c + first_chunk_bits + 1)) != 0)
+            c++;
+
+        return _chunks[c].load(std::memory_order_acquire)[pos - (1U << (c + first_chunk_bits))];
+    }
+    template<typename Value, typename Index = unsigned int>
     class sparse_factory
     {
     public:
@@ -26,113 +399,151 @@ namespace psset
         };
 
     public:
+        sparse_factory();
+
         ValueId create();
+        ValueId create_concurrent();
+        void reserve(Index n, unsigned int threads = std::thread::hardware_concurrency());
         const Value &at(ValueId p) const;
         Value &at(ValueId p);
         bool exists(ValueId p) const;
         void remove(ValueId p);
 
-        unsigned int size() const;
+        Index size() const;
 
-        using iterator = psset::KeyValue<ValueId, Value> *;
+        using iterator = typename psset::sparse_map<ValueId, Value, ValueIdHash, initialized_sparse, Index>::iterator;
+        using const_iterator = typename psset::sparse_map<ValueId, Value, ValueIdHash, initialized_sparse, Index>::const_iterator;
         iterator begin();
         iterator end();
-        const iterator begin() const;
-        const iterator end() const;
+        const_iterator begin() const;
+        const_iterator end() const;
 
     private:
         ValueId _inc_version(ValueId e) const;
 
-        ValueId _index_counter = 0;
-        psset::sparse_map<ValueId, Value, ValueIdHash> _used;
-        std::vector<ValueId> _unused;
+        std::unique_ptr<handle_allocator> _handles; // held by pointer, threads cache its address
+        psset::sparse_map<ValueId, Value, ValueIdHash, initialized_sparse, Index> _used;
     };
 
-    template<typename Value>
-    typename sparse_factory<Value>::ValueId sparse_factory<Value>::create()
+    template<typename Value, typename Index>
+    sparse_factory<Value, Index>::sparse_factory() : _handles(new handle_allocator)
     {
-        ValueId value_id;
+    }
 
-        if (_unused.empty())
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::ValueId sparse_factory<Value, Index>::create()
+    {
+        ValueId value_id = _handles->acquire();
+
+        try
         {
-            value_id = _index_counter++;
+            _used.add(value_id, Value());
         }
-        else
+        catch (...)
         {
-            value_id = _unused.back();
-            _unused.pop_back();
+            _handles->release(value_id);
+            throw;
         }
 
-        _used.add(value_id, Value());
+        return value_id;
+    }
+
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::ValueId sparse_factory<Value, Index>::create_concurrent() // any number of threads at once, after reserve()
+    {
+        ValueId value_id = _handles->acquire_concurrent();
+
+        try
+        {
+            _used.add_concurrent(value_id, Value());
+        }
+        catch (...)
+        {
+            _handles->release_concurrent(value_id);
+            throw;
+        }
 
         return value_id;
     }
 
-    template<typename Value>
-    const Value &sparse_factory<Value>::at(sparse_factory::ValueId p) const
+    template<typename Value, typename Index>
+    void sparse_factory<Value, Index>::reserve(Index n, unsigned int threads) // room for n more create_concurrent() calls from up to threads threads
+    {
+        // Every thread may leave most of a block of fresh indices unused.
+        unsigned long long callers = std::max<unsigned long long>(std::max<unsigned long long>(threads, _handles->caches()), 1);
+        unsigned long long slack = static_cast<unsigned long long>(detail::handle_batch) * callers;
+        unsigned long long key_cap = _handles->bound() + n + slack;
+
+        _handles->flush(); // released handles come back before fresh blocks are cut
+        _used.reserve_keys(static_cast<unsigned int>(std::min<unsigned long long>(key_cap, UINT_MAX)));
+        _used.reserve_elements(static_cast<Index>(std::min<unsigned long long>(static_cast<unsigned long long>(_used.size()) + n, _used.npos)));
+    }
+
+    template<typename Value, typename Index>
+    const Value &sparse_factory<Value, Index>::at(sparse_factory::ValueId p) const
     {
         return _used.at(p);
     }
 
-    template<typename Value>
-    Value &sparse_factory<Value>::at(sparse_factory::ValueId p)
+    template<typename Value, typename Index>
+    Value &sparse_factory<Value, Index>::at(sparse_factory::ValueId p)
     {
         return _used.at(p);
     }
 
-    template<typename Value>
-    bool sparse_factory<Value>::exists(sparse_factory::ValueId p) const
+    template<typename Value, typename Index>
+    bool sparse_factory<Value, Index>::exists(sparse_factory::ValueId p) const
     {
         auto idx = _used.search(p);
 
         if (idx >= _used.size())
             return false;
 
-        return _used.data()[idx].key == p;
+        return _used.keys()[idx] == p;
     }
 
-    template<typename Value>
-    void sparse_factory<Value>::remove(sparse_factory::ValueId p)
+    template<typename Value, typename Index>
+    void sparse_factory<Value, Index>::remove(sparse_factory::ValueId p)
     {
         if (exists(p))
         {
             _used.remove(p);
-            _unused.push_back(_inc_version(p));
+            _handles->release(_inc_version(p));
         }
     }
 
-    template<typename Value>
-    unsigned int sparse_factory<Value>::size() const
+    template<typename Value, typename Index>
+    Index sparse_factory<Value, Index>::size() const
     {
         return _used.size();
     }
 
-    template<typename Value>
-    typename sparse_factory<Value>::iterator sparse_factory<Value>::begin()
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::iterator sparse_factory<Value, Index>::begin()
     {
         return _used.begin();
     }
 
-    template<typename Value>
-    typename sparse_factory<Value>::iterator sparse_factory<Value>::end()
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::iterator sparse_factory<Value, Index>::end()
     {
         return _used.end();
     }
 
-    template<typename Value>
-    const typename sparse_factory<Value>::iterator sparse_factory<Value>::begin() const
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::const_iterator sparse_factory<Value, Index>::begin() const
     {
         return _used.begin();
     }
 
-    template<typename Value>
-    const typename sparse_factory<Value>::iterator sparse_factory<Value>::end() const
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::const_iterator sparse_factory<Value, Index>::end() const
     {
         return _used.end();
     }
 
-    template<typename Value>
-    typename sparse_factory<Value>::ValueId sparse_factory<Value>::_inc_version(typename sparse_factory<ValueId>::ValueId p) const
+    template<typename Value, typename Index>
+    typename sparse_factory<Value, Index>::ValueId sparse_factory<Value, Index>::_inc_version(typename sparse_factory<Value, Index>::ValueId p) const
     {
         return (p & 0x00000000FFFFFFFF) | ((p + 0x0000000100000000) & 0xFFFFFFFF00000000);
     }
@@ -0,0 +1,173 @@
+//
+// Owning groups that keep several sparse_maps co-packed.
+//
+
+#ifndef PSSET_SPARSE_GROUP_H
+#define PSSET_SPARSE_GROUP_H
+
+
+#include "sparse_view.h"
+
+#include <cstddef>
+#include <tuple>
+#include <utility>
+
+namespace psset
+{
+
+    // Keeps the keys contained in all of Maps at the front of every map, in the
+    // same order, so that position i < size() refers to the same key in each of
+    // them. While grouped, keys must be added to and removed from the maps
+    // through the group; it only ever reorders them with swap_positions().
+    template <typename... Maps>
+    class group
+    {
+        static_assert(sizeof...(Maps) > 1, "a group needs at least two maps");
+
+        using pools_seq = detail::make_index_sequence<sizeof...(Maps)>;
+
+    public:
+        using key_type = typename detail::first_pool<Maps...>::type::key_type;
+
+        template <std::size_t I>
+        using mapped_type = typename std::tuple_element<I, std::tuple<Maps...>>::type::mapped_type;
+
+        explicit group(Maps&... maps);
+
+        template <std::size_t I, typename... Args>
+        void add(const key_type& k, Args&&... args);
+        template <std::size_t I>
+        void remove(const key_type& k);
+        bool contains(const key_type& k) const;
+
+        template <typename F>
+        void each(F f) const;
+
+        std::size_t size() const;
+        span<const key_type> keys() const;
+        template <std::size_t I>
+        span<mapped_type<I>> values() const;
+
+    private:
+        template <std::size_t... I>
+        void _pack(const key_type& k, detail::index_sequence<I...>);
+        template <std::size_t... I>
+        void _unpack(const key_type& k, detail::index_sequence<I...>);
+        template <typename F, std::size_t... I>
+        void _each(F& f, detail::index_sequence<I...>) const;
+
+        std::tuple<Maps&...> _pools;
+        std::size_t _size;
+    };
+
+    template <typename... Maps>
+    group<Maps...>::group(Maps&... maps) : _pools(maps...), _size(0) // packs the keys the maps already share
+    {
+        auto driver = make_view(maps...);
+
+        for (auto it = driver.begin(); it != driver.end(); ++it)
+            _pack(std::get<0>(*it), pools_seq()); // the swaps only touch positions the walk has passed
+    }
+
+    template <typename... Maps>
+    template <std::size_t I, typename... Args>
+    void group<Maps...>::add(const key_type& k, Args&&... args) // adds to map I, joins the group once every map holds k
+    {
+        if (std::get<I>(_pools).try_emplace(k, std::forward<Args>(args)...).second)
+            _pack(k, pools_seq());
+    }
+
+    template <typename... Maps>
+    template <std::size_t I>
+    void group<Maps...>::remove(const key_type& k) // removes from map I, leaving the group first
+    {
+        if (contains(k))
+            _unpack(k, pools_seq());
+
+        std::get<I>(_pools).remove(k);
+    }
+
+    template <typename... Maps>
+    bool group<Maps...>::contains(const key_type& k) const
+    {
+        return std::get<0>(_pools).search(k) < _size; // npos is never below size()
+    }
+
+    template <typename... Maps>
+    template <typename F>
+    void group<Maps...>::each(F f) const // f(key, values...), a linear scan of every map
+    {
+        _each(f, pools_seq());
+    }
+
+    template <typename... Maps>
+    std::size_t group<Maps...>::size() const
+    {
+        return _size;
+    }
+
+    template <typename... Maps>
+    span<const typename group<Maps...>::key_type> group<Maps...>::keys() const
+    {
+        return span<const key_type>(std::get<0>(_pools).keys().data(), _size);
+    }
+
+    template <typename... Maps>
+    template <std::size_t I>
+    span<typename group<Maps...>::template mapped_type<I>> group<Maps...>::values() const
+    {
+        return span<mapped_type<I>>(std::get<I>(_pools).values().data(), _size);
+    }
+
+    template <typename... Maps>
+    template <std::size_t... I>
+    void group<Maps...>::_pack(const key_type& key, detail::index_sequence<I...>) // swaps key to position size() in every map if all hold it
+    {
+        const key_type k = key; // key may refer into a dense array the swaps reorder
+        const std::size_t idx[] = {static_cast<std::size_t>(std::get<I>(_pools).search(k))...};
+        const std::size_t npos[] = {static_cast<std::size_t>(std::get<I>(_pools).npos)...};
+
+        for (std::size_t i = 0; i < sizeof...(I); i++)
+        {
+            if (idx[i] == npos[i] || idx[i] < _size)
+                return;
+        }
+
+        const int expand[] = {0, (std::get<I>(_pools).swap_positions(idx[I], _size), 0)...};
+        (void) expand;
+
+        _size++;
+    }
+
+    template <typename... Maps>
+    template <std::size_t... I>
+    void group<Maps...>::_unpack(const key_type& key, detail::index_sequence<I...>) // swaps key to the last grouped position and shrinks the group
+    {
+        const key_type k = key;
+        _size--;
+
+        const int expand[] = {0, (std::get<I>(_pools).swap_positions(std::get<I>(_pools).search(k), _size), 0)...};
+        (void) expand;
+    }
+
+    template <typename... Maps>
+    template <typename F, std::size_t... I>
+    void group<Maps...>::_each(F& f, detail::index_sequence<I...>) const
+    {
+        const key_type* keys = std::get<0>(_pools).keys().data();
+        auto values = std::make_tuple(std::get<I>(_pools).values().data()...);
+
+        for (std::size_t i = 0; i < _size; i++)
+            f(keys[i], std::get<I>(values)[i]...);
+    }
+
+    template <typename... Maps>
+    group<Maps...> make_group(Maps&... maps)
+    {
+        return group<Maps...>(maps...);
+    }
+
+}
+
+
+#endif //PSSET_SPARSE_GROUP_H
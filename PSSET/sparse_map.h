@@ -8,6 +8,9 @@
 
 #include "sparse_set.h"
 
+#include <cstddef>
+#include <iterator>
+
 namespace psset
 {
     template <typename K, typename  V>
@@ -16,16 +19,11 @@ namespace psset
         K key;
         V value;
 
-        template <typename H>
-        struct KeyHash
+        template <typename K2, typename V2>
+        operator KeyValue<K2, V2>() const // copies out of the pairs a sparse_map iterator yields
         {
-            unsigned int operator()(KeyValue<K, V> const& e) const
-            {
-                return _hash(e.key);
-            }
-
-            H _hash;
-        };
+            return {key, value};
+        }
     };
 
     template <typename K, typename V>
@@ -34,138 +32,922 @@ namespace psset
         return {key, value};
     }
 
-    template <typename Key, typename Value, typename Hash>
+    // Walks the key and value columns of a sparse_map in lockstep, yielding
+    // KeyValue<const Key&, V&> pairs that refer into both columns. key() and
+    // value() project onto a single column. The reference is such a proxy, so
+    // auto kv = *it still refers into the map; value_type kv = *it copies.
+    template <typename Key, typename V>
+    class kv_iterator
+    {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = KeyValue<Key, typename std::remove_const<V>::type>;
+        using difference_type = std::ptrdiff_t;
+        using reference = KeyValue<const Key&, V&>;
+
+        class pointer // it->key and it->value on the pair the proxy refers to
+        {
+        public:
+            explicit pointer(reference kv) : _kv(kv) {}
+            const reference* operator->() const { return &_kv; }
+
+        private:
+            reference _kv;
+        };
+
+        kv_iterator() : _key(nullptr), _value(nullptr) {}
+        kv_iterator(const Key* key, V* value) : _key(key), _value(value) {}
+
+        template <typename W, typename = typename std::enable_if<std::is_convertible<W*, V*>::value>::type>
+        kv_iterator(const kv_iterator<Key, W>& it) : _key(it._key), _value(it._value) {}
+
+        reference operator*() const { return {*_key, *_value}; }
+        pointer operator->() const { return pointer(**this); }
+        reference operator[](difference_type n) const { return {_key[n], _value[n]}; }
+        const Key& key() const { return *_key; }
+        V& value() const { return *_value; }
+
+        kv_iterator& operator++() { ++_key; ++_value; return *this; }
+        kv_iterator operator++(int) { kv_iterator it = *this; ++*this; return it; }
+        kv_iterator& operator--() { --_key; --_value; return *this; }
+        kv_iterator operator--(int) { kv_iterator it = *this; --*this; return it; }
+        kv_iterator& operator+=(difference_type n) { _key += n; _value += n; return *this; }
+        kv_iterator& operator-=(difference_type n) { _key -= n; _value -= n; return *this; }
+        kv_iterator operator+(difference_type n) const { return kv_iterator(_key + n, _value + n); }
+        kv_iterator operator-(difference_type n) const { return kv_iterator(_key - n, _value - n); }
+        friend kv_iterator operator+(difference_type n, const kv_iterator& it) { return it + n; }
+        difference_type operator-(const kv_iterator& rhs) const { return _key - rhs._key; }
+
+        bool operator==(const kv_iterator& rhs) const { return _key == rhs._key; }
+        bool operator!=(const kv_iterator& rhs) const { return _key != rhs._key; }
+        bool operator<(const kv_iterator& rhs) const { return _key < rhs._key; }
+        bool operator>(const kv_iterator& rhs) const { return _key > rhs._key; }
+        bool operator<=(const kv_iterator& rhs) const { return _key <= rhs._key; }
+        bool operator>=(const kv_iterator& rhs) const { return _key >= rhs._key; }
+
+    private:
+        template <typename, typename>
+        friend class kv_iterator; // the converting constructor copies the pointers, end() must not be dereferenced
+
+        const Key* _key;
+        V* _value;
+    };
+
+    template <typename Key, typename Value, typename Hash, typename Policy = initialized_sparse, typename Index = unsigned int>
     class sparse_map
     {
 
     public:
+        using key_type = Key;
+        using mapped_type = Value;
+        using index_type = Index;
+        static constexpr Index npos = std::numeric_limits<Index>::max();
+
         explicit sparse_map(unsigned int cap = 0);
+        sparse_map(const sparse_map&) = delete;
+        sparse_map(sparse_map&& other) noexcept;
+        sparse_map& operator=(const sparse_map&) = delete;
+        sparse_map& operator=(sparse_map&& other) noexcept;
+        ~sparse_map();
+
+        void swap(sparse_map& other) noexcept;
+        sparse_map clone() const;
 
         void resize(unsigned int new_cap);
-        void add(Key k, Value v);
-        void remove(Key k);
-        unsigned int search(Key k) const;
-        Value& at(Key k);
-        const Value& at(Key k) const;
+        void reserve_keys(unsigned int key_cap);
+        void reserve_elements(Index elem_cap);
+        void add(const Key& k, const Value& v);
+        void add(const Key& k, Value&& v);
+        template <typename... Args>
+        void emplace(const Key& k, Args&&... args);
+        void add_concurrent(const Key& k, const Value& v);
+        void add_concurrent(const Key& k, Value&& v);
+        template <typename KeyIt, typename ValueIt>
+        void add_range(KeyIt key_first, KeyIt key_last, ValueIt value_first);
+        template <typename K>
+        void remove(const K& k);
+        template <typename It>
+        void remove_range(It first, It last);
+        template <typename Other>
+        void intersect(const Other& other);
+        template <typename V, typename P, typename I>
+        void unite(const sparse_map<Key, V, Hash, P, I>& other);
+        template <typename Other>
+        void subtract(const Other& other);
+        void swap_positions(Index i, Index j);
+        template <typename Compare>
+        void sort(Compare comp);
+        void sort_by_key();
+        template <typename Other>
+        void sort_as(const Other& other);
+        template <typename K>
+        Index search(const K& k) const;
+        template <typename K>
+        bool contains(const K& k) const;
+        template <typename K>
+        Value& at(const K& k);
+        template <typename K>
+        const Value& at(const K& k) const;
+        template <typename K>
+        Value* find(const K& k);
+        template <typename K>
+        const Value* find(const K& k) const;
+        template <typename K>
+        void search_many(const K* keys, std::size_t n, Index* out) const;
+        template <typename K>
+        void contains_many(const K* keys, std::size_t n, bool* out) const;
+        template <typename K>
+        void find_many(const K* keys, std::size_t n, Value** out);
+        template <typename K>
+        void find_many(const K* keys, std::size_t n, const Value** out) const;
+        template <typename K>
+        Value fetch_add(const K& k, Value delta);
+        template <typename K>
+        Value fetch_sub(const K& k, Value delta);
+        template <typename K>
+        bool compare_exchange(const K& k, Value& expected, Value desired);
+        template <typename K>
+        Value atomic_load(const K& k) const;
+        template <typename K>
+        void atomic_store(const K& k, Value v);
+        template <typename... Args>
+        std::pair<Value&, bool> try_emplace(const Key& k, Args&&... args);
+        template <typename V>
+        std::pair<Value&, bool> insert_or_assign(const Key& k, V&& v);
+        template <typename... Args>
+        Value& get_or_insert(const Key& k, Args&&... args);
+        Value& operator[](const Key& k);
         void clear();
 
-        unsigned int size() const;
-        KeyValue<Key, Value>* data();
-        const KeyValue<Key, Value>* data() const;
-
-        using iterator = KeyValue<Key, Value>*;
+        Index size() const;
+        Index capacity() const;
+        unsigned int key_capacity() const;
+        span<const Key> keys() const;
+        span<Value> values();
+        span<const Value> values() const;
+
+        using iterator = kv_iterator<Key, Value>;
+        using const_iterator = kv_iterator<Key, const Value>;
+        using reverse_iterator = std::reverse_iterator<iterator>;
+        using const_reverse_iterator = std::reverse_iterator<const_iterator>;
         iterator begin();
-        const iterator begin() const;
+        const_iterator begin() const;
+        const_iterator cbegin() const;
         iterator end();
-        const iterator end() const;
+        const_iterator end() const;
+        const_iterator cend() const;
+        reverse_iterator rbegin();
+        const_reverse_iterator rbegin() const;
+        reverse_iterator rend();
+        const_reverse_iterator rend() const;
 
     private:
-        sparse_set<KeyValue<Key, Value>,  typename KeyValue<Key, Value>::template KeyHash<Hash>> _sset;
+        static void _check_atomic();
+        static Value _fetch_add(Value& v, Value delta, std::true_type);
+        static Value _fetch_add(Value& v, Value delta, std::false_type);
+        static Value _fetch_sub(Value& v, Value delta, std::true_type);
+        static Value _fetch_sub(Value& v, Value delta, std::false_type);
+        void _sync_capacity();
+        void _remove_at(Index idx, unsigned int val);
+        void _permute(const std::vector<Index>& order);
+        template <typename... Args>
+        Value& _emplace_at(Index& slot, unsigned int val, const Key& k, Args&&... args);
+
+        sparse_set<Key, Hash, Policy, Index> _sset;
+        Index _capacity; // of the value column, follows _sset.capacity()
+        Value* _values;
     };
 
-    template<typename Key, typename Value, typename Hash>
-    sparse_map<Key, Value, Hash>::sparse_map(unsigned int cap) : _sset(cap)
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    constexpr Index sparse_map<Key, Value, Hash, Policy, Index>::npos;
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    sparse_map<Key, Value, Hash, Policy, Index>::sparse_map(unsigned int cap) : _sset(cap), _capacity(0), _values(nullptr)
+    {
+        _sync_capacity();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    sparse_map<Key, Value, Hash, Policy, Index>::sparse_map(sparse_map&& other) noexcept
+        : _sset(std::move(other._sset)), _capacity(other._capacity), _values(other._values)
+    {
+        other._capacity = 0;
+        other._values = nullptr;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    sparse_map<Key, Value, Hash, Policy, Index> &sparse_map<Key, Value, Hash, Policy, Index>::operator=(sparse_map&& other) noexcept
+    {
+        sparse_map tmp(std::move(other));
+        swap(tmp);
+        return *this;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::swap(sparse_map& other) noexcept
+    {
+        using std::swap;
+        _sset.swap(other._sset);
+        swap(_capacity, other._capacity);
+        swap(_values, other._values);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    sparse_map<Key, Value, Hash, Policy, Index> sparse_map<Key, Value, Hash, Policy, Index>::clone() const // copies the live elements only
+    {
+        sparse_map copy; // stays empty until both columns are complete
+        auto keys = _sset.clone(); // same dense order, so the value column lines up
+        Value* values = detail::allocate<Value>(keys.capacity());
+        Index i = 0;
+
+        try
+        {
+            for (; i < size(); i++)
+                new (&values[i]) Value(_values[i]);
+        }
+        catch (...)
+        {
+            detail::destroy(values, values + i);
+            detail::deallocate(values);
+            throw;
+        }
+
+        detail::deallocate(copy._values);
+        copy._sset = std::move(keys);
+        copy._values = values;
+        copy._capacity = copy._sset.capacity();
+
+        return copy;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    sparse_map<Key, Value, Hash, Policy, Index>::~sparse_map()
+    {
+        detail::destroy(_values, _values + size());
+        detail::deallocate(_values);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::resize(unsigned int new_cap)
+    {
+        _sset.resize(new_cap);
+        _sync_capacity();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::reserve_keys(unsigned int key_cap)
+    {
+        _sset.reserve_keys(key_cap);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::reserve_elements(Index elem_cap)
+    {
+        _sset.reserve_elements(elem_cap);
+        _sync_capacity();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::add(const Key& k, const Value& v)
+    {
+        emplace(k, v);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::add(const Key& k, Value&& v)
+    {
+        emplace(k, std::move(v));
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename... Args>
+    void sparse_map<Key, Value, Hash, Policy, Index>::emplace(const Key& k, Args&&... args)
+    {
+        try_emplace(k, std::forward<Args>(args)...);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::add_concurrent(const Key& k, const Value& v) // same contract as sparse_set::add_concurrent
+    {
+        static_assert(std::is_nothrow_copy_constructible<Key>::value && std::is_nothrow_copy_constructible<Value>::value,
+                      "add_concurrent cannot give back a claimed slot");
+
+        unsigned int val = _sset._hash(k);
+        Index& slot = _sset._slot_concurrent(val);
+        Index idx = _sset._claim_concurrent();
+
+        new (&_sset._dense[idx]) Key(k);
+        new (&_values[idx]) Value(v);
+        _sset._publish_concurrent(slot, val, idx);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::add_concurrent(const Key& k, Value&& v)
+    {
+        static_assert(std::is_nothrow_copy_constructible<Key>::value && std::is_nothrow_move_constructible<Value>::value,
+                      "add_concurrent cannot give back a claimed slot");
+
+        unsigned int val = _sset._hash(k);
+        Index& slot = _sset._slot_concurrent(val);
+        Index idx = _sset._claim_concurrent();
+
+        new (&_sset._dense[idx]) Key(k);
+        new (&_values[idx]) Value(std::move(v));
+        _sset._publish_concurrent(slot, val, idx);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename KeyIt, typename ValueIt>
+    void sparse_map<Key, Value, Hash, Policy, Index>::add_range(KeyIt key_first, KeyIt key_last, ValueIt value_first) // values of contained keys are skipped
+    {
+        _sset._reserve_range(key_first, key_last, typename std::iterator_traits<KeyIt>::iterator_category());
+        _sync_capacity();
+
+        for (; key_first != key_last; ++key_first, ++value_first)
+        {
+            unsigned int val = _sset._hash(*key_first);
+            Index& slot = _sset._slot(val);
+
+            if (!_sset._holds(slot, val))
+                _emplace_at(slot, val, *key_first, *value_first);
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_map<Key, Value, Hash, Policy, Index>::remove(const K& k)
+    {
+        auto idx = _sset.search(k);
+
+        if (idx == npos)
+            return;
+
+        _remove_at(idx, _sset._hash(k));
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename It>
+    void sparse_map<Key, Value, Hash, Policy, Index>::remove_range(It first, It last)
+    {
+        for (; first != last; ++first)
+            remove(*first);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_map<Key, Value, Hash, Policy, Index>::intersect(const Other& other) // keeps the entries whose key other contains
+    {
+        const Key* keys = _sset.data();
+
+        for (Index i = size(); i-- > 0;)
+        {
+            if (!other.contains(keys[i]))
+                _remove_at(i, _sset._hash(keys[i]));
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename V, typename P, typename I>
+    void sparse_map<Key, Value, Hash, Policy, Index>::unite(const sparse_map<Key, V, Hash, P, I>& other) // contained keys keep their value
+    {
+        if (static_cast<const void*>(&other) == this) // add_range would grow the columns it reads from
+            return;
+
+        add_range(other.keys().begin(), other.keys().end(), other.values().begin());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_map<Key, Value, Hash, Policy, Index>::subtract(const Other& other)
+    {
+        if (other.size() < size())
+        {
+            for (const auto& k : other.keys())
+                remove(k);
+
+            return;
+        }
+
+        const Key* keys = _sset.data();
+
+        for (Index i = size(); i-- > 0;)
+        {
+            if (other.contains(keys[i]))
+                _remove_at(i, _sset._hash(keys[i]));
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::swap_positions(Index i, Index j) // moves both columns, both must be below size()
     {
+        if (i == j)
+            return;
+
+        using std::swap;
+        swap(_values[i], _values[j]);
+        _sset.swap_positions(i, j);
     }
 
-    template<typename Key, typename Value, typename Hash>
-    void sparse_map<Key, Value, Hash>::resize(unsigned int new_cap)
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename Compare>
+    void sparse_map<Key, Value, Hash, Policy, Index>::sort(Compare comp) // comp orders keys, values follow them
     {
-        return _sset.resize(new_cap);
+        std::vector<Index> order(size());
+        for (Index i = 0; i < size(); i++)
+            order[i] = i;
+
+        const Key* keys = _sset.data();
+        std::sort(order.begin(), order.end(), [&](Index a, Index b) { return comp(keys[a], keys[b]); });
+
+        _permute(order);
     }
 
-    template<typename Key, typename Value, typename Hash>
-    void sparse_map<Key, Value, Hash>::add(Key k, Value v)
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::sort_by_key() // ascending hash order, reproducible regardless of insertion history
     {
-        auto p = make_keyvalue(k, v);
-        return _sset.add(p);
+        _permute(detail::radix_order<Index>(_sset._hashes()));
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_map<Key, Value, Hash, Policy, Index>::sort_as(const Other& other) // keys other contains come first, in its order
+    {
+        Index pos = 0;
+
+        for (const auto& k : other.keys())
+        {
+            Index idx = search(k);
+            if (idx != npos)
+                swap_positions(idx, pos++);
+        }
     }
 
-    template<typename Key, typename Value, typename Hash>
-    void sparse_map<Key, Value, Hash>::remove(Key k)
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Index sparse_map<Key, Value, Hash, Policy, Index>::search(const K& k) const // hashes k directly, no Key or Value is constructed
     {
-        Value v;
-        auto p = make_keyvalue(k, v);
-        return _sset.remove(p);
+        return _sset.search(k);
     }
 
-    template<typename Key, typename Value, typename Hash>
-    unsigned int sparse_map<Key, Value, Hash>::search(Key k) const
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    bool sparse_map<Key, Value, Hash, Policy, Index>::contains(const K& k) const
     {
-        Value v;
-        auto p = make_keyvalue(k, v);
-        return _sset.search(p);
+        return _sset.search(k) != npos;
     }
 
-    template<typename Key, typename Value, typename Hash>
-    Value &sparse_map<Key, Value, Hash>::at(Key k)
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Value &sparse_map<Key, Value, Hash, Policy, Index>::at(const K& k)
     {
         auto idx = search(k);
 
         if (idx >= size())
             throw std::out_of_range("key not found in smap.");
 
-        return _sset.data()[idx].value;
+        return _values[idx];
     }
 
-    template<typename Key, typename Value, typename Hash>
-    const Value &sparse_map<Key, Value, Hash>::at(Key k) const
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    const Value &sparse_map<Key, Value, Hash, Policy, Index>::at(const K& k) const
     {
         auto idx = search(k);
 
         if (idx >= size())
             throw std::out_of_range("key not found in smap.");
 
-        return _sset.data()[idx].value;
+        return _values[idx];
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Value *sparse_map<Key, Value, Hash, Policy, Index>::find(const K& k) // nullptr if k is not contained
+    {
+        auto idx = search(k);
+
+        return idx == npos ? nullptr : &_values[idx];
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    const Value *sparse_map<Key, Value, Hash, Policy, Index>::find(const K& k) const // nullptr if k is not contained
+    {
+        auto idx = search(k);
+
+        return idx == npos ? nullptr : &_values[idx];
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_map<Key, Value, Hash, Policy, Index>::search_many(const K* keys, std::size_t n, Index* out) const
+    {
+        _sset.search_many(keys, n, out);
     }
-    template<typename Key, typename Value, typename Hash>
-    void sparse_map<Key, Value, Hash>::clear()
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_map<Key, Value, Hash, Policy, Index>::contains_many(const K* keys, std::size_t n, bool* out) const
+    {
+        _sset.contains_many(keys, n, out);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_map<Key, Value, Hash, Policy, Index>::find_many(const K* keys, std::size_t n, Value** out) // find() for n keys, prefetching the values of a batch before handing them out
     {
+        Index idx[detail::batch_size];
+
+        for (std::size_t first = 0; first < n; first += detail::batch_size)
+        {
+            std::size_t m = std::min(n - first, detail::batch_size);
+            _sset.search_many(keys + first, m, idx);
+
+            for (std::size_t j = 0; j < m; j++)
+            {
+                if (idx[j] != npos)
+                    detail::prefetch(&_values[idx[j]]);
+            }
+
+            for (std::size_t j = 0; j < m; j++)
+                out[first + j] = idx[j] == npos ? nullptr : &_values[idx[j]];
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_map<Key, Value, Hash, Policy, Index>::find_many(const K* keys, std::size_t n, const Value** out) const
+    {
+        Index idx[detail::batch_size];
+
+        for (std::size_t first = 0; first < n; first += detail::batch_size)
+        {
+            std::size_t m = std::min(n - first, detail::batch_size);
+            _sset.search_many(keys + first, m, idx);
+
+            for (std::size_t j = 0; j < m; j++)
+            {
+                if (idx[j] != npos)
+                    detail::prefetch(&_values[idx[j]]);
+            }
+
+            for (std::size_t j = 0; j < m; j++)
+                out[first + j] = idx[j] == npos ? nullptr : &_values[idx[j]];
+        }
+    }
+
+    // Atomic updates of single values. They may run from any number of threads
+    // together with each other and with lookups, as long as no thread adds or
+    // removes keys meanwhile; every access to a value shared this way must go
+    // through them.
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::fetch_add(const K& k, Value delta) // relaxed, returns the previous value
+    {
+        static_assert(std::is_arithmetic<Value>::value && !std::is_same<Value, bool>::value, "fetch_add needs an arithmetic value type");
+        _check_atomic();
+
+        return _fetch_add(at(k), delta, std::is_integral<Value>());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::fetch_sub(const K& k, Value delta)
+    {
+        static_assert(std::is_arithmetic<Value>::value && !std::is_same<Value, bool>::value, "fetch_sub needs an arithmetic value type");
+        _check_atomic();
+
+        return _fetch_sub(at(k), delta, std::is_integral<Value>());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    bool sparse_map<Key, Value, Hash, Policy, Index>::compare_exchange(const K& k, Value& expected, Value desired) // compares the object representation
+    {
+        _check_atomic();
+        return detail::atomic_compare_exchange(at(k), expected, desired);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::atomic_load(const K& k) const
+    {
+        _check_atomic();
+        return detail::atomic_load_acquire(at(k));
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_map<Key, Value, Hash, Policy, Index>::atomic_store(const K& k, Value v)
+    {
+        _check_atomic();
+        detail::atomic_store_release(at(k), v);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::_check_atomic()
+    {
+        static_assert(std::is_trivially_copyable<Value>::value, "atomic updates need a trivially copyable value type");
+        static_assert(sizeof(Value) <= sizeof(unsigned long long) && (sizeof(Value) & (sizeof(Value) - 1)) == 0,
+                      "atomic updates need a value type of a lock-free size");
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::_fetch_add(Value& v, Value delta, std::true_type)
+    {
+        return detail::atomic_fetch_add(v, delta);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::_fetch_add(Value& v, Value delta, std::false_type) // floating point, retried until no other thread got in between
+    {
+        Value old = detail::atomic_load_acquire(v);
+
+        while (!detail::atomic_compare_exchange(v, old, static_cast<Value>(old + delta)))
+        {
+        }
+
+        return old;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::_fetch_sub(Value& v, Value delta, std::true_type)
+    {
+        return detail::atomic_fetch_sub(v, delta);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Value sparse_map<Key, Value, Hash, Policy, Index>::_fetch_sub(Value& v, Value delta, std::false_type)
+    {
+        return _fetch_add(v, -delta, std::false_type());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename... Args>
+    std::pair<Value&, bool> sparse_map<Key, Value, Hash, Policy, Index>::try_emplace(const Key& k, Args&&... args) // args are left untouched if k is contained
+    {
+        unsigned int val = _sset._hash(k);
+        Index& slot = _sset._slot(val);
+
+        if (_sset._holds(slot, val))
+            return std::pair<Value&, bool>(_values[slot], false);
+
+        return std::pair<Value&, bool>(_emplace_at(slot, val, k, std::forward<Args>(args)...), true);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename V>
+    std::pair<Value&, bool> sparse_map<Key, Value, Hash, Policy, Index>::insert_or_assign(const Key& k, V&& v)
+    {
+        unsigned int val = _sset._hash(k);
+        Index& slot = _sset._slot(val);
+
+        if (_sset._holds(slot, val))
+        {
+            _values[slot] = std::forward<V>(v);
+            return std::pair<Value&, bool>(_values[slot], false);
+        }
+
+        return std::pair<Value&, bool>(_emplace_at(slot, val, k, std::forward<V>(v)), true);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename... Args>
+    Value &sparse_map<Key, Value, Hash, Policy, Index>::get_or_insert(const Key& k, Args&&... args)
+    {
+        return try_emplace(k, std::forward<Args>(args)...).first;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Value &sparse_map<Key, Value, Hash, Policy, Index>::operator[](const Key& k) // value-initializes missing entries
+    {
+        return try_emplace(k).first;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::clear()
+    {
+        detail::destroy(_values, _values + size());
         _sset.clear();
     }
 
-    template<typename Key, typename Value, typename Hash>
-    unsigned int sparse_map<Key, Value, Hash>::size() const
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Index sparse_map<Key, Value, Hash, Policy, Index>::size() const
     {
         return _sset.size();
     }
 
-    template<typename Key, typename Value, typename Hash>
-    KeyValue<Key, Value> *sparse_map<Key, Value, Hash>::data() // not allowed to change result of hash function
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    Index sparse_map<Key, Value, Hash, Policy, Index>::capacity() const
+    {
+        return _sset.capacity();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    unsigned int sparse_map<Key, Value, Hash, Policy, Index>::key_capacity() const
+    {
+        return _sset.key_capacity();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    span<const Key> sparse_map<Key, Value, Hash, Policy, Index>::keys() const // not allowed to change result of hash function
     {
-        return _sset.data();
+        return span<const Key>(_sset.data(), size());
     }
 
-    template<typename Key, typename Value, typename Hash>
-    const KeyValue<Key, Value> *sparse_map<Key, Value, Hash>::data() const // not allowed to change result of hash function
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    span<Value> sparse_map<Key, Value, Hash, Policy, Index>::values()
     {
-        return _sset.data();
+        return span<Value>(_values, size());
     }
 
-    template<typename Key, typename Value, typename Hash>
-    typename sparse_map<Key, Value, Hash>::iterator sparse_map<Key, Value, Hash>::begin()
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    span<const Value> sparse_map<Key, Value, Hash, Policy, Index>::values() const
     {
-        return _sset.begin();
+        return span<const Value>(_values, size());
     }
 
-    template<typename Key, typename Value, typename Hash>
-    const typename sparse_map<Key, Value, Hash>::iterator sparse_map<Key, Value, Hash>::begin() const
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::iterator sparse_map<Key, Value, Hash, Policy, Index>::begin()
     {
-        return _sset.begin();
+        return iterator(_sset.data(), _values);
     }
 
-    template<typename Key, typename Value, typename Hash>
-    typename sparse_map<Key, Value, Hash>::iterator sparse_map<Key, Value, Hash>::end()
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::const_iterator sparse_map<Key, Value, Hash, Policy, Index>::begin() const
     {
-        return _sset.end();
+        return const_iterator(_sset.data(), _values);
     }
 
-    template<typename Key, typename Value, typename Hash>
-    const typename sparse_map<Key, Value, Hash>::iterator sparse_map<Key, Value, Hash>::end() const
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::iterator sparse_map<Key, Value, Hash, Policy, Index>::end()
     {
-        return _sset.end();
+        return iterator(_sset.data() + size(), _values + size());
     }
 
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::const_iterator sparse_map<Key, Value, Hash, Policy, Index>::end() const
+    {
+        return const_iterator(_sset.data() + size(), _values + size());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::const_iterator sparse_map<Key, Value, Hash, Policy, Index>::cbegin() const
+    {
+        return begin();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::const_iterator sparse_map<Key, Value, Hash, Policy, Index>::cend() const
+    {
+        return end();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::reverse_iterator sparse_map<Key, Value, Hash, Policy, Index>::rbegin()
+    {
+        return reverse_iterator(end());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::const_reverse_iterator sparse_map<Key, Value, Hash, Policy, Index>::rbegin() const
+    {
+        return const_reverse_iterator(end());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::reverse_iterator sparse_map<Key, Value, Hash, Policy, Index>::rend()
+    {
+        return reverse_iterator(begin());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    typename sparse_map<Key, Value, Hash, Policy, Index>::const_reverse_iterator sparse_map<Key, Value, Hash, Policy, Index>::rend() const
+    {
+        return const_reverse_iterator(begin());
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::_sync_capacity()
+    {
+        if (_sset.capacity() == _capacity)
+            return;
+
+        detail::reallocate(_values, size(), _sset.capacity());
+        _capacity = _sset.capacity();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::_remove_at(Index idx, unsigned int val) // val is the hash of the key at idx
+    {
+        if (idx != size() - 1)
+            _values[idx] = std::move(_values[size() - 1]); // mirrors the swap-and-pop of the key set
+        _values[size() - 1].~Value();
+        _sset._remove_at(idx, val);
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void sparse_map<Key, Value, Hash, Policy, Index>::_permute(const std::vector<Index>& order) // position i takes the entry at order[i]
+    {
+        using std::swap;
+        Key* keys = _sset._dense;
+
+        detail::permute(order, [&](Index i, Index j) {
+            swap(keys[i], keys[j]);
+            swap(_values[i], _values[j]);
+        });
+
+        _sset._relink();
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    template<typename... Args>
+    Value &sparse_map<Key, Value, Hash, Policy, Index>::_emplace_at(Index& slot, unsigned int val, const Key& k, Args&&... args) // slot is the probed miss of k
+    {
+        if (size() == _capacity)
+        {
+            if (_capacity == npos)
+                throw std::length_error("sparse_map index type exhausted.");
+
+            Key key(k); // k and args may refer into the columns growth is about to move
+            Value value(std::forward<Args>(args)...);
+            reserve_elements(detail::next_capacity(size()));
+
+            return _emplace_at(slot, val, key, std::move(value));
+        }
+
+        Index idx = size();
+        new (&_values[idx]) Value(std::forward<Args>(args)...);
+
+        try
+        {
+            _sset._emplace_at(slot, val, k);
+        }
+        catch (...)
+        {
+            _values[idx].~Value();
+            throw;
+        }
+
+        return _values[idx];
+    }
+
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    void swap(sparse_map<Key, Value, Hash, Policy, Index>& lhs, sparse_map<Key, Value, Hash, Policy, Index>& rhs) noexcept
+    {
+        lhs.swap(rhs);
+    }
+
+    // Set algebra into a new map. Values are taken from a; b may be any sparse_set or sparse_map over the same keys.
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index, typename Other>
+    sparse_map<Key, Value, Hash, Policy, Index> intersect(const sparse_map<Key, Value, Hash, Policy, Index>& a, const Other& b) // walks the smaller side
+    {
+        sparse_map<Key, Value, Hash, Policy, Index> result;
+        result.reserve_elements(static_cast<Index>(std::min<std::size_t>(a.size(), b.size())));
+
+        if (b.size() < a.size())
+        {
+            for (const auto& k : b.keys())
+            {
+                if (const Value* v = a.find(k))
+                    result.add(k, *v);
+            }
+        }
+        else
+        {
+            for (auto kv : a)
+            {
+                if (b.contains(kv.key))
+                    result.add(kv.key, kv.value);
+            }
+        }
+
+        return result;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index, typename V, typename P, typename I>
+    sparse_map<Key, Value, Hash, Policy, Index> unite(const sparse_map<Key, Value, Hash, Policy, Index>& a, const sparse_map<Key, V, Hash, P, I>& b)
+    {
+        auto result = a.clone();
+        result.unite(b);
+        return result;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Policy, typename Index, typename Other>
+    sparse_map<Key, Value, Hash, Policy, Index> subtract(const sparse_map<Key, Value, Hash, Policy, Index>& a, const Other& b)
+    {
+        sparse_map<Key, Value, Hash, Policy, Index> result;
+        result.reserve_elements(a.size());
+
+        for (auto kv : a)
+        {
+            if (!b.contains(kv.key))
+                result.add(kv.key, kv.value);
+        }
+
+        return result;
+    }
 
 }
 
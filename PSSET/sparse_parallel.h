@@ -0,0 +1,302 @@
+//
+// Parallel iteration over the dense storage of sets, maps and views.
+//
+
+#ifndef PSSET_SPARSE_PARALLEL_H
+#define PSSET_SPARSE_PARALLEL_H
+
+
+#include "sparse_view.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace psset
+{
+
+    namespace detail
+    {
+        // Elements per chunk handed to one thread, before rounding to whole cache lines.
+        const std::size_t parallel_grain = 1024;
+
+        // Chunk length for elements of the given size: at least parallel_grain and a
+        // whole number of cache lines. Columns start on a line (see allocate), so
+        // neighbouring chunks do not write to the same line of the column.
+        inline std::size_t chunk_length(std::size_t elem_size)
+        {
+            std::size_t a = elem_size, b = cache_line;
+            while (b != 0)
+            {
+                std::size_t r = a % b;
+                a = b;
+                b = r;
+            }
+
+            std::size_t line_elems = cache_line / a;
+            return (parallel_grain + line_elems - 1) / line_elems * line_elems;
+        }
+
+        inline bool& inside_pool()
+        {
+            static thread_local bool inside = false;
+            return inside;
+        }
+    }
+
+    // Fixed set of worker threads for parallel_for. Every call splits [0, n) into
+    // chunks, deals them out in contiguous runs to the workers and the calling
+    // thread, and lets a thread that ran out steal chunks from the back of the
+    // others' runs. Calls made from inside a running loop execute serially.
+    class thread_pool
+    {
+    public:
+        explicit thread_pool(unsigned int workers = default_workers());
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+        ~thread_pool();
+
+        static unsigned int default_workers();
+        static thread_pool& shared();
+
+        unsigned int size() const;
+
+        template <typename F>
+        void parallel_for(std::size_t n, std::size_t chunk, F fn);
+
+    private:
+        struct run
+        {
+            std::mutex m;
+            std::size_t front;
+            std::size_t back;
+            char pad[detail::cache_line]; // keeps the runs of different threads off one line
+        };
+
+        void _work(unsigned int id);
+        void _drain(unsigned int id);
+        bool _pop(unsigned int id, std::size_t& chunk);
+        bool _steal(unsigned int id, std::size_t& chunk);
+
+        std::vector<std::thread> _threads;
+        std::unique_ptr<run[]> _runs; // one per worker, the last one belongs to the caller
+
+        std::mutex _submit; // one loop at a time
+        std::mutex _m;
+        std::condition_variable _wake;
+        std::condition_variable _done;
+        unsigned long _generation;
+        unsigned int _busy;
+        bool _stop;
+
+        std::function<void(std::size_t)> _chunk;
+        std::exception_ptr _error;
+    };
+
+    inline thread_pool::thread_pool(unsigned int workers)
+        : _runs(new run[workers + 1]), _generation(0), _busy(0), _stop(false)
+    {
+        _threads.reserve(workers);
+
+        for (unsigned int i = 0; i < workers; i++)
+            _threads.emplace_back(&thread_pool::_work, this, i);
+    }
+
+    inline thread_pool::~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _stop = true;
+        }
+
+        _wake.notify_all();
+
+        for (auto& t : _threads)
+            t.join();
+    }
+
+    inline unsigned int thread_pool::default_workers() // the calling thread is the last participant
+    {
+        unsigned int hw = std::thread::hardware_concurrency();
+        return hw > 1 ? hw - 1 : 0;
+    }
+
+    inline thread_pool &thread_pool::shared()
+    {
+        static thread_pool pool;
+        return pool;
+    }
+
+    inline unsigned int thread_pool::size() const
+    {
+        return static_cast<unsigned int>(_threads.size());
+    }
+
+    template <typename F>
+    void thread_pool::parallel_for(std::size_t n, std::size_t chunk, F fn) // fn(first, last) for consecutive ranges covering [0, n)
+    {
+        if (n == 0)
+            return;
+
+        chunk = std::max<std::size_t>(chunk, 1);
+        std::size_t chunks = (n + chunk - 1) / chunk;
+
+        if (_threads.empty() || chunks == 1 || detail::inside_pool())
+        {
+            fn(std::size_t(0), n);
+            return;
+        }
+
+        std::lock_guard<std::mutex> submit(_submit);
+
+        _chunk = [&](std::size_t c) { fn(c * chunk, std::min(n, (c + 1) * chunk)); };
+        _error = nullptr;
+
+        const std::size_t parts = _threads.size() + 1;
+        for (std::size_t i = 0; i < parts; i++)
+        {
+            _runs[i].front = chunks * i / parts;
+            _runs[i].back = chunks * (i + 1) / parts;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _generation++;
+            _busy = size();
+        }
+
+        _wake.notify_all();
+        _drain(size());
+
+        {
+            std::unique_lock<std::mutex> lock(_m);
+            _done.wait(lock, [this] { return _busy == 0; });
+        }
+
+        _chunk = nullptr;
+
+        if (_error)
+            std::rethrow_exception(_error);
+    }
+
+    inline void thread_pool::_work(unsigned int id)
+    {
+        unsigned long seen = 0;
+
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(_m);
+                _wake.wait(lock, [&] { return _stop || _generation != seen; });
+
+                if (_stop)
+                    return;
+
+                seen = _generation;
+            }
+
+            _drain(id);
+
+            {
+                std::lock_guard<std::mutex> lock(_m);
+                if (--_busy == 0)
+                    _done.notify_one();
+            }
+        }
+    }
+
+    inline void thread_pool::_drain(unsigned int id) // own run first, then steals until every run is empty
+    {
+        detail::inside_pool() = true;
+        std::size_t c;
+
+        while (_pop(id, c) || _steal(id, c))
+        {
+            try
+            {
+                _chunk(c);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(_m);
+                if (!_error)
+                    _error = std::current_exception();
+            }
+        }
+
+        detail::inside_pool() = false;
+    }
+
+    inline bool thread_pool::_pop(unsigned int id, std::size_t& chunk)
+    {
+        std::lock_guard<std::mutex> lock(_runs[id].m);
+
+        if (_runs[id].front == _runs[id].back)
+            return false;
+
+        chunk = _runs[id].front++;
+        return true;
+    }
+
+    inline bool thread_pool::_steal(unsigned int id, std::size_t& chunk)
+    {
+        const std::size_t parts = _threads.size() + 1;
+
+        for (std::size_t k = 1; k < parts; k++)
+        {
+            run& victim = _runs[(id + k) % parts];
+            std::lock_guard<std::mutex> lock(victim.m);
+
+            if (victim.front != victim.back)
+            {
+                chunk = --victim.back;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // fn(element) for every element of a set. Elements must keep their hash.
+    template <typename T, typename Hash, typename Policy, typename Index, typename F>
+    void parallel_for_each(sparse_set<T, Hash, Policy, Index>& set, F fn, thread_pool& pool = thread_pool::shared())
+    {
+        T* data = set.data();
+
+        pool.parallel_for(set.size(), detail::chunk_length(sizeof(T)), [&](std::size_t first, std::size_t last) {
+            for (std::size_t i = first; i < last; i++)
+                fn(data[i]);
+        });
+    }
+
+    // fn(key, value) for every entry of a map, chunked by the value column.
+    template <typename Key, typename Value, typename Hash, typename Policy, typename Index, typename F>
+    void parallel_for_each(sparse_map<Key, Value, Hash, Policy, Index>& map, F fn, thread_pool& pool = thread_pool::shared())
+    {
+        const Key* keys = map.keys().data();
+        Value* values = map.values().data();
+
+        pool.parallel_for(map.size(), detail::chunk_length(sizeof(Value)), [&](std::size_t first, std::size_t last) {
+            for (std::size_t i = first; i < last; i++)
+                fn(keys[i], values[i]);
+        });
+    }
+
+    // view::each() with the positions of the driving map split across threads.
+    template <typename... Excluded, typename... Maps, typename F>
+    void parallel_for_each(const view<exclude_t<Excluded...>, Maps...>& v, F fn, thread_pool& pool = thread_pool::shared())
+    {
+        pool.parallel_for(v.size_hint(), detail::parallel_grain, [&](std::size_t first, std::size_t last) {
+            v.each(fn, first, last);
+        });
+    }
+
+}
+
+
+#endif //PSSET_SPARSE_PARALLEL_H
@@ -8,180 +8,1303 @@
 
 #include <cmath>
 #include <climits>
+#include <cstddef>
+#include <cstdlib>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
 
 namespace psset
 {
 
-    template <typename T, typename Hash>
+    namespace detail
+    {
+        const unsigned int page_bits = 12;
+        const unsigned int page_size = 1U << page_bits;
+        const unsigned int page_mask = page_size - 1;
+
+        // Batched lookups resolve this many keys per round of prefetches.
+        const std::size_t batch_size = 16;
+
+        const std::size_t cache_line = 64;
+
+        inline void prefetch(const void* p)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_prefetch(p);
+#else
+            (void) p;
+#endif
+        }
+
+        // Atomic access to plain members, for the few paths that share them between threads.
+        // U is an integer, a pointer or, for load, store and compare_exchange, any
+        // trivially copyable type of a lock-free size.
+        template <typename U>
+        U atomic_load_acquire(const U& x)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            U v;
+            __atomic_load(&x, &v, __ATOMIC_ACQUIRE);
+            return v;
+#else
+            return reinterpret_cast<const std::atomic<U>&>(x).load(std::memory_order_acquire);
+#endif
+        }
+
+        template <typename U>
+        void atomic_store_release(U& x, U v)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            __atomic_store(&x, &v, __ATOMIC_RELEASE);
+#else
+            reinterpret_cast<std::atomic<U>&>(x).store(v, std::memory_order_release);
+#endif
+        }
+
+        template <typename U>
+        U atomic_fetch_add(U& x, U v)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return __atomic_fetch_add(&x, v, __ATOMIC_RELAXED);
+#else
+            return reinterpret_cast<std::atomic<U>&>(x).fetch_add(v, std::memory_order_relaxed);
+#endif
+        }
+
+        template <typename U>
+        U atomic_fetch_sub(U& x, U v)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return __atomic_fetch_sub(&x, v, __ATOMIC_RELAXED);
+#else
+            return reinterpret_cast<std::atomic<U>&>(x).fetch_sub(v, std::memory_order_relaxed);
+#endif
+        }
+
+        template <typename U>
+        bool atomic_compare_exchange(U& x, U& expected, U desired) // on failure expected holds the current value
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return __atomic_compare_exchange(&x, &expected, &desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#else
+            return reinterpret_cast<std::atomic<U>&>(x).compare_exchange_strong(expected, desired, std::memory_order_acq_rel,
+                                                                                 std::memory_order_acquire);
+#endif
+        }
+
+        // Shared, read-only page that every untouched part of the sparse index points to.
+        // It is never written to; a page is allocated once a key falls inside it.
+        template <typename Index>
+        Index *invalid_page()
+        {
+            struct page
+            {
+                page()
+                {
+                    std::fill(slots, slots + page_size, std::numeric_limits<Index>::max());
+                }
+
+                Index slots[page_size];
+            };
+
+            static page p;
+            return p.slots;
+        }
+
+        // Dense columns are raw blocks starting on a cache line, so chunks of whole
+        // lines handed to different threads never share one; only the first n slots
+        // hold live objects.
+        template <typename T>
+        T *allocate(std::size_t cap)
+        {
+            static_assert(alignof(T) <= cache_line, "over-aligned types are not supported");
+
+            if (cap == 0)
+                return nullptr;
+
+            void* data = nullptr;
+#if defined(_WIN32)
+            data = _aligned_malloc(cap * sizeof(T), cache_line);
+#else
+            if (posix_memalign(&data, cache_line, cap * sizeof(T)) != 0)
+                data = nullptr;
+#endif
+            if (data == nullptr)
+                throw std::bad_alloc();
+
+            return static_cast<T*>(data);
+        }
+
+        inline void deallocate(void* data)
+        {
+#if defined(_WIN32)
+            _aligned_free(data);
+#else
+            std::free(data);
+#endif
+        }
+
+        template <typename T>
+        void destroy(T* first, T* last)
+        {
+            if (std::is_trivially_destructible<T>::value)
+                return;
+
+            for (; first != last; ++first)
+                first->~T();
+        }
+
+        // Trivially copyable columns are copied bytewise; realloc would give up the alignment.
+        template <typename T, typename Index>
+        void reallocate(T*& data, Index n, Index new_cap, std::true_type)
+        {
+            T* new_data = allocate<T>(new_cap);
+
+            if (n != 0)
+                std::memcpy(static_cast<void*>(new_data), static_cast<const void*>(data), n * sizeof(T));
+
+            deallocate(data);
+            data = new_data;
+        }
+
+        template <typename T, typename Index>
+        void reallocate(T*& data, Index n, Index new_cap, std::false_type)
+        {
+            T* new_data = allocate<T>(new_cap);
+            Index i = 0;
+
+            try
+            {
+                for (; i < n; i++)
+                    new (&new_data[i]) T(std::move(data[i]));
+            }
+            catch (...)
+            {
+                destroy(new_data, new_data + i);
+                deallocate(new_data);
+                throw;
+            }
+
+            destroy(data, data + n);
+            deallocate(data);
+            data = new_data;
+        }
+
+        // Moves the first n elements of a dense column into a new block of new_cap elements.
+        template <typename T, typename Index>
+        void reallocate(T*& data, Index n, Index new_cap)
+        {
+            reallocate(data, n, new_cap, std::is_trivially_copyable<T>());
+        }
+
+        // Positions of keys[0, n) in ascending key order, stable. LSD radix sort,
+        // 8 bits per pass; passes whose byte is the same for every key are skipped.
+        template <typename Index>
+        std::vector<Index> radix_order(std::vector<unsigned int> keys)
+        {
+            const std::size_t n = keys.size();
+            std::vector<Index> order(n);
+            for (std::size_t i = 0; i < n; i++)
+                order[i] = static_cast<Index>(i);
+
+            std::vector<unsigned int> keys_tmp(n);
+            std::vector<Index> order_tmp(n);
+
+            for (unsigned int shift = 0; shift < 32; shift += 8)
+            {
+                std::size_t offsets[257] = {};
+                for (std::size_t i = 0; i < n; i++)
+                    offsets[(keys[i] >> shift & 0xFFU) + 1]++;
+
+                if (std::find(offsets + 1, offsets + 257, n) != offsets + 257)
+                    continue;
+
+                for (std::size_t b = 1; b < 257; b++)
+                    offsets[b] += offsets[b - 1];
+
+                for (std::size_t i = 0; i < n; i++)
+                {
+                    std::size_t to = offsets[keys[i] >> shift & 0xFFU]++;
+                    keys_tmp[to] = keys[i];
+                    order_tmp[to] = order[i];
+                }
+
+                keys.swap(keys_tmp);
+                order.swap(order_tmp);
+            }
+
+            return order;
+        }
+
+        // Moves the element at old position order[i] to position i. swap_at(i, j)
+        // exchanges two positions of every column; each element is swapped into
+        // its final place at most once.
+        template <typename Index, typename Swap>
+        void permute(const std::vector<Index>& order, Swap swap_at)
+        {
+            std::vector<Index> dest(order.size());
+            for (std::size_t i = 0; i < order.size(); i++)
+                dest[order[i]] = static_cast<Index>(i);
+
+            for (std::size_t i = 0; i < dest.size(); i++)
+            {
+                while (dest[i] != i)
+                {
+                    Index j = dest[i];
+                    swap_at(static_cast<Index>(i), j);
+                    std::swap(dest[i], dest[j]);
+                }
+            }
+        }
+
+        // Smallest power of two strictly greater than n, used to grow the dense storage.
+        // Saturates at the sentinel of Index, which is never a valid dense position.
+        template <typename Index>
+        Index next_capacity(Index n)
+        {
+            const Index max = std::numeric_limits<Index>::max();
+
+            if (n >= max / 2)
+                return max;
+
+            Index cap = 1;
+            while (cap <= n)
+                cap = static_cast<Index>(cap << 1U);
+
+            return cap;
+        }
+    }
+
+    // Non-owning view of a contiguous column.
+    template <typename T>
+    class span
+    {
+    public:
+        span(T* data, std::size_t size) : _data(data), _size(size) {}
+
+        T* data() const { return _data; }
+        std::size_t size() const { return _size; }
+        T* begin() const { return _data; }
+        T* end() const { return _data + _size; }
+        std::reverse_iterator<T*> rbegin() const { return std::reverse_iterator<T*>(end()); }
+        std::reverse_iterator<T*> rend() const { return std::reverse_iterator<T*>(begin()); }
+        T& operator[](std::size_t i) const { return _data[i]; }
+
+    private:
+        T* _data;
+        std::size_t _size;
+    };
+
+    // Hash for keys that already are 32-bit indices. Batched membership tests on
+    // sets using it run a vectorized kernel when compiled with AVX2.
+    struct identity_hash
+    {
+        unsigned int operator()(unsigned int k) const
+        {
+            return k;
+        }
+    };
+
+    // Sparse index policies. The initialized policy keeps every sparse slot either
+    // valid or npos, so search() is a single load. The uninitialized policy
+    // (Briggs & Torczon) never initializes the sparse pages and instead validates a
+    // hit against the key stored next to the dense slot, which makes construction,
+    // growth and clear() independent of the key range.
+    struct initialized_sparse
+    {
+        static const bool validated = false;
+    };
+
+    struct uninitialized_sparse
+    {
+        static const bool validated = true;
+    };
+
+    template <typename Key, typename Value, typename Hash, typename Policy, typename Index>
+    class sparse_map;
+
+    template <typename T, typename Hash, typename Policy = initialized_sparse, typename Index = unsigned int>
     class sparse_set
     {
+        template <typename, typename, typename, typename, typename>
+        friend class sparse_map; // probes and links slots directly to upsert in one lookup
+
+        static_assert(std::is_integral<Index>::value && std::is_unsigned<Index>::value,
+                      "sparse_set index type must be an unsigned integer");
+
     public:
+        using index_type = Index;
+        static constexpr Index npos = std::numeric_limits<Index>::max();
+
         explicit sparse_set(unsigned int cap = 0);
+        sparse_set(const sparse_set&) = delete;
+        sparse_set(sparse_set&& other) noexcept;
+        sparse_set& operator=(const sparse_set&) = delete;
+        sparse_set& operator=(sparse_set&& other) noexcept;
         ~sparse_set();
 
+        void swap(sparse_set& other) noexcept;
+        sparse_set clone() const;
+
         void resize(unsigned int new_cap);
-        void add(T x);
-        void remove(T x);
-        unsigned int search(T x) const;
+        void reserve_keys(unsigned int key_cap);
+        void reserve_elements(Index elem_cap);
+        void add(const T& x);
+        void add(T&& x);
+        template <typename... Args>
+        void emplace(Args&&... args);
+        void add_concurrent(const T& x);
+        void add_concurrent(T&& x);
+        template <typename It>
+        void add_range(It first, It last);
+        template <typename K>
+        void remove(const K& k);
+        template <typename It>
+        void remove_range(It first, It last);
+        template <typename Other>
+        void intersect(const Other& other);
+        template <typename Other>
+        void unite(const Other& other);
+        template <typename Other>
+        void subtract(const Other& other);
+        void swap_positions(Index i, Index j);
+        template <typename Compare>
+        void sort(Compare comp);
+        void sort_by_key();
+        template <typename Other>
+        void sort_as(const Other& other);
+        template <typename K>
+        Index search(const K& k) const;
+        template <typename K>
+        bool contains(const K& k) const;
+        template <typename K>
+        void search_many(const K* keys, std::size_t n, Index* out) const;
+        template <typename K>
+        void contains_many(const K* keys, std::size_t n, bool* out) const;
         void clear();
 
-        unsigned int size() const;
+        Index size() const;
+        Index capacity() const;
+        unsigned int key_capacity() const;
         T* data();
         const T* data() const;
+        span<const T> keys() const;
 
-        using iterator = T*;
+        using iterator = T*; // contiguous; writes must not change the result of the hash function
+        using const_iterator = const T*;
+        using reverse_iterator = std::reverse_iterator<iterator>;
+        using const_reverse_iterator = std::reverse_iterator<const_iterator>;
         iterator begin();
-        const iterator begin() const;
+        const_iterator begin() const;
+        const_iterator cbegin() const;
         iterator end();
-        const iterator end() const;
+        const_iterator end() const;
+        const_iterator cend() const;
+        reverse_iterator rbegin();
+        const_reverse_iterator rbegin() const;
+        reverse_iterator rend();
+        const_reverse_iterator rend() const;
 
     private:
+        void _grow_pages(unsigned int page_count);
+        Index& _slot(unsigned int val);
+        bool _holds(Index idx, unsigned int val) const;
+        void _remove_at(Index idx, unsigned int val);
+        void _relink();
+        std::vector<unsigned int> _hashes() const;
+        void _reserve_one();
+        void _push_back(unsigned int val);
+        void _link(Index& slot, unsigned int val);
+        template <typename... Args>
+        void _emplace_at(Index& slot, unsigned int val, Args&&... args);
+        template <typename U>
+        void _add_concurrent(U&& x);
+        Index& _slot_concurrent(unsigned int val);
+        Index _claim_concurrent();
+        void _publish_concurrent(Index& slot, unsigned int val, Index idx);
+        template <typename It>
+        void _reserve_range(It first, It last, std::forward_iterator_tag);
+        template <typename It>
+        void _reserve_range(It, It, std::input_iterator_tag);
+        template <typename K>
+        void _contains_many(const K* keys, std::size_t n, bool* out, std::false_type) const;
+        void _contains_many(const unsigned int* keys, std::size_t n, bool* out, std::true_type) const;
+
         Hash _hash;
-        unsigned int _n;
-        unsigned int _capacity;
-        unsigned int* _sparse;
+        Index _n;
+        Index _capacity; // dense storage, grows with _n
+        unsigned int _page_count; // sparse index, grows with the largest key
+        Index** _pages;
         T* _dense;
+        unsigned int* _keys; // key of every dense slot, only used by validated policies
     };
 
-    template<typename T, typename Hash>
-    sparse_set<T, Hash>::sparse_set(unsigned int cap)
+    template<typename T, typename Hash, typename Policy, typename Index>
+    constexpr Index sparse_set<T, Hash, Policy, Index>::npos;
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    sparse_set<T, Hash, Policy, Index>::sparse_set(unsigned int cap)
     {
         _n = 0;
-        _capacity = cap;
+        _capacity = 0;
+        _page_count = 0;
+        _pages = nullptr;
+        _dense = nullptr;
+        _keys = nullptr;
+
+        resize(cap);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    sparse_set<T, Hash, Policy, Index>::sparse_set(sparse_set&& other) noexcept
+        : _hash(std::move(other._hash)), _n(other._n), _capacity(other._capacity),
+          _page_count(other._page_count), _pages(other._pages), _dense(other._dense), _keys(other._keys)
+    {
+        other._n = 0;
+        other._capacity = 0;
+        other._page_count = 0;
+        other._pages = nullptr;
+        other._dense = nullptr;
+        other._keys = nullptr;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    sparse_set<T, Hash, Policy, Index> &sparse_set<T, Hash, Policy, Index>::operator=(sparse_set&& other) noexcept
+    {
+        sparse_set tmp(std::move(other));
+        swap(tmp);
+        return *this;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::swap(sparse_set& other) noexcept
+    {
+        using std::swap;
+        swap(_hash, other._hash);
+        swap(_n, other._n);
+        swap(_capacity, other._capacity);
+        swap(_page_count, other._page_count);
+        swap(_pages, other._pages);
+        swap(_dense, other._dense);
+        swap(_keys, other._keys);
+    }
 
-        _sparse = new unsigned int[_capacity];
-        for (int i = 0; i < _capacity; i++)
+    template<typename T, typename Hash, typename Policy, typename Index>
+    sparse_set<T, Hash, Policy, Index> sparse_set<T, Hash, Policy, Index>::clone() const // copies the live elements only
+    {
+        sparse_set copy;
+        copy._hash = _hash;
+        copy.reserve_elements(_n);
+
+        for (Index i = 0; i < _n; i++)
+            copy.add(_dense[i]);
+
+        return copy;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    sparse_set<T, Hash, Policy, Index>::~sparse_set()
+    {
+        for (unsigned int i = 0; i < _page_count; i++)
         {
-            _sparse[i] = UINT_MAX;
+            if (_pages[i] != detail::invalid_page<Index>())
+                delete [] _pages[i];
         }
-        _dense = new T[_capacity];
+
+        delete [] _pages;
+        detail::destroy(_dense, _dense + _n);
+        detail::deallocate(_dense);
+        detail::deallocate(_keys);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::resize(unsigned int new_cap) // only ever grows
+    {
+        reserve_keys(new_cap);
+        reserve_elements(static_cast<Index>(std::min<unsigned long long>(new_cap, npos)));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::reserve_keys(unsigned int key_cap)
+    {
+        auto page_count = static_cast<unsigned int>((static_cast<unsigned long long>(key_cap) + detail::page_mask) >> detail::page_bits);
+
+        if (page_count > _page_count)
+            _grow_pages(page_count);
     }
 
-    template<typename T, typename Hash>
-    sparse_set<T, Hash>::~sparse_set()
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::reserve_elements(Index elem_cap)
     {
-        delete [] _sparse;
-        delete [] _dense;
+        if (elem_cap <= _capacity)
+            return;
+
+        detail::reallocate(_dense, _n, elem_cap);
+        if (Policy::validated)
+            detail::reallocate(_keys, _n, elem_cap);
+
+        _capacity = elem_cap;
     }
 
-    template<typename T, typename Hash>
-    void sparse_set<T, Hash>::resize(unsigned int new_cap)
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::add(const T& x)
     {
-        auto * new_sparse = new unsigned int[new_cap];
-        for (int i = 0; i < new_cap; i++)
+        unsigned int val = _hash(x);
+        Index& slot = _slot(val);
+
+        if (_holds(slot, val))
+            return;
+
+        _emplace_at(slot, val, x);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::add(T&& x)
+    {
+        unsigned int val = _hash(x);
+        Index& slot = _slot(val);
+
+        if (_holds(slot, val))
+            return;
+
+        _emplace_at(slot, val, std::move(x));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename... Args>
+    void sparse_set<T, Hash, Policy, Index>::emplace(Args&&... args)
+    {
+        if (_n == _capacity)
         {
-            new_sparse[i] = UINT_MAX;
+            T x(std::forward<Args>(args)...); // args may refer into the dense array growth is about to move
+            unsigned int val = _hash(x);
+            Index& slot = _slot(val);
+
+            if (_holds(slot, val))
+                return;
+
+            _reserve_one();
+            new (&_dense[_n]) T(std::move(x));
+            _link(slot, val);
+            return;
         }
-        T* new_dense = new T[new_cap];
 
-        unsigned int min_cap = std::min(_capacity, new_cap);
-        std::copy(_sparse, _sparse + min_cap, new_sparse);
-        std::copy(_dense, _dense + min_cap, new_dense);
+        new (&_dense[_n]) T(std::forward<Args>(args)...); // built in the first free slot, dropped again if already present
 
-        delete [] _sparse;
-        delete [] _dense;
+        if (search(_dense[_n]) != npos)
+        {
+            _dense[_n].~T();
+            return;
+        }
 
-        if (_n > new_cap)
-            _n = new_cap;
-        _capacity = new_cap;
-        _sparse = new_sparse;
-        _dense = new_dense;
+        _push_back(_hash(_dense[_n]));
     }
 
-    template<typename T, typename Hash>
-    void sparse_set<T, Hash>::add(T x)
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::add_concurrent(const T& x) // see _add_concurrent
     {
-        unsigned int val = _hash(x);
+        static_assert(std::is_nothrow_copy_constructible<T>::value, "add_concurrent cannot give back a claimed slot");
+        _add_concurrent(x);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::add_concurrent(T&& x)
+    {
+        static_assert(std::is_nothrow_move_constructible<T>::value, "add_concurrent cannot give back a claimed slot");
+        _add_concurrent(std::move(x));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename It>
+    void sparse_set<T, Hash, Policy, Index>::add_range(It first, It last) // grows both sides once up front
+    {
+        _reserve_range(first, last, typename std::iterator_traits<It>::iterator_category());
 
-        if (val >= _capacity) {
-            resize(static_cast<unsigned int>(std::pow(2, std::ceil(std::log2(val + 1)))));
+        for (; first != last; ++first)
+        {
+            unsigned int val = _hash(*first);
+            Index& slot = _slot(val);
+
+            if (!_holds(slot, val))
+                _emplace_at(slot, val, *first);
         }
+    }
 
-        if (search(x) != UINT_MAX)
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_set<T, Hash, Policy, Index>::remove(const K& k) // any K the hash accepts, no T is constructed
+    {
+        Index idx = search(k);
+
+        if (idx == npos)
             return;
 
-        _dense[_n] = x;
-        _sparse[val] = _n;
-        _n++;
+        _remove_at(idx, _hash(k));
     }
 
-    template<typename T, typename Hash>
-    void sparse_set<T, Hash>::remove(T x)
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename It>
+    void sparse_set<T, Hash, Policy, Index>::remove_range(It first, It last)
     {
-        unsigned int val = _hash(x);
+        for (; first != last; ++first)
+            remove(*first);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_set<T, Hash, Policy, Index>::intersect(const Other& other) // other is any sparse_set or sparse_map over the same keys
+    {
+        for (Index i = _n; i-- > 0;) // swap-and-pop only pulls in elements already visited
+        {
+            if (!other.contains(_dense[i]))
+                _remove_at(i, _hash(_dense[i]));
+        }
+    }
 
-        if (search(x) == UINT_MAX)
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_set<T, Hash, Policy, Index>::unite(const Other& other)
+    {
+        if (static_cast<const void*>(&other) == this) // add_range would grow the array it reads from
             return;
 
-        _dense[_sparse[val]] = _dense[_n - 1];
-        _sparse[_hash(_dense[_n - 1])] = _sparse[val];
-        _sparse[val] = UINT_MAX;
+        add_range(other.keys().begin(), other.keys().end());
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_set<T, Hash, Policy, Index>::subtract(const Other& other) // walks the smaller side
+    {
+        if (other.size() < _n)
+        {
+            for (const auto& k : other.keys())
+                remove(k);
+
+            return;
+        }
+
+        for (Index i = _n; i-- > 0;)
+        {
+            if (other.contains(_dense[i]))
+                _remove_at(i, _hash(_dense[i]));
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::swap_positions(Index i, Index j) // reorders the dense array, both must be below size()
+    {
+        if (i == j)
+            return;
+
+        using std::swap;
+        swap(_dense[i], _dense[j]);
+
+        if (Policy::validated)
+        {
+            swap(_keys[i], _keys[j]);
+            _slot(_keys[i]) = i;
+            _slot(_keys[j]) = j;
+        }
+        else
+        {
+            _slot(_hash(_dense[i])) = i;
+            _slot(_hash(_dense[j])) = j;
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename Compare>
+    void sparse_set<T, Hash, Policy, Index>::sort(Compare comp)
+    {
+        std::sort(_dense, _dense + _n, comp);
+        _relink();
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::sort_by_key() // ascending hash order, reproducible regardless of insertion history
+    {
+        using std::swap;
+        detail::permute(detail::radix_order<Index>(_hashes()), [this](Index i, Index j) { swap(_dense[i], _dense[j]); });
+        _relink();
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename Other>
+    void sparse_set<T, Hash, Policy, Index>::sort_as(const Other& other) // keys other contains come first, in its order
+    {
+        Index pos = 0;
+
+        for (const auto& k : other.keys())
+        {
+            Index idx = search(k);
+            if (idx != npos)
+                swap_positions(idx, pos++);
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_relink() // points the sparse slot of every element back at its dense position
+    {
+        for (Index i = 0; i < _n; i++)
+        {
+            unsigned int val = _hash(_dense[i]);
+
+            if (Policy::validated)
+                _keys[i] = val;
+
+            _slot(val) = i;
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    std::vector<unsigned int> sparse_set<T, Hash, Policy, Index>::_hashes() const
+    {
+        std::vector<unsigned int> hashes(_n);
+
+        for (Index i = 0; i < _n; i++)
+            hashes[i] = Policy::validated ? _keys[i] : _hash(_dense[i]);
+
+        return hashes;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_remove_at(Index idx, unsigned int val) // val is the hash of the element at idx
+    {
+        if (idx != _n - 1)
+        {
+            _dense[idx] = std::move(_dense[_n - 1]);
+
+            if (Policy::validated)
+            {
+                _keys[idx] = _keys[_n - 1];
+                _slot(_keys[idx]) = idx;
+            }
+            else
+            {
+                _slot(_hash(_dense[idx])) = idx;
+            }
+        }
+
+        _dense[_n - 1].~T();
+
+        if (!Policy::validated)
+            _slot(val) = npos;
 
         _n--;
     }
 
-    template<typename T, typename Hash>
-    unsigned int sparse_set<T, Hash>::search(T x) const
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    Index sparse_set<T, Hash, Policy, Index>::search(const K& k) const // any K the hash accepts, no T is constructed
     {
-        unsigned int val = _hash(x);
+        unsigned int val = _hash(k);
+        unsigned int page = val >> detail::page_bits;
 
-        if (val >= _capacity)
-            return UINT_MAX;
+        if (page >= _page_count)
+            return npos;
 
-        if (_sparse[val] < _n)
-            return _sparse[val];
+        Index idx = _pages[page][val & detail::page_mask];
 
-        return UINT_MAX;
+        if (Policy::validated)
+            return _holds(idx, val) ? idx : npos;
+
+        return idx;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    bool sparse_set<T, Hash, Policy, Index>::contains(const K& k) const
+    {
+        return search(k) != npos;
     }
 
-    template<typename T, typename Hash>
-    void sparse_set<T, Hash>::clear()
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_set<T, Hash, Policy, Index>::search_many(const K* keys, std::size_t n, Index* out) const // search() for n keys, overlapping their cache misses
     {
+        unsigned int vals[detail::batch_size];
+        const Index* slots[detail::batch_size];
+
+        for (std::size_t first = 0; first < n; first += detail::batch_size)
+        {
+            std::size_t m = std::min(n - first, detail::batch_size);
+
+            for (std::size_t j = 0; j < m; j++)
+            {
+                vals[j] = _hash(keys[first + j]);
+                unsigned int page = vals[j] >> detail::page_bits;
+                slots[j] = page < _page_count ? &_pages[page][vals[j] & detail::page_mask] : nullptr;
+
+                if (slots[j] != nullptr)
+                    detail::prefetch(slots[j]);
+            }
+
+            for (std::size_t j = 0; j < m; j++)
+            {
+                Index idx = slots[j] != nullptr ? *slots[j] : npos;
+
+                if (Policy::validated && idx < _n)
+                    detail::prefetch(&_keys[idx]);
+
+                out[first + j] = idx;
+            }
+
+            if (Policy::validated)
+            {
+                for (std::size_t j = 0; j < m; j++)
+                {
+                    if (!_holds(out[first + j], vals[j]))
+                        out[first + j] = npos;
+                }
+            }
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_set<T, Hash, Policy, Index>::contains_many(const K* keys, std::size_t n, bool* out) const
+    {
+#if defined(__AVX2__)
+        using vectorized = std::integral_constant<bool,
+                std::is_same<Hash, identity_hash>::value && std::is_same<K, unsigned int>::value && sizeof(Index) == 4>;
+#else
+        using vectorized = std::false_type;
+#endif
+
+        _contains_many(keys, n, out, vectorized());
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename K>
+    void sparse_set<T, Hash, Policy, Index>::_contains_many(const K* keys, std::size_t n, bool* out, std::false_type) const
+    {
+        Index idx[detail::batch_size];
+
+        for (std::size_t first = 0; first < n; first += detail::batch_size)
+        {
+            std::size_t m = std::min(n - first, detail::batch_size);
+            search_many(keys + first, m, idx);
+
+            for (std::size_t j = 0; j < m; j++)
+                out[first + j] = idx[j] != npos;
+        }
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_contains_many(const unsigned int* keys, std::size_t n, bool* out, std::true_type) const // four keys per step: gather page pointers, then slots
+    {
+#if defined(__AVX2__)
+        if (_n > static_cast<Index>(INT_MAX)) // dense positions are gathered as signed 32-bit offsets
+            return _contains_many(keys, n, out, std::false_type());
+
+        const __m128i page_count = _mm_set1_epi32(static_cast<int>(_page_count));
+        const __m128i page_mask = _mm_set1_epi32(static_cast<int>(detail::page_mask));
+        const __m128i sign = _mm_set1_epi32(INT_MIN);
+        const __m128i live = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(_n)), sign);
+        const __m128i not_found = _mm_set1_epi32(-1);
+
+        std::size_t i = 0;
+
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i vals = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+            __m128i pages = _mm_srli_epi32(vals, detail::page_bits);
+            __m128i in_range = _mm_cmpgt_epi32(page_count, pages); // both below 2^21, signed compare is exact
+
+            __m256i page_ptrs = _mm256_mask_i32gather_epi64(_mm256_setzero_si256(), reinterpret_cast<const long long*>(_pages),
+                                                            _mm_and_si128(pages, in_range), _mm256_cvtepi32_epi64(in_range), sizeof(Index*));
+            __m256i slot_ptrs = _mm256_add_epi64(page_ptrs, _mm256_slli_epi64(_mm256_cvtepu32_epi64(_mm_and_si128(vals, page_mask)), 2));
+            __m128i idx = _mm256_mask_i64gather_epi32(not_found, static_cast<const int*>(nullptr), slot_ptrs, in_range, 1);
+
+            __m128i found;
+
+            if (Policy::validated)
+            {
+                __m128i valid = _mm_cmpgt_epi32(live, _mm_xor_si128(idx, sign)); // idx < _n, unsigned
+                __m128i stored = _mm_mask_i32gather_epi32(not_found, reinterpret_cast<const int*>(_keys), idx, valid, sizeof(unsigned int));
+                found = _mm_and_si128(valid, _mm_cmpeq_epi32(stored, vals));
+            }
+            else
+            {
+                found = _mm_andnot_si128(_mm_cmpeq_epi32(idx, not_found), in_range);
+            }
+
+            int bits = _mm_movemask_ps(_mm_castsi128_ps(found));
+
+            for (int j = 0; j < 4; j++)
+                out[i + j] = (bits >> j & 1) != 0;
+        }
+
+        _contains_many(keys + i, n - i, out + i, std::false_type());
+#else
+        _contains_many(keys, n, out, std::false_type());
+#endif
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::clear()
+    {
+        if (!Policy::validated)
+        {
+            for (Index i = 0; i < _n; i++)
+            {
+                _slot(_hash(_dense[i])) = npos;
+            }
+        }
+
+        detail::destroy(_dense, _dense + _n);
         _n = 0;
     }
 
-    template<typename T, typename Hash>
-    unsigned int sparse_set<T, Hash>::size() const
+    template<typename T, typename Hash, typename Policy, typename Index>
+    Index sparse_set<T, Hash, Policy, Index>::size() const
     {
         return _n;
     }
 
-    template<typename T, typename Hash>
-    T *sparse_set<T, Hash>::data() // not allowed to change result of hash function
+    template<typename T, typename Hash, typename Policy, typename Index>
+    Index sparse_set<T, Hash, Policy, Index>::capacity() const
+    {
+        return _capacity;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    unsigned int sparse_set<T, Hash, Policy, Index>::key_capacity() const
+    {
+        return static_cast<unsigned int>(std::min<unsigned long long>(static_cast<unsigned long long>(_page_count) << detail::page_bits, UINT_MAX));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    T *sparse_set<T, Hash, Policy, Index>::data() // not allowed to change result of hash function
     {
         return _dense;
     }
 
-    template<typename T, typename Hash>
-    const T *sparse_set<T, Hash>::data() const // not allowed to change result of hash function
+    template<typename T, typename Hash, typename Policy, typename Index>
+    const T *sparse_set<T, Hash, Policy, Index>::data() const // not allowed to change result of hash function
     {
         return _dense;
     }
 
-    template<typename T, typename Hash>
-    typename sparse_set<T, Hash>::iterator sparse_set<T, Hash>::begin()
+    template<typename T, typename Hash, typename Policy, typename Index>
+    span<const T> sparse_set<T, Hash, Policy, Index>::keys() const // the elements are the keys
+    {
+        return span<const T>(_dense, _n);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::iterator sparse_set<T, Hash, Policy, Index>::begin()
+    {
+        return _dense;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::const_iterator sparse_set<T, Hash, Policy, Index>::begin() const
+    {
+        return _dense;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::const_iterator sparse_set<T, Hash, Policy, Index>::cbegin() const
+    {
+        return _dense;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::iterator sparse_set<T, Hash, Policy, Index>::end()
+    {
+        return _dense + _n;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::const_iterator sparse_set<T, Hash, Policy, Index>::end() const
+    {
+        return _dense + _n;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::const_iterator sparse_set<T, Hash, Policy, Index>::cend() const
+    {
+        return _dense + _n;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::reverse_iterator sparse_set<T, Hash, Policy, Index>::rbegin()
     {
-        return &_dense[0];
+        return reverse_iterator(end());
     }
 
-    template<typename T, typename Hash>
-    const typename sparse_set<T, Hash>::iterator sparse_set<T, Hash>::begin() const
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::const_reverse_iterator sparse_set<T, Hash, Policy, Index>::rbegin() const
     {
-        return &_dense[0];
+        return const_reverse_iterator(end());
     }
 
-    template<typename T, typename Hash>
-    typename sparse_set<T, Hash>::iterator sparse_set<T, Hash>::end()
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::reverse_iterator sparse_set<T, Hash, Policy, Index>::rend()
     {
-        return &_dense[size()];
+        return reverse_iterator(begin());
     }
 
-    template<typename T, typename Hash>
-    const typename sparse_set<T, Hash>::iterator sparse_set<T, Hash>::end() const
+    template<typename T, typename Hash, typename Policy, typename Index>
+    typename sparse_set<T, Hash, Policy, Index>::const_reverse_iterator sparse_set<T, Hash, Policy, Index>::rend() const
     {
-        return &_dense[size()];
+        return const_reverse_iterator(begin());
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_grow_pages(unsigned int page_count)
+    {
+        unsigned int new_count = 1;
+        while (new_count < page_count)
+            new_count <<= 1U;
+
+        auto new_pages = new Index*[new_count];
+        std::copy(_pages, _pages + _page_count, new_pages);
+        std::fill(new_pages + _page_count, new_pages + new_count, detail::invalid_page<Index>());
+        delete [] _pages;
+
+        _page_count = new_count;
+        _pages = new_pages;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_reserve_one()
+    {
+        if (_n < _capacity)
+            return;
+
+        if (_capacity == npos)
+            throw std::length_error("sparse_set index type exhausted.");
+
+        reserve_elements(detail::next_capacity(_n));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_push_back(unsigned int val) // links the element already stored at _dense[_n]
+    {
+        _link(_slot(val), val);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_link(Index& slot, unsigned int val) // slot is _slot(val), probed beforehand
+    {
+        if (Policy::validated)
+            _keys[_n] = val;
+
+        slot = _n;
+        _n++;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename... Args>
+    void sparse_set<T, Hash, Policy, Index>::_emplace_at(Index& slot, unsigned int val, Args&&... args) // slot stays valid, growth only moves the dense side
+    {
+        if (_n == _capacity)
+        {
+            T x(std::forward<Args>(args)...); // args may refer into the dense array growth is about to move
+            _reserve_one();
+            new (&_dense[_n]) T(std::move(x));
+        }
+        else
+        {
+            new (&_dense[_n]) T(std::forward<Args>(args)...);
+        }
+
+        _link(slot, val);
+    }
+
+    // Lock-free add from several threads at once. Nothing else may touch the set
+    // meanwhile, x must not be contained and no other thread may add the same key.
+    // reserve_keys() and reserve_elements() must already cover every key and
+    // element added; pages are still materialised on demand.
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename U>
+    void sparse_set<T, Hash, Policy, Index>::_add_concurrent(U&& x)
+    {
+        unsigned int val = _hash(x);
+        Index& slot = _slot_concurrent(val);
+        Index idx = _claim_concurrent();
+
+        new (&_dense[idx]) T(std::forward<U>(x));
+        _publish_concurrent(slot, val, idx);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    Index &sparse_set<T, Hash, Policy, Index>::_slot_concurrent(unsigned int val) // the first thread to install a page wins
+    {
+        unsigned int page = val >> detail::page_bits;
+
+        if (page >= _page_count)
+            throw std::length_error("sparse_set key outside the range reserved for concurrent adds.");
+
+        Index* p = detail::atomic_load_acquire(_pages[page]);
+
+        if (p == detail::invalid_page<Index>())
+        {
+            Index* fresh = new Index[detail::page_size];
+            if (!Policy::validated)
+                std::fill(fresh, fresh + detail::page_size, npos);
+
+            if (detail::atomic_compare_exchange(_pages[page], p, fresh))
+                p = fresh;
+            else
+                delete [] fresh;
+        }
+
+        return p[val & detail::page_mask];
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    Index sparse_set<T, Hash, Policy, Index>::_claim_concurrent() // a dense slot of its own for the calling thread
+    {
+        Index idx = detail::atomic_fetch_add(_n, Index(1));
+
+        if (idx >= _capacity)
+        {
+            detail::atomic_fetch_sub(_n, Index(1)); // _n never drops below the slots handed out
+            throw std::length_error("sparse_set capacity not reserved for concurrent adds.");
+        }
+
+        return idx;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void sparse_set<T, Hash, Policy, Index>::_publish_concurrent(Index& slot, unsigned int val, Index idx) // after the dense side of idx is built
+    {
+        if (Policy::validated)
+            _keys[idx] = val;
+
+        detail::atomic_store_release(slot, idx);
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename It>
+    void sparse_set<T, Hash, Policy, Index>::_reserve_range(It first, It last, std::forward_iterator_tag) // sized for the largest key and for every element being new
+    {
+        unsigned long long count = 0;
+        unsigned int max_val = 0;
+
+        for (; first != last; ++first, ++count)
+            max_val = std::max(max_val, static_cast<unsigned int>(_hash(*first)));
+
+        if (count == 0)
+            return;
+
+        unsigned int page = max_val >> detail::page_bits;
+        if (page >= _page_count)
+            _grow_pages(page + 1);
+
+        unsigned long long needed = _n + count;
+
+        if (needed > _capacity) // geometric, so repeated small ranges stay amortized
+            reserve_elements(static_cast<Index>(std::min<unsigned long long>(std::max<unsigned long long>(needed, detail::next_capacity(_capacity)), npos)));
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    template<typename It>
+    void sparse_set<T, Hash, Policy, Index>::_reserve_range(It, It, std::input_iterator_tag) // single pass, grows as it goes
+    {
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    bool sparse_set<T, Hash, Policy, Index>::_holds(Index idx, unsigned int val) const // idx was read from the sparse slot of val
+    {
+        if (Policy::validated)
+            return idx < _n && _keys[idx] == val;
+
+        return idx != npos;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    Index &sparse_set<T, Hash, Policy, Index>::_slot(unsigned int val) // materialises the page holding val
+    {
+        unsigned int page = val >> detail::page_bits;
+
+        if (page >= _page_count)
+            _grow_pages(page + 1);
+
+        if (_pages[page] == detail::invalid_page<Index>())
+        {
+            _pages[page] = new Index[detail::page_size];
+            if (!Policy::validated)
+                std::fill(_pages[page], _pages[page] + detail::page_size, npos);
+        }
+
+        return _pages[page][val & detail::page_mask];
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index>
+    void swap(sparse_set<T, Hash, Policy, Index>& lhs, sparse_set<T, Hash, Policy, Index>& rhs) noexcept
+    {
+        lhs.swap(rhs);
+    }
+
+    // Set algebra into a new set; b may be any sparse_set or sparse_map over the same keys.
+    template<typename T, typename Hash, typename Policy, typename Index, typename Other>
+    sparse_set<T, Hash, Policy, Index> intersect(const sparse_set<T, Hash, Policy, Index>& a, const Other& b) // walks the smaller side
+    {
+        sparse_set<T, Hash, Policy, Index> result;
+        result.reserve_elements(static_cast<Index>(std::min<std::size_t>(a.size(), b.size())));
+
+        if (b.size() < a.size())
+        {
+            for (const auto& k : b.keys())
+            {
+                auto idx = a.search(k);
+                if (idx != a.npos)
+                    result.add(a.data()[idx]);
+            }
+        }
+        else
+        {
+            for (const auto& x : a.keys())
+            {
+                if (b.contains(x))
+                    result.add(x);
+            }
+        }
+
+        return result;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index, typename Other>
+    sparse_set<T, Hash, Policy, Index> unite(const sparse_set<T, Hash, Policy, Index>& a, const Other& b)
+    {
+        auto result = a.clone();
+        result.unite(b);
+        return result;
+    }
+
+    template<typename T, typename Hash, typename Policy, typename Index, typename Other>
+    sparse_set<T, Hash, Policy, Index> subtract(const sparse_set<T, Hash, Policy, Index>& a, const Other& b)
+    {
+        sparse_set<T, Hash, Policy, Index> result;
+        result.reserve_elements(a.size());
+
+        for (const auto& x : a.keys())
+        {
+            if (!b.contains(x))
+                result.add(x);
+        }
+
+        return result;
     }
 
 }
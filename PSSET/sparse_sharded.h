@@ -0,0 +1,279 @@
+//
+// Sparse map split into independently locked shards.
+//
+
+#ifndef PSSET_SPARSE_SHARDED_H
+#define PSSET_SPARSE_SHARDED_H
+
+
+#include "sparse_parallel.h"
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace psset
+{
+
+    namespace detail
+    {
+        // Test-and-test-and-set lock for critical sections of a few lookups.
+        class spin_lock
+        {
+        public:
+            spin_lock() : _locked(false) {}
+
+            void lock()
+            {
+                for (;;)
+                {
+                    if (!_locked.exchange(true, std::memory_order_acquire))
+                        return;
+
+                    while (_locked.load(std::memory_order_relaxed))
+                        std::this_thread::yield();
+                }
+            }
+
+            bool try_lock()
+            {
+                return !_locked.load(std::memory_order_relaxed) && !_locked.exchange(true, std::memory_order_acquire);
+            }
+
+            void unlock()
+            {
+                _locked.store(false, std::memory_order_release);
+            }
+
+        private:
+            std::atomic<bool> _locked;
+        };
+
+        // Drops the shard bits, so each shard indexes a dense range of its own.
+        template <typename Hash, unsigned int Bits>
+        struct shard_hash
+        {
+            template <typename K>
+            unsigned int operator()(const K& k) const
+            {
+                return Hash()(k) >> Bits;
+            }
+        };
+
+        constexpr unsigned int log2(unsigned int n)
+        {
+            return n <= 1 ? 0 : 1 + log2(n >> 1U);
+        }
+    }
+
+    // Splits the key space over Shards sparse_maps by the low bits of the hash,
+    // so that consecutive keys land in different shards. Each shard has its own
+    // lock and sits on cache lines of its own; operations on keys in different
+    // shards never touch the same memory.
+    template <typename Key, typename Value, typename Hash, unsigned int Shards = 16,
+              typename Policy = initialized_sparse, typename Index = unsigned int>
+    class sharded_sparse_map
+    {
+        static_assert(Shards > 0 && (Shards & (Shards - 1)) == 0, "the shard count must be a power of two");
+
+        static constexpr unsigned int shard_bits = detail::log2(Shards);
+
+    public:
+        using key_type = Key;
+        using mapped_type = Value;
+        using shard_type = sparse_map<Key, Value, detail::shard_hash<Hash, shard_bits>, Policy, Index>;
+
+        sharded_sparse_map() = default;
+        sharded_sparse_map(const sharded_sparse_map&) = delete;
+        sharded_sparse_map& operator=(const sharded_sparse_map&) = delete;
+
+        void add(const Key& k, const Value& v);
+        template <typename... Args>
+        bool try_emplace(const Key& k, Args&&... args);
+        template <typename V>
+        void insert_or_assign(const Key& k, V&& v);
+        template <typename K>
+        void remove(const K& k);
+        void clear();
+
+        template <typename K>
+        bool contains(const K& k) const;
+        template <typename K>
+        bool try_get(const K& k, Value& out) const;
+        template <typename K, typename F>
+        bool visit(const K& k, F f);
+
+        template <typename F>
+        void for_each(F f);
+        template <typename F>
+        void for_each_shard(std::size_t s, F f);
+
+        template <typename K>
+        static std::size_t shard_of(const K& k);
+        static constexpr std::size_t shard_count() { return Shards; }
+
+        std::size_t size() const;
+        bool empty() const;
+
+    private:
+        struct shard
+        {
+            mutable detail::spin_lock lock;
+            shard_type map;
+            char pad[detail::cache_line]; // keeps the next shard's lock off this one's lines
+        };
+
+        using guard = std::lock_guard<detail::spin_lock>;
+
+        shard _shards[Shards];
+    };
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    void sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::add(const Key& k, const Value& v) // ignored if k is already contained
+    {
+        shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        s.map.add(k, v);
+    }
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename... Args>
+    bool sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::try_emplace(const Key& k, Args&&... args) // true if k was added
+    {
+        shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        return s.map.try_emplace(k, std::forward<Args>(args)...).second;
+    }
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename V>
+    void sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::insert_or_assign(const Key& k, V&& v)
+    {
+        shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        s.map.insert_or_assign(k, std::forward<V>(v));
+    }
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename K>
+    void sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::remove(const K& k)
+    {
+        shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        s.map.remove(k);
+    }
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    void sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::clear() // one shard at a time
+    {
+        for (auto& s : _shards)
+        {
+            guard lock(s.lock);
+            s.map.clear();
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename K>
+    bool sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::contains(const K& k) const
+    {
+        const shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        return s.map.contains(k);
+    }
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename K>
+    bool sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::try_get(const K& k, Value& out) const // copies the value out under the shard lock
+    {
+        const shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        const Value* v = s.map.find(k);
+
+        if (v == nullptr)
+            return false;
+
+        out = *v;
+        return true;
+    }
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename K, typename F>
+    bool sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::visit(const K& k, F f) // f(value) under the shard lock, false if k is not contained
+    {
+        shard& s = _shards[shard_of(k)];
+        guard lock(s.lock);
+        Value* v = s.map.find(k);
+
+        if (v == nullptr)
+            return false;
+
+        f(*v);
+        return true;
+    }
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename F>
+    void sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::for_each(F f) // f(key, value), shard by shard
+    {
+        for (std::size_t s = 0; s < Shards; s++)
+            for_each_shard(s, f);
+    }
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename F>
+    void sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::for_each_shard(std::size_t s, F f) // holds the lock of shard s for the whole walk
+    {
+        guard lock(_shards[s].lock);
+
+        shard_type& map = _shards[s].map;
+        const Key* keys = map.keys().data();
+        Value* values = map.values().data();
+
+        for (Index i = 0; i < map.size(); i++)
+            f(keys[i], values[i]);
+    }
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    template<typename K>
+    std::size_t sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::shard_of(const K& k)
+    {
+        return Hash()(k) & (Shards - 1);
+    }
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    std::size_t sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::size() const // each shard is read at a different moment
+    {
+        std::size_t n = 0;
+
+        for (const auto& s : _shards)
+        {
+            guard lock(s.lock);
+            n += s.map.size();
+        }
+
+        return n;
+    }
+
+    template<typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index>
+    bool sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>::empty() const
+    {
+        return size() == 0;
+    }
+
+    // fn(key, value) for every entry, one shard per task.
+    template <typename Key, typename Value, typename Hash, unsigned int Shards, typename Policy, typename Index, typename F>
+    void parallel_for_each(sharded_sparse_map<Key, Value, Hash, Shards, Policy, Index>& map, F fn, thread_pool& pool = thread_pool::shared())
+    {
+        pool.parallel_for(Shards, 1, [&](std::size_t first, std::size_t last) {
+            for (std::size_t s = first; s < last; s++)
+                map.for_each_shard(s, fn);
+        });
+    }
+
+}
+
+
+#endif //PSSET_SPARSE_SHARDED_H
@@ -0,0 +1,270 @@
+//
+// Join views over several sparse_maps sharing a key space.
+//
+
+#ifndef PSSET_SPARSE_VIEW_H
+#define PSSET_SPARSE_VIEW_H
+
+
+#include "sparse_map.h"
+
+#include <cstddef>
+#include <iterator>
+#include <tuple>
+
+namespace psset
+{
+
+    namespace detail
+    {
+        template <std::size_t... I>
+        struct index_sequence {};
+
+        template <std::size_t N, std::size_t... I>
+        struct make_index_sequence : make_index_sequence<N - 1, N - 1, I...> {};
+
+        template <std::size_t... I>
+        struct make_index_sequence<0, I...> : index_sequence<I...> {};
+
+        // Value type of a pool as seen through the view, const if the pool is.
+        template <typename Map>
+        using pool_value_t = typename std::conditional<std::is_const<Map>::value,
+                const typename Map::mapped_type, typename Map::mapped_type>::type;
+
+        template <typename Map, typename... Maps>
+        struct first_pool
+        {
+            using type = Map;
+        };
+    }
+
+    // Tags the types of the pools whose keys are filtered out of a view.
+    template <typename... Pools>
+    struct exclude_t {};
+
+    template <typename Exclude, typename... Maps>
+    class view;
+
+    // Visits every key contained in all of Maps and in none of the excluded pools.
+    // The smallest map drives the walk and the others are probed; maps must not
+    // gain or lose keys while a walk is in progress.
+    template <typename... Excluded, typename... Maps>
+    class view<exclude_t<Excluded...>, Maps...>
+    {
+        static_assert(sizeof...(Maps) > 0, "a view needs at least one map");
+
+        using pools_seq = detail::make_index_sequence<sizeof...(Maps)>;
+        using excluded_seq = detail::make_index_sequence<sizeof...(Excluded)>;
+        using pointers = std::tuple<detail::pool_value_t<Maps>*...>;
+
+    public:
+        using key_type = typename detail::first_pool<Maps...>::type::key_type;
+        using value_type = std::tuple<const key_type&, detail::pool_value_t<Maps>&...>;
+
+        class iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = typename view::value_type;
+            using difference_type = std::ptrdiff_t;
+            using pointer = void;
+            using reference = value_type;
+
+            iterator(const view* v, std::size_t driver, span<const key_type> keys, std::size_t i)
+                : _view(v), _driver(driver), _keys(keys), _i(i)
+            {
+                _seek();
+            }
+
+            reference operator*() const { return _deref(pools_seq()); }
+            iterator& operator++() { ++_i; _seek(); return *this; }
+            iterator operator++(int) { iterator it = *this; ++*this; return it; }
+            bool operator==(const iterator& rhs) const { return _i == rhs._i; }
+            bool operator!=(const iterator& rhs) const { return _i != rhs._i; }
+
+        private:
+            void _seek()
+            {
+                while (_i < _keys.size() && !_view->_match(_keys[_i], _i, _driver, _ptrs, pools_seq()))
+                    ++_i;
+            }
+
+            template <std::size_t... I>
+            reference _deref(detail::index_sequence<I...>) const
+            {
+                return reference(_keys[_i], *std::get<I>(_ptrs)...);
+            }
+
+            const view* _view;
+            std::size_t _driver;
+            span<const key_type> _keys;
+            std::size_t _i;
+            pointers _ptrs;
+        };
+
+        explicit view(Maps&... maps, const Excluded&... excluded);
+
+        template <typename... More>
+        view<exclude_t<Excluded..., More...>, Maps...> exclude(const More&... pools) const;
+
+        template <typename F>
+        void each(F f) const;
+        template <typename F>
+        void each(F f, std::size_t first, std::size_t last) const;
+
+        std::size_t size_hint() const;
+
+        iterator begin() const;
+        iterator end() const;
+
+    private:
+        template <std::size_t... I, typename... More, std::size_t... J>
+        view<exclude_t<Excluded..., More...>, Maps...> _exclude(detail::index_sequence<I...>, detail::index_sequence<J...>,
+                                                                 const More&... pools) const;
+        template <typename F, std::size_t... I>
+        void _each(F& f, std::size_t first, std::size_t last, detail::index_sequence<I...>) const;
+        template <std::size_t... I>
+        std::size_t _driver(detail::index_sequence<I...>) const;
+        template <std::size_t... I>
+        span<const key_type> _keys(std::size_t driver, detail::index_sequence<I...>) const;
+        template <std::size_t... I>
+        bool _match(const key_type& k, std::size_t i, std::size_t driver, pointers& ptrs, detail::index_sequence<I...>) const;
+        template <std::size_t... J>
+        bool _excluded(const key_type& k, detail::index_sequence<J...>) const;
+        template <std::size_t I>
+        typename std::tuple_element<I, pointers>::type _fetch(const key_type& k, std::size_t i, std::size_t driver) const;
+
+        std::tuple<Maps&...> _pools;
+        std::tuple<const Excluded&...> _exclude_pools;
+    };
+
+    template <typename... Excluded, typename... Maps>
+    view<exclude_t<Excluded...>, Maps...>::view(Maps&... maps, const Excluded&... excluded)
+        : _pools(maps...), _exclude_pools(excluded...)
+    {
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <typename... More>
+    view<exclude_t<Excluded..., More...>, Maps...> view<exclude_t<Excluded...>, Maps...>::exclude(const More&... pools) const // any sparse_set or sparse_map over the same keys
+    {
+        return _exclude(pools_seq(), excluded_seq(), pools...);
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <std::size_t... I, typename... More, std::size_t... J>
+    view<exclude_t<Excluded..., More...>, Maps...> view<exclude_t<Excluded...>, Maps...>::_exclude(detail::index_sequence<I...>, detail::index_sequence<J...>,
+                                                                                                    const More&... pools) const
+    {
+        return view<exclude_t<Excluded..., More...>, Maps...>(std::get<I>(_pools)..., std::get<J>(_exclude_pools)..., pools...);
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <typename F>
+    void view<exclude_t<Excluded...>, Maps...>::each(F f) const // f(key, values...), one reference per map
+    {
+        _each(f, 0, size_hint(), pools_seq());
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <typename F>
+    void view<exclude_t<Excluded...>, Maps...>::each(F f, std::size_t first, std::size_t last) const // only positions [first, last) of the driving map
+    {
+        _each(f, first, last, pools_seq());
+    }
+
+    template <typename... Excluded, typename... Maps>
+    std::size_t view<exclude_t<Excluded...>, Maps...>::size_hint() const // upper bound, the size of the driving map
+    {
+        return _keys(_driver(pools_seq()), pools_seq()).size();
+    }
+
+    template <typename... Excluded, typename... Maps>
+    typename view<exclude_t<Excluded...>, Maps...>::iterator view<exclude_t<Excluded...>, Maps...>::begin() const
+    {
+        std::size_t driver = _driver(pools_seq());
+        return iterator(this, driver, _keys(driver, pools_seq()), 0);
+    }
+
+    template <typename... Excluded, typename... Maps>
+    typename view<exclude_t<Excluded...>, Maps...>::iterator view<exclude_t<Excluded...>, Maps...>::end() const
+    {
+        std::size_t driver = _driver(pools_seq());
+        span<const key_type> keys = _keys(driver, pools_seq());
+        return iterator(this, driver, keys, keys.size());
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <typename F, std::size_t... I>
+    void view<exclude_t<Excluded...>, Maps...>::_each(F& f, std::size_t first, std::size_t last, detail::index_sequence<I...> seq) const
+    {
+        std::size_t driver = _driver(seq);
+        span<const key_type> keys = _keys(driver, seq);
+        pointers ptrs;
+
+        last = std::min(last, keys.size());
+
+        for (std::size_t i = first; i < last; i++)
+        {
+            if (_match(keys[i], i, driver, ptrs, seq))
+                f(keys[i], *std::get<I>(ptrs)...);
+        }
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <std::size_t... I>
+    std::size_t view<exclude_t<Excluded...>, Maps...>::_driver(detail::index_sequence<I...>) const // position of the smallest map
+    {
+        const std::size_t sizes[] = {static_cast<std::size_t>(std::get<I>(_pools).size())...};
+        return static_cast<std::size_t>(std::min_element(sizes, sizes + sizeof...(I)) - sizes);
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <std::size_t... I>
+    span<const typename view<exclude_t<Excluded...>, Maps...>::key_type> view<exclude_t<Excluded...>, Maps...>::_keys(std::size_t driver, detail::index_sequence<I...>) const
+    {
+        const span<const key_type> keys[] = {std::get<I>(_pools).keys()...};
+        return keys[driver];
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <std::size_t... I>
+    bool view<exclude_t<Excluded...>, Maps...>::_match(const key_type& k, std::size_t i, std::size_t driver, pointers& ptrs, detail::index_sequence<I...>) const // stops probing at the first miss
+    {
+        bool found = true;
+        const int expand[] = {0, (found = found && (std::get<I>(ptrs) = _fetch<I>(k, i, driver)) != nullptr, 0)...};
+        (void) expand;
+
+        return found && !_excluded(k, excluded_seq());
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <std::size_t... J>
+    bool view<exclude_t<Excluded...>, Maps...>::_excluded(const key_type& k, detail::index_sequence<J...>) const
+    {
+        bool hit = false;
+        const int expand[] = {0, (hit = hit || std::get<J>(_exclude_pools).contains(k), 0)...};
+        (void) expand;
+
+        return hit;
+    }
+
+    template <typename... Excluded, typename... Maps>
+    template <std::size_t I>
+    typename std::tuple_element<I, typename view<exclude_t<Excluded...>, Maps...>::pointers>::type
+    view<exclude_t<Excluded...>, Maps...>::_fetch(const key_type& k, std::size_t i, std::size_t driver) const // the driving map is read by position, the others are probed
+    {
+        auto& pool = std::get<I>(_pools);
+        return I == driver ? &pool.values()[i] : pool.find(k);
+    }
+
+    template <typename Map, typename... Maps>
+    view<exclude_t<>, Map, Maps...> make_view(Map& map, Maps&... maps)
+    {
+        return view<exclude_t<>, Map, Maps...>(map, maps...);
+    }
+
+}
+
+
+#endif //PSSET_SPARSE_VIEW_H
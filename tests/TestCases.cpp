@@ -6,7 +6,17 @@
 
 #include "psset.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 typedef uint32_t EntityIndex;
 typedef uint8_t EntityVersion;
@@ -64,6 +74,22 @@ private:
     EntityId _id;
 };
 
+struct StringLengthHash
+{
+    unsigned int operator()(std::string const& s) const
+    {
+        return static_cast<unsigned int>(s.size());
+    }
+};
+
+struct UIntHash
+{
+    unsigned int operator()(unsigned int const& e) const
+    {
+        return e;
+    }
+};
+
 
 
 TEST_CASE( "sparse_set creation and deletion of 1M entities", "[sparse_set]")
@@ -109,6 +135,119 @@ TEST_CASE( "sparse_set mixed creation and deletion of 10k entities", "[sparse_se
     }
 }
 
+TEST_CASE( "sparse_set with keys spread over distant pages", "[sparse_set]")
+{
+    psset::sparse_set<unsigned int, UIntHash> sset;
+
+    std::vector<unsigned int> keys = {0, 1, 4095, 4096, 1U << 20U, (1U << 20U) + 4097};
+
+    for (auto k : keys)
+        sset.add(k);
+
+    REQUIRE( sset.size() == keys.size() );
+    REQUIRE( sset.search(2) >= sset.size() );
+    REQUIRE( sset.search(1U << 19U) >= sset.size() );
+    REQUIRE( sset.search(UINT_MAX) >= sset.size() );
+
+    for (auto k : keys) {
+        REQUIRE( sset.search(k) < sset.size() );
+        REQUIRE( sset.data()[sset.search(k)] == k );
+    }
+
+    sset.clear();
+    REQUIRE( sset.size() == 0 );
+
+    sset.add(4096);
+    for (auto k : keys) {
+        if (k != 4096)
+            REQUIRE( sset.search(k) >= sset.size() );
+    }
+    REQUIRE( sset.search(4096) == 0 );
+}
+
+TEST_CASE( "sparse_set dense capacity follows element count, not keys", "[sparse_set]")
+{
+    psset::sparse_set<unsigned int, UIntHash> sset;
+
+    sset.add(UINT_MAX - 1);
+    sset.add(1U << 28U);
+    sset.add(3);
+
+    REQUIRE( sset.size() == 3 );
+    REQUIRE( sset.capacity() < 8 );
+    REQUIRE( sset.key_capacity() == UINT_MAX );
+    REQUIRE( sset.search(UINT_MAX - 1) < sset.size() );
+    REQUIRE( sset.search(1U << 28U) < sset.size() );
+
+    sset.reserve_elements(1000);
+    REQUIRE( sset.capacity() == 1000 );
+    REQUIRE( sset.search(3) < sset.size() );
+
+    psset::sparse_set<unsigned int, UIntHash> reserved;
+    reserved.reserve_keys(10000);
+    REQUIRE( reserved.key_capacity() >= 10000 );
+    REQUIRE( reserved.capacity() == 0 );
+}
+
+TEST_CASE( "sparse_set with uninitialized sparse index", "[sparse_set]")
+{
+    psset::sparse_set<Entity, Entity::Hash, psset::uninitialized_sparse> sset(1U << 20U);
+
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 10000; i += 3) {
+            sset.add(Entity(static_cast<EntityIndex>(i * 7), 0));
+        }
+
+        for (int i = 0; i < 10000; i += 3) {
+            REQUIRE( sset.search(Entity(static_cast<EntityIndex>(i * 7), 0)) < sset.size() );
+            REQUIRE( sset.search(Entity(static_cast<EntityIndex>(i * 7 + 1), 0)) >= sset.size() );
+        }
+
+        for (int i = 0; i < 10000; i += 6) {
+            Entity e(static_cast<EntityIndex>(i * 7), 0);
+            sset.remove(e);
+            REQUIRE( sset.search(e) >= sset.size() );
+        }
+
+        for (auto const& e : sset) {
+            REQUIRE( sset.data()[sset.search(e)] == e );
+        }
+
+        sset.clear();
+        REQUIRE( sset.size() == 0 );
+        REQUIRE( sset.search(Entity(21, 0)) >= sset.size() );
+    }
+}
+
+TEST_CASE( "sparse_set with narrow index types", "[sparse_set]")
+{
+    psset::sparse_set<unsigned int, UIntHash, psset::initialized_sparse, uint16_t> sset16;
+
+    for (unsigned int i = 0; i < 60000; ++i)
+        sset16.add(i * 64);
+
+    REQUIRE( sset16.size() == 60000 );
+    REQUIRE( sset16.search(59999 * 64) == 59999 );
+    REQUIRE( sset16.search(1) == sset16.npos );
+
+    psset::sparse_set<unsigned int, UIntHash, psset::uninitialized_sparse, uint8_t> sset8;
+
+    for (unsigned int i = 0; i < 255; ++i)
+        sset8.add(i * 1000);
+
+    REQUIRE( sset8.size() == 255 );
+    REQUIRE_THROWS_AS( sset8.add(1), std::length_error );
+
+    sset8.remove(0);
+    REQUIRE( sset8.search(0) == sset8.npos );
+    REQUIRE( sset8.search(254000) < sset8.size() );
+
+    psset::sparse_map<unsigned int, int, UIntHash, psset::initialized_sparse, uint64_t> smap64;
+    smap64.add(UINT_MAX - 1, 7);
+    REQUIRE( smap64.search(UINT_MAX - 1) == 0 );
+    REQUIRE( smap64.at(UINT_MAX - 1) == 7 );
+}
+
 TEST_CASE( "sparse_map creation and deletion of 1M entities", "[sparse_map]")
 {
     psset::sparse_map<Entity, int, Entity::Hash> smap;
@@ -152,6 +291,1334 @@ TEST_CASE( "sparse_map mixed creation and deletion of 10k entities", "[sparse_ma
     }
 }
 
+TEST_CASE( "sparse_map keeps keys and values in separate columns", "[sparse_map]")
+{
+    psset::sparse_map<unsigned int, double, UIntHash> smap;
+
+    for (unsigned int i = 0; i < 100; ++i)
+        smap.add(i * 3, i * 0.5);
+
+    smap.remove(0);
+    smap.remove(30);
+
+    REQUIRE( smap.keys().size() == 98 );
+    REQUIRE( smap.values().size() == 98 );
+
+    for (std::size_t i = 0; i < smap.keys().size(); ++i) {
+        REQUIRE( smap.values()[i] == smap.keys()[i] / 3 * 0.5 );
+        REQUIRE( smap.search(smap.keys()[i]) == i );
+    }
+
+    for (auto& v : smap.values())
+        v = 1.0;
+
+    unsigned int count = 0;
+    for (auto kv : smap) {
+        REQUIRE( kv.value == 1.0 );
+        REQUIRE( smap.at(kv.key) == 1.0 );
+        kv.value = 2.0;
+        count++;
+    }
+
+    REQUIRE( count == smap.size() );
+    REQUIRE( smap.at(3) == 2.0 );
+}
+
+struct CountedValue
+{
+    static int default_constructions;
+
+    CountedValue() : payload(0) { default_constructions++; }
+    explicit CountedValue(int p) : payload(p) {}
+
+    int payload;
+};
+
+int CountedValue::default_constructions = 0;
+
+struct EntityOrIndexHash
+{
+    unsigned int operator()(Entity const& e) const
+    {
+        return e.index();
+    }
+
+    unsigned int operator()(EntityIndex const& i) const
+    {
+        return i;
+    }
+};
+
+TEST_CASE( "sparse_map key-only lookup never constructs values", "[sparse_map]")
+{
+    psset::sparse_map<Entity, CountedValue, EntityOrIndexHash> smap;
+    smap.reserve_elements(64);
+
+    for (int i = 0; i < 64; ++i)
+        smap.add(Entity(static_cast<EntityIndex>(i), 1), CountedValue(i));
+
+    int constructed = CountedValue::default_constructions;
+
+    for (int i = 0; i < 64; ++i) {
+        Entity e(static_cast<EntityIndex>(i), 1);
+        REQUIRE( smap.contains(e) );
+        REQUIRE( smap.at(e).payload == i );
+        REQUIRE( smap.at(static_cast<EntityIndex>(i)).payload == i );
+    }
+
+    smap.remove(static_cast<EntityIndex>(10));
+    smap.remove(Entity(11, 1));
+
+    REQUIRE( !smap.contains(static_cast<EntityIndex>(10)) );
+    REQUIRE( !smap.contains(Entity(11, 1)) );
+    REQUIRE_THROWS_AS( smap.at(static_cast<EntityIndex>(10)), std::out_of_range );
+    REQUIRE( CountedValue::default_constructions == constructed );
+
+    psset::sparse_set<Entity, EntityOrIndexHash> sset;
+    sset.add(Entity(5, 3));
+    REQUIRE( sset.contains(static_cast<EntityIndex>(5)) );
+    sset.remove(static_cast<EntityIndex>(5));
+    REQUIRE( sset.size() == 0 );
+}
+
+TEST_CASE( "sparse_set and sparse_map relocate elements by moving", "[sparse_set][sparse_map]")
+{
+    psset::sparse_map<unsigned int, std::unique_ptr<int>, UIntHash> smap;
+
+    for (int i = 0; i < 1000; ++i)
+        smap.add(static_cast<unsigned int>(i), std::unique_ptr<int>(new int(i)));
+
+    smap.emplace(5, nullptr); // already present, ignored
+    smap.emplace(1000, new int(1000));
+
+    for (unsigned int i = 0; i < 1000; i += 2)
+        smap.remove(i);
+
+    REQUIRE( smap.size() == 501 );
+
+    for (auto kv : smap)
+        REQUIRE( *kv.value == static_cast<int>(kv.key) );
+
+    psset::sparse_set<std::string, StringLengthHash> sset;
+    std::string word = "moved into the set";
+    sset.add(std::move(word));
+    sset.emplace(3, 'x');
+    sset.emplace("abc"); // same length as "xxx", ignored
+    sset.add(std::string(5, 'y'));
+
+    REQUIRE( sset.size() == 3 );
+    REQUIRE( sset.data()[sset.search(std::string(3, ' '))] == "xxx" );
+
+    sset.remove(std::string(3, ' '));
+    REQUIRE( sset.data()[0] == "moved into the set" );
+    REQUIRE( sset.data()[1] == "yyyyy" );
+}
+
+struct Tracked
+{
+    static int alive;
+
+    explicit Tracked(unsigned int k) : key(k), buffer(16, 'x') { alive++; }
+    Tracked(const Tracked& other) : key(other.key), buffer(other.buffer) { alive++; }
+    Tracked(Tracked&& other) : key(other.key), buffer(std::move(other.buffer)) { alive++; }
+    Tracked& operator=(const Tracked&) = default;
+    Tracked& operator=(Tracked&&) = default;
+    ~Tracked() { alive--; }
+
+    unsigned int key;
+    std::string buffer;
+
+    struct Hash
+    {
+        unsigned int operator()(Tracked const& t) const
+        {
+            return t.key;
+        }
+
+        unsigned int operator()(unsigned int k) const
+        {
+            return k;
+        }
+    };
+};
+
+int Tracked::alive = 0;
+
+TEST_CASE( "sparse_set and sparse_map construct and destroy only live elements", "[sparse_set][sparse_map]")
+{
+    {
+        psset::sparse_set<Tracked, Tracked::Hash> sset(1024);
+        REQUIRE( Tracked::alive == 0 );
+
+        for (unsigned int i = 0; i < 100; ++i)
+            sset.emplace(i);
+        sset.emplace(7U); // duplicate, destroyed again right away
+
+        REQUIRE( Tracked::alive == 100 );
+
+        sset.remove(3U);
+        sset.remove(99U);
+        REQUIRE( Tracked::alive == 98 );
+
+        sset.clear();
+        REQUIRE( Tracked::alive == 0 );
+
+        for (unsigned int i = 0; i < 10; ++i)
+            sset.emplace(i);
+    }
+    REQUIRE( Tracked::alive == 0 );
+
+    {
+        psset::sparse_map<unsigned int, Tracked, UIntHash> smap;
+
+        for (unsigned int i = 0; i < 100; ++i)
+            smap.emplace(i, i);
+
+        REQUIRE( Tracked::alive == 100 );
+
+        for (unsigned int i = 0; i < 100; i += 2)
+            smap.remove(i);
+
+        REQUIRE( Tracked::alive == 50 );
+        REQUIRE( smap.at(51).key == 51 );
+        REQUIRE( smap.at(51).buffer == std::string(16, 'x') );
+
+        smap.clear();
+        REQUIRE( Tracked::alive == 0 );
+
+        smap.emplace(1, 1);
+    }
+    REQUIRE( Tracked::alive == 0 );
+}
+
+template <typename Map>
+Map make_filled_map(unsigned int n)
+{
+    Map smap;
+    for (unsigned int i = 0; i < n; ++i)
+        smap.add(i * 10, std::to_string(i));
+    return smap;
+}
+
+TEST_CASE( "sparse_map move, swap and clone", "[sparse_map]")
+{
+    using Map = psset::sparse_map<unsigned int, std::string, UIntHash>;
+
+    Map a = make_filled_map<Map>(100);
+    REQUIRE( a.size() == 100 );
+
+    Map b(std::move(a));
+    REQUIRE( a.size() == 0 );
+    REQUIRE( !a.contains(10U) );
+    REQUIRE( b.at(990U) == "99" );
+
+    a.add(5, "five");
+    swap(a, b);
+    REQUIRE( a.size() == 100 );
+    REQUIRE( b.size() == 1 );
+    REQUIRE( b.at(5U) == "five" );
+
+    a.reserve_elements(4096);
+    Map c = a.clone();
+    REQUIRE( c.size() == a.size() );
+    REQUIRE( c.capacity() == a.size() );
+
+    for (auto kv : a)
+        REQUIRE( c.at(kv.key) == kv.value );
+
+    c.remove(0U);
+    c.at(10U) = "changed";
+    REQUIRE( a.at(0U) == "0" );
+    REQUIRE( a.at(10U) == "1" );
+
+    b = std::move(c);
+    REQUIRE( b.size() == 99 );
+    REQUIRE( b.at(10U) == "changed" );
+
+    psset::sparse_set<unsigned int, UIntHash, psset::uninitialized_sparse> s1;
+    s1.add(1U << 30U);
+    s1.add(4);
+    auto s2 = s1.clone();
+    s1.remove(4U);
+    REQUIRE( s2.contains(4U) );
+    REQUIRE( s2.contains(1U << 30U) );
+    REQUIRE( !s1.contains(4U) );
+}
+
+struct CopyLimited
+{
+    static int copies_left;
+
+    std::string text;
+
+    explicit CopyLimited(std::string t) : text(std::move(t)) {}
+    CopyLimited(const CopyLimited& other) : text(other.text)
+    {
+        if (copies_left-- == 0)
+            throw std::runtime_error("copy failed");
+    }
+    CopyLimited(CopyLimited&&) = default;
+    CopyLimited& operator=(const CopyLimited&) = default;
+    CopyLimited& operator=(CopyLimited&&) = default;
+};
+
+int CopyLimited::copies_left = -1;
+
+TEST_CASE( "sparse_map clone leaves nothing behind when a value copy throws", "[sparse_map]")
+{
+    psset::sparse_map<unsigned int, CopyLimited, UIntHash> smap;
+    for (unsigned int i = 0; i < 50; ++i)
+        smap.emplace(i, std::string(40, static_cast<char>('a' + i % 26)));
+
+    CopyLimited::copies_left = 20;
+    REQUIRE_THROWS_AS( smap.clone(), std::runtime_error );
+
+    CopyLimited::copies_left = -1;
+    auto copy = smap.clone();
+    REQUIRE( copy.size() == 50 );
+    REQUIRE( copy.at(27U).text == std::string(40, 'b') );
+}
+
+TEST_CASE( "sparse_map upserts with a single lookup", "[sparse_map]")
+{
+    psset::sparse_map<unsigned int, std::string, UIntHash> smap;
+
+    REQUIRE( smap.find(7U) == nullptr );
+
+    auto r = smap.try_emplace(7, "seven");
+    REQUIRE( r.second );
+    REQUIRE( r.first == "seven" );
+
+    std::string replacement = "SEVEN";
+    auto kept = smap.try_emplace(7, std::move(replacement));
+    REQUIRE( !kept.second );
+    REQUIRE( kept.first == "seven" );
+    REQUIRE( replacement == "SEVEN" );
+
+    auto assigned = smap.insert_or_assign(7, std::string("7"));
+    REQUIRE( !assigned.second );
+    REQUIRE( smap.at(7U) == "7" );
+
+    auto inserted = smap.insert_or_assign(1U << 20U, std::string("far"));
+    REQUIRE( inserted.second );
+    REQUIRE( *smap.find(1U << 20U) == "far" );
+
+    REQUIRE( smap.get_or_insert(3, 2, 'x') == "xx" );
+    REQUIRE( smap.get_or_insert(3, 5, 'y') == "xx" );
+
+    REQUIRE( smap[9].empty() );
+    smap[9] += "nine";
+    REQUIRE( smap.at(9U) == "nine" );
+    REQUIRE( smap.size() == 4 );
+
+    const auto& csmap = smap;
+    REQUIRE( *csmap.find(9U) == "nine" );
+    smap.remove(9U);
+    REQUIRE( csmap.find(9U) == nullptr );
+
+    psset::sparse_map<unsigned int, int, UIntHash, psset::uninitialized_sparse> counts;
+    for (unsigned int i = 0; i < 1000; ++i)
+        counts[i % 10]++;
+
+    REQUIRE( counts.size() == 10 );
+    for (auto kv : counts)
+        REQUIRE( kv.value == 100 );
+}
+
+TEST_CASE( "sparse_set and sparse_map bulk insertion and removal", "[sparse_set][sparse_map]")
+{
+    std::vector<unsigned int> keys;
+    for (unsigned int i = 0; i < 10000; ++i)
+        keys.push_back(i * 3);
+    keys.push_back(0); // duplicates are skipped
+
+    psset::sparse_set<unsigned int, UIntHash> sset;
+    sset.add(3);
+    sset.add_range(keys.begin(), keys.end());
+
+    REQUIRE( sset.size() == 10000 );
+    REQUIRE( sset.capacity() >= 10000 );
+    REQUIRE( sset.key_capacity() > 9999 * 3 );
+    REQUIRE( sset.contains(29997U) );
+
+    sset.remove_range(keys.begin(), keys.begin() + 5000);
+    REQUIRE( sset.size() == 5000 );
+    REQUIRE( !sset.contains(3U) );
+    REQUIRE( sset.contains(15000U) );
+
+    std::istringstream stream("7 8 7 4294967295");
+    psset::sparse_set<unsigned int, UIntHash, psset::uninitialized_sparse> input;
+    input.add_range(std::istream_iterator<unsigned int>(stream), std::istream_iterator<unsigned int>());
+    REQUIRE( input.size() == 3 );
+    REQUIRE( input.contains(4294967295U) );
+
+    std::vector<std::string> values;
+    for (unsigned int i = 0; i < keys.size(); ++i)
+        values.push_back(std::to_string(i));
+
+    psset::sparse_map<unsigned int, std::string, UIntHash> smap;
+    smap.add(0, "kept");
+    smap.add_range(keys.begin(), keys.end(), values.begin());
+
+    REQUIRE( smap.size() == 10000 );
+    REQUIRE( smap.at(0U) == "kept" );
+    REQUIRE( smap.at(30U) == "10" );
+    REQUIRE( values[10] == "10" );
+
+    std::vector<std::unique_ptr<int>> owned;
+    owned.push_back(std::unique_ptr<int>(new int(1)));
+    owned.push_back(std::unique_ptr<int>(new int(2)));
+
+    psset::sparse_map<unsigned int, std::unique_ptr<int>, UIntHash> moved;
+    moved.add_range(keys.begin(), keys.begin() + 2, std::make_move_iterator(owned.begin()));
+    REQUIRE( *moved.at(3U) == 2 );
+    REQUIRE( owned[0] == nullptr );
+
+    smap.remove_range(keys.begin(), keys.end());
+    REQUIRE( smap.size() == 0 );
+
+    psset::sparse_set<unsigned int, UIntHash> grown;
+    psset::sparse_map<unsigned int, int, UIntHash> grown_map;
+    int set_growths = 0;
+    int map_growths = 0;
+    for (unsigned int i = 0; i < 4096; ++i) { // one element at a time must not reallocate every time
+        unsigned int set_cap = grown.capacity();
+        unsigned int map_cap = grown_map.capacity();
+        int value = static_cast<int>(i);
+        grown.add_range(&i, &i + 1);
+        grown_map.add_range(&i, &i + 1, &value);
+        set_growths += grown.capacity() != set_cap;
+        map_growths += grown_map.capacity() != map_cap;
+    }
+    REQUIRE( grown.size() == 4096 );
+    REQUIRE( grown_map.at(4095U) == 4095 );
+    REQUIRE( set_growths <= 13 );
+    REQUIRE( map_growths <= 13 );
+}
+
+TEST_CASE( "sparse_set and sparse_map batched lookups", "[sparse_set][sparse_map]")
+{
+    psset::sparse_set<unsigned int, UIntHash, psset::uninitialized_sparse> sset;
+    psset::sparse_map<unsigned int, int, UIntHash> smap;
+
+    for (unsigned int i = 0; i < 1000; i += 2) {
+        sset.add(i);
+        smap.add(i, static_cast<int>(i) * 10);
+    }
+
+    std::vector<unsigned int> keys;
+    for (unsigned int i = 0; i < 1000; i += 7)
+        keys.push_back(i);
+    keys.push_back(1U << 31U);
+
+    std::vector<psset::sparse_set<unsigned int, UIntHash>::index_type> idx(keys.size());
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    std::vector<int*> values(keys.size());
+
+    sset.search_many(keys.data(), keys.size(), idx.data());
+    sset.contains_many(keys.data(), keys.size(), found.get());
+    smap.find_many(keys.data(), keys.size(), values.data());
+
+    for (std::size_t j = 0; j < keys.size(); ++j) {
+        REQUIRE( idx[j] == sset.search(keys[j]) );
+        REQUIRE( found[j] == sset.contains(keys[j]) );
+        REQUIRE( values[j] == smap.find(keys[j]) );
+    }
+
+    const auto& csmap = smap;
+    std::vector<const int*> cvalues(keys.size());
+    csmap.find_many(keys.data(), keys.size(), cvalues.data());
+    REQUIRE( *cvalues[2] == 140 );
+    REQUIRE( cvalues.back() == nullptr );
+}
+
+template <typename Policy>
+void check_identity_contains_many()
+{
+    psset::sparse_set<unsigned int, psset::identity_hash, Policy> sset;
+
+    for (unsigned int i = 0; i < 20000; i += 3)
+        sset.add(i);
+    sset.add(0xFFFFFFFEU);
+    sset.remove(9U);
+
+    std::vector<unsigned int> keys;
+    for (unsigned int i = 0; i < 20000; i += 5)
+        keys.push_back(i);
+    keys.push_back(1U << 30U);
+    keys.push_back(0xFFFFFFFEU);
+    keys.push_back(0xFFFFFFFFU);
+
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    sset.contains_many(keys.data(), keys.size(), found.get());
+
+    for (std::size_t j = 0; j < keys.size(); ++j)
+        REQUIRE( found[j] == sset.contains(keys[j]) );
+}
+
+TEST_CASE( "sparse_set batched membership with the identity hash", "[sparse_set]")
+{
+    check_identity_contains_many<psset::initialized_sparse>();
+    check_identity_contains_many<psset::uninitialized_sparse>();
+}
+
+TEST_CASE( "sparse_set and sparse_map set algebra", "[sparse_set][sparse_map]")
+{
+    using Set = psset::sparse_set<unsigned int, UIntHash>;
+    using Map = psset::sparse_map<unsigned int, std::string, UIntHash>;
+
+    Set a, b;
+    psset::sparse_set<unsigned int, UIntHash, psset::uninitialized_sparse, uint16_t> c;
+    for (unsigned int i = 0; i < 100; ++i) {
+        a.add(i);
+        if (i % 2 == 0)
+            b.add(i);
+        if (i % 3 == 0)
+            c.add(i);
+    }
+
+    Set ab = psset::intersect(a, b);
+    Set ba = psset::intersect(b, a);
+    REQUIRE( ab.size() == 50 );
+    REQUIRE( ba.size() == 50 );
+
+    Set abc = psset::subtract(ab, c); // in a and b but not c
+    REQUIRE( abc.size() == 33 );
+    for (auto x : abc)
+        REQUIRE( (x % 2 == 0 && x % 3 != 0) );
+
+    Set bc = psset::unite(b, c);
+    REQUIRE( bc.size() == 67 );
+    REQUIRE( b.size() == 50 );
+
+    a.intersect(b);
+    a.subtract(c);
+    REQUIRE( a.size() == abc.size() );
+    for (auto x : abc)
+        REQUIRE( a.contains(x) );
+
+    c.unite(b);
+    REQUIRE( c.size() == 67 );
+    c.subtract(b);
+    REQUIRE( c.size() == 17 );
+
+    Map m;
+    Map extra;
+    for (unsigned int i = 0; i < 10; ++i) {
+        m.add(i, std::to_string(i));
+        extra.add(i + 5, "extra");
+    }
+
+    Map mb = psset::intersect(m, b);
+    REQUIRE( mb.size() == 5 );
+    REQUIRE( mb.at(4U) == "4" );
+    REQUIRE( psset::subtract(m, b).size() == 5 );
+    REQUIRE( psset::subtract(b, m).size() == 45 );
+
+    Map me = psset::unite(m, extra);
+    REQUIRE( me.size() == 15 );
+    REQUIRE( me.at(7U) == "7" );
+    REQUIRE( me.at(14U) == "extra" );
+
+    m.intersect(extra);
+    REQUIRE( m.size() == 5 );
+    REQUIRE( m.at(9U) == "9" );
+    m.subtract(b);
+    REQUIRE( m.size() == 3 );
+    REQUIRE( !m.contains(6U) );
+    REQUIRE( m.at(5U) == "5" );
+
+    Set full;
+    for (unsigned int i = 0; i < 8; ++i)
+        full.add(i);
+    full.unite(full);
+    REQUIRE( full.size() == 8 );
+    m.unite(m);
+    REQUIRE( m.size() == 3 );
+    REQUIRE( m.at(5U) == "5" );
+    m.subtract(m);
+    REQUIRE( m.size() == 0 );
+}
+
+TEST_CASE( "sparse_view joins maps sharing a key space", "[sparse_view]")
+{
+    psset::sparse_map<unsigned int, int, UIntHash> positions;
+    psset::sparse_map<unsigned int, std::string, UIntHash> names;
+    psset::sparse_map<unsigned int, double, UIntHash, psset::uninitialized_sparse> speeds;
+    psset::sparse_set<unsigned int, UIntHash> frozen;
+
+    for (unsigned int i = 0; i < 1000; ++i)
+        positions.add(i, static_cast<int>(i));
+    for (unsigned int i = 0; i < 1000; i += 2)
+        speeds.add(i, 0.5);
+    for (unsigned int i = 0; i < 1000; i += 10)
+        names.add(i, std::to_string(i));
+    frozen.add(20);
+    frozen.add(21);
+
+    auto moving = psset::make_view(positions, speeds, names);
+    REQUIRE( moving.size_hint() == names.size() );
+
+    unsigned int visited = 0;
+    moving.each([&](unsigned int key, int& pos, double& speed, std::string& name) {
+        REQUIRE( name == std::to_string(key) );
+        pos += static_cast<int>(speed * 2);
+        ++visited;
+    });
+    REQUIRE( visited == 100 );
+    REQUIRE( positions.at(10U) == 11 );
+    REQUIRE( positions.at(11U) == 11 );
+
+    const auto& cnames = names;
+    auto filtered = psset::make_view(speeds, cnames).exclude(frozen);
+    visited = 0;
+    for (auto entry : filtered) {
+        REQUIRE( std::get<0>(entry) % 10 == 0 );
+        REQUIRE( std::get<0>(entry) != 20 );
+        REQUIRE( std::get<2>(entry) == std::to_string(std::get<0>(entry)) );
+        std::get<1>(entry) = 2.0;
+        ++visited;
+    }
+    REQUIRE( visited == 99 );
+    REQUIRE( speeds.at(30U) == 2.0 );
+    REQUIRE( speeds.at(20U) == 0.5 );
+
+    auto none = psset::make_view(positions).exclude(speeds, names);
+    visited = 0;
+    none.each([&](unsigned int key, int&) {
+        REQUIRE( key % 2 == 1 );
+        ++visited;
+    });
+    REQUIRE( visited == 500 );
+}
+
+TEST_CASE( "sparse_group keeps shared keys packed at the front", "[sparse_group]")
+{
+    psset::sparse_map<unsigned int, int, UIntHash> positions;
+    psset::sparse_map<unsigned int, std::string, UIntHash, psset::uninitialized_sparse> names;
+
+    for (unsigned int i = 0; i < 100; ++i)
+        positions.add(i, static_cast<int>(i));
+    for (unsigned int i = 0; i < 100; i += 3)
+        names.add(i, std::to_string(i));
+
+    auto grouped = psset::make_group(positions, names);
+    REQUIRE( grouped.size() == 34 );
+
+    auto check_packed = [&]() {
+        for (std::size_t i = 0; i < grouped.size(); ++i) {
+            REQUIRE( positions.keys()[i] == names.keys()[i] );
+            REQUIRE( names.values()[i] == std::to_string(positions.values()[i]) );
+        }
+        for (std::size_t i = grouped.size(); i < names.size(); ++i)
+            REQUIRE( !positions.contains(names.keys()[i]) );
+        for (std::size_t i = grouped.size(); i < positions.size(); ++i)
+            REQUIRE( !names.contains(positions.keys()[i]) );
+    };
+    check_packed();
+
+    grouped.add<1>(1, "1");
+    grouped.add<1>(500, "500");
+    grouped.add<0>(500, 500);
+    grouped.add<0>(0, -1); // already there, no change
+    REQUIRE( grouped.size() == 36 );
+    REQUIRE( grouped.contains(500U) );
+    REQUIRE( !grouped.contains(2U) );
+    check_packed();
+
+    grouped.remove<0>(3);
+    grouped.remove<1>(500);
+    grouped.remove<1>(2); // not in the group
+    REQUIRE( grouped.size() == 34 );
+    REQUIRE( names.contains(3U) );
+    REQUIRE( positions.contains(500U) );
+    REQUIRE( !grouped.contains(3U) );
+    check_packed();
+
+    int sum = 0;
+    grouped.each([&](unsigned int key, int& pos, std::string& name) {
+        REQUIRE( name == std::to_string(key) );
+        sum += pos;
+    });
+
+    int expected = 0;
+    for (auto pos : grouped.values<0>())
+        expected += pos;
+    REQUIRE( sum == expected );
+    REQUIRE( grouped.keys().size() == 34 );
+}
+
+TEST_CASE( "sparse_set and sparse_map sort their dense storage", "[sparse_set][sparse_map]")
+{
+    psset::sparse_set<unsigned int, UIntHash, psset::uninitialized_sparse> sset;
+    psset::sparse_map<unsigned int, std::string, UIntHash> smap;
+
+    unsigned int x = 12345;
+    for (int i = 0; i < 5000; ++i) {
+        x = x * 1103515245U + 12345U;
+        sset.add(x >> 4U);
+        smap.add(x >> 8U, std::to_string(x >> 8U));
+    }
+    sset.remove(sset.data()[17]);
+
+    sset.sort_by_key();
+    for (std::size_t i = 1; i < sset.size(); ++i)
+        REQUIRE( sset.data()[i - 1] < sset.data()[i] );
+    for (std::size_t i = 0; i < sset.size(); ++i)
+        REQUIRE( sset.search(sset.data()[i]) == i );
+
+    sset.sort([](unsigned int a, unsigned int b) { return a > b; });
+    for (std::size_t i = 1; i < sset.size(); ++i)
+        REQUIRE( sset.data()[i - 1] > sset.data()[i] );
+    for (std::size_t i = 0; i < sset.size(); ++i)
+        REQUIRE( sset.search(sset.data()[i]) == i );
+
+    smap.sort_by_key();
+    for (std::size_t i = 1; i < smap.size(); ++i)
+        REQUIRE( smap.keys()[i - 1] < smap.keys()[i] );
+    for (auto kv : smap)
+        REQUIRE( smap.at(kv.key) == std::to_string(kv.key) );
+
+    smap.sort([](unsigned int a, unsigned int b) { return a % 1000 < b % 1000; });
+    for (std::size_t i = 1; i < smap.size(); ++i)
+        REQUIRE( smap.keys()[i - 1] % 1000 <= smap.keys()[i] % 1000 );
+    for (auto kv : smap)
+        REQUIRE( kv.value == std::to_string(kv.key) );
+
+    psset::sparse_map<unsigned int, int, UIntHash> other;
+    for (unsigned int i = 0; i < 100; ++i)
+        other.add(99 - i, static_cast<int>(i));
+    psset::sparse_set<unsigned int, UIntHash> order;
+    for (unsigned int i = 0; i < 200; i += 2)
+        order.add(i);
+
+    other.sort_as(order);
+    for (unsigned int i = 0; i < 50; ++i) {
+        REQUIRE( other.keys()[i] == order.data()[i] );
+        REQUIRE( other.values()[i] == static_cast<int>(99 - order.data()[i]) );
+    }
+    for (unsigned int i = 0; i < other.size(); ++i)
+        REQUIRE( other.search(other.keys()[i]) == i );
+}
+
+TEST_CASE( "parallel_for_each over sets, maps and views", "[parallel]")
+{
+    psset::thread_pool pool(3);
+
+    psset::sparse_set<unsigned int, UIntHash> sset;
+    psset::sparse_map<unsigned int, int, UIntHash> positions;
+    psset::sparse_map<unsigned int, int, UIntHash, psset::uninitialized_sparse> speeds;
+    psset::sparse_set<unsigned int, UIntHash> frozen;
+
+    for (unsigned int i = 0; i < 100000; ++i) {
+        sset.add(i);
+        positions.add(i, 0);
+        if (i % 2 == 0)
+            speeds.add(i, 3);
+        if (i % 4 == 0)
+            frozen.add(i);
+    }
+
+    REQUIRE( reinterpret_cast<std::uintptr_t>(sset.data()) % 64 == 0 );
+    REQUIRE( reinterpret_cast<std::uintptr_t>(positions.values().data()) % 64 == 0 );
+
+    std::atomic<unsigned long long> sum(0);
+    psset::parallel_for_each(sset, [&](unsigned int x) { sum += x; }, pool);
+    REQUIRE( sum == 100000ULL * 99999ULL / 2 );
+
+    psset::parallel_for_each(positions, [](unsigned int key, int& pos) { pos = static_cast<int>(key); }, pool);
+    for (auto kv : positions)
+        REQUIRE( kv.value == static_cast<int>(kv.key) );
+
+    auto moving = psset::make_view(positions, speeds).exclude(frozen);
+    std::atomic<unsigned int> visited(0);
+    psset::parallel_for_each(moving, [&](unsigned int, int& pos, int& speed) {
+        pos += speed;
+        ++visited;
+    }, pool);
+    REQUIRE( visited == 25000 );
+    REQUIRE( positions.at(2U) == 5 );
+    REQUIRE( positions.at(4U) == 4 );
+    REQUIRE( positions.at(3U) == 3 );
+
+    REQUIRE_THROWS_AS( psset::parallel_for_each(sset, [](unsigned int x) {
+        if (x == 77777)
+            throw std::runtime_error("failed");
+    }, pool), std::runtime_error );
+
+    std::atomic<unsigned int> nested(0);
+    pool.parallel_for(64, 1, [&](std::size_t first, std::size_t last) {
+        pool.parallel_for(last - first, 1, [&](std::size_t a, std::size_t b) { nested += static_cast<unsigned int>(b - a); });
+    });
+    REQUIRE( nested == 64 );
+
+    psset::thread_pool serial(0);
+    sum = 0;
+    psset::parallel_for_each(sset, [&](unsigned int x) { sum += x; }, serial);
+    REQUIRE( sum == 100000ULL * 99999ULL / 2 );
+}
+
+TEST_CASE( "sparse_set and sparse_map iterators work with standard algorithms", "[sparse_set][sparse_map]")
+{
+    psset::sparse_set<unsigned int, UIntHash> sset;
+    psset::sparse_map<unsigned int, int, UIntHash> smap;
+
+    for (unsigned int i = 0; i < 100; ++i) {
+        sset.add(99 - i);
+        smap.add(99 - i, static_cast<int>(i));
+    }
+
+    const auto& csset = sset;
+    static_assert(std::is_same<decltype(csset.begin()), const unsigned int*>::value, "const begin() yields const elements");
+    static_assert(std::is_same<std::iterator_traits<decltype(smap.begin())>::iterator_category, std::random_access_iterator_tag>::value,
+                  "map iterators are random access");
+
+    REQUIRE( std::accumulate(csset.cbegin(), csset.cend(), 0U) == 4950U );
+    REQUIRE( *sset.rbegin() == 0U );
+    REQUIRE( std::equal(sset.rbegin(), sset.rend(), smap.keys().rbegin()) );
+
+    smap.sort_by_key();
+    auto it = std::lower_bound(smap.begin(), smap.end(), 42U, [](psset::KeyValue<const unsigned int&, int&> kv, unsigned int k) {
+        return kv.key < k;
+    });
+    REQUIRE( it - smap.begin() == 42 );
+    REQUIRE( it.key() == 42U );
+    REQUIRE( it[1].value == 56 );
+    REQUIRE( (it + 2 > it && it - 2 < it) );
+
+    psset::sparse_map<unsigned int, int, UIntHash> empty;
+    psset::sparse_map<unsigned int, int, UIntHash>::const_iterator empty_end = empty.end();
+    REQUIRE( empty_end == empty.cend() );
+    psset::sparse_map<unsigned int, int, UIntHash>::const_iterator from_default = psset::sparse_map<unsigned int, int, UIntHash>::iterator();
+    REQUIRE( from_default == psset::sparse_map<unsigned int, int, UIntHash>::const_iterator() );
+    REQUIRE( psset::sparse_map<unsigned int, int, UIntHash>::const_iterator(smap.end()) == smap.cend() );
+
+    psset::sparse_map<unsigned int, int, UIntHash>::const_iterator cit = it;
+    REQUIRE( cit.value() == 57 );
+    REQUIRE( std::distance(cit, smap.cend()) == 58 );
+
+    static_assert(std::is_same<decltype(smap.begin())::value_type, psset::KeyValue<unsigned int, int>>::value,
+                  "map iterators name an owning value_type");
+    static_assert(std::is_same<decltype(smap.cbegin())::value_type, psset::KeyValue<unsigned int, int>>::value,
+                  "const map iterators name an owning value_type");
+    REQUIRE( it->key == 42U );
+    it->value += 1;
+    REQUIRE( cit->value == 58 );
+    decltype(smap.begin())::value_type copied = *it;
+    it->value = 0;
+    REQUIRE( copied.key == 42U );
+    REQUIRE( copied.value == 58 );
+    it->value = 57;
+
+    std::for_each(smap.values().begin(), smap.values().end(), [](int& v) { v *= 2; });
+    REQUIRE( smap.at(42U) == 114 );
+
+    unsigned int expected = 0;
+    for (auto rit = smap.rbegin(); rit != smap.rend(); ++rit)
+        REQUIRE( (*rit).key == 99 - expected++ );
+    REQUIRE( expected == 100 );
+}
+
+TEST_CASE( "concurrent_sparse_map readers run alongside one writer", "[concurrent]")
+{
+    psset::concurrent_sparse_map<unsigned int, unsigned long long, UIntHash> cmap;
+    const unsigned int n = 20000;
+
+    std::atomic<bool> done(false);
+    std::atomic<unsigned int> torn(0);
+    std::vector<std::thread> readers;
+
+    for (int t = 0; t < 3; ++t) {
+        readers.emplace_back([&] {
+            while (!done) {
+                for (unsigned int k = 0; k < n; k += 7) {
+                    unsigned long long v;
+                    if (cmap.try_get(k, v) && v != k && v != k * 3ULL)
+                        ++torn;
+                }
+
+                auto r = cmap.read();
+                r.for_each([&](unsigned int k, unsigned long long v) {
+                    if (v != k && v != k * 3ULL)
+                        ++torn;
+                });
+            }
+        });
+    }
+
+    for (unsigned int k = 0; k < n; ++k)
+        cmap.add(k, k);
+    for (unsigned int k = 0; k < n; k += 2)
+        cmap.insert_or_assign(k, k * 3ULL);
+    for (unsigned int k = 0; k < n; k += 5)
+        cmap.remove(k);
+    for (unsigned int k = n; k < 2 * n; ++k)
+        cmap.add(k, k);
+
+    done = true;
+    for (auto& t : readers)
+        t.join();
+
+    REQUIRE( torn == 0 );
+    REQUIRE( cmap.size() == 2 * n - n / 5 );
+    REQUIRE_FALSE( cmap.contains(10U) );
+    REQUIRE( cmap.at(4U) == 12ULL );
+    REQUIRE( cmap.at(3U) == 3ULL );
+    REQUIRE( cmap.at(2 * n - 1) == 2ULL * n - 1 );
+    REQUIRE_THROWS_AS( cmap.at(15U), std::out_of_range );
+
+    cmap.add(3U, 99ULL);
+    REQUIRE( cmap.at(3U) == 3ULL );
+
+    auto r = cmap.read();
+    REQUIRE( r.find(15U) == nullptr );
+    REQUIRE( *r.find(6U) == 18ULL );
+    unsigned int visited = 0;
+    r.for_each([&](unsigned int, unsigned long long) { ++visited; });
+    REQUIRE( visited == cmap.size() );
+}
+
+TEST_CASE( "sharded_sparse_map takes concurrent writers on disjoint keys", "[sharded]")
+{
+    typedef psset::sharded_sparse_map<unsigned int, unsigned int, UIntHash, 8> sharded;
+    sharded smap;
+    const unsigned int per_thread = 10000;
+
+    REQUIRE( sharded::shard_count() == 8 );
+    REQUIRE( sharded::shard_of(13U) == 5 );
+
+    std::vector<std::thread> writers;
+    for (unsigned int t = 0; t < 4; ++t) {
+        writers.emplace_back([&, t] {
+            for (unsigned int i = 0; i < per_thread; ++i) {
+                unsigned int k = i * 4 + t;
+                smap.add(k, k);
+                if (i % 2 == 0)
+                    smap.visit(k, [](unsigned int& v) { v *= 2; });
+                if (i % 10 == 0)
+                    smap.remove(k);
+            }
+        });
+    }
+    for (auto& t : writers)
+        t.join();
+
+    REQUIRE( smap.size() == 4 * per_thread - 4 * per_thread / 10 );
+    REQUIRE_FALSE( smap.contains(0U) );
+    REQUIRE_FALSE( smap.try_emplace(5U, 1U) );
+
+    unsigned int v = 0;
+    REQUIRE( smap.try_get(9U, v) );
+    REQUIRE( v == 18U );
+    REQUIRE( smap.try_get(5U, v) );
+    REQUIRE( v == 5U );
+
+    smap.insert_or_assign(5U, 7U);
+    REQUIRE( smap.try_get(5U, v) );
+    REQUIRE( v == 7U );
+    smap.insert_or_assign(5U, 5U);
+
+    std::size_t last_shard = 0;
+    bool in_order = true;
+    smap.for_each([&](unsigned int k, unsigned int&) {
+        in_order = in_order && sharded::shard_of(k) >= last_shard;
+        last_shard = sharded::shard_of(k);
+    });
+    REQUIRE( in_order );
+
+    psset::thread_pool pool(3);
+    std::atomic<unsigned int> wrong(0);
+    psset::parallel_for_each(smap, [&](unsigned int k, unsigned int& val) {
+        if (val != k && val != 2 * k)
+            ++wrong;
+    }, pool);
+    REQUIRE( wrong == 0 );
+
+    smap.clear();
+    REQUIRE( smap.empty() );
+}
+
+template <typename Policy>
+void concurrent_disjoint_adds()
+{
+    psset::sparse_set<unsigned int, UIntHash, Policy> sset;
+    psset::sparse_map<unsigned int, unsigned int, UIntHash, Policy> smap;
+    const unsigned int per_thread = 20000;
+    const unsigned int threads = 4;
+
+    sset.add(3 * per_thread * threads);
+    sset.reserve_keys(3 * per_thread * threads + 1);
+    sset.reserve_elements(per_thread * threads + 1);
+    smap.reserve_keys(per_thread * threads * 3);
+    smap.reserve_elements(per_thread * threads);
+
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (unsigned int i = t; i < per_thread * threads; i += threads) {
+                sset.add_concurrent(i * 3);
+                smap.add_concurrent(i * 3, i);
+            }
+        });
+    }
+    for (auto& t : workers)
+        t.join();
+
+    REQUIRE( sset.size() == per_thread * threads + 1 );
+    REQUIRE( smap.size() == per_thread * threads );
+    for (unsigned int i = 0; i < per_thread * threads; ++i) {
+        REQUIRE( sset.contains(i * 3) );
+        REQUIRE_FALSE( sset.contains(i * 3 + 1) );
+        REQUIRE( smap.at(i * 3) == i );
+    }
+    REQUIRE( sset.contains(3 * per_thread * threads) );
+
+    REQUIRE_THROWS_AS( sset.add_concurrent(1U), std::length_error );
+    REQUIRE( sset.size() == per_thread * threads + 1 );
+    REQUIRE_THROWS_AS( smap.add_concurrent(per_thread * threads * 3, 0U), std::length_error );
+
+    sset.remove(0U);
+    sset.add(1U);
+    REQUIRE( sset.contains(1U) );
+    REQUIRE_FALSE( sset.contains(0U) );
+}
+
+TEST_CASE( "sparse_set and sparse_map take concurrent adds of disjoint keys", "[sparse_set][sparse_map][concurrent]")
+{
+    concurrent_disjoint_adds<psset::initialized_sparse>();
+    concurrent_disjoint_adds<psset::uninitialized_sparse>();
+}
+
+TEST_CASE( "command_buffer records from worker threads and applies at flush", "[command_buffer]")
+{
+    psset::sparse_set<unsigned int, UIntHash> alive;
+    psset::sparse_map<unsigned int, std::string, UIntHash> names;
+    psset::sparse_factory<int> factory;
+
+    for (unsigned int i = 0; i < 1000; ++i) {
+        alive.add(i);
+        names.add(i, "old");
+    }
+    auto id = factory.create();
+    auto gone = factory.create();
+
+    psset::command_buffer commands;
+    psset::thread_pool pool(3);
+
+    pool.parallel_for(1000, 50, [&](std::size_t first, std::size_t last) {
+        for (std::size_t i = first; i < last; ++i) {
+            auto k = static_cast<unsigned int>(i);
+            if (k % 2 == 0) {
+                commands.remove(alive, k);
+                commands.remove(names, k);
+            } else {
+                commands.add(alive, k + 1000);
+                commands.add(names, k, std::string("kept"));
+                commands.assign(names, k + 1000, std::string(200, 'x'));
+            }
+        }
+    });
+
+    commands.assign(names, 1U, std::string("first"));
+    commands.assign(names, 1U, std::string("second"));
+    commands.remove(factory, gone);
+    commands.assign(factory, gone, 5);
+    commands.assign(factory, id, 7);
+
+    REQUIRE( commands.size() == 500 * 2 + 500 * 3 + 5 );
+    REQUIRE( alive.size() == 1000 );
+
+    commands.flush();
+    REQUIRE( commands.empty() );
+
+    REQUIRE( alive.size() == 1000 );
+    REQUIRE_FALSE( alive.contains(0U) );
+    REQUIRE( alive.contains(1001U) );
+    REQUIRE( names.size() == 1000 );
+    REQUIRE( names.at(3U) == "old" );
+    REQUIRE( names.at(1U) == "second" );
+    REQUIRE( names.at(1003U) == std::string(200, 'x') );
+    REQUIRE_FALSE( names.contains(2U) );
+    REQUIRE_FALSE( factory.exists(gone) );
+    REQUIRE( factory.at(id) == 7 );
+
+    commands.add(alive, 0U);
+    commands.clear();
+    commands.flush();
+    REQUIRE_FALSE( alive.contains(0U) );
+
+    commands.add(alive, 0U);
+    commands.flush();
+    REQUIRE( alive.contains(0U) );
+}
+
+TEST_CASE( "command_buffer records into many buffers from one thread", "[command_buffer]")
+{
+    psset::sparse_map<unsigned int, unsigned int, UIntHash> values;
+
+    for (int pass = 0; pass < 3; ++pass) {
+        std::vector<std::unique_ptr<psset::command_buffer>> buffers;
+        for (int b = 0; b < 6; ++b)
+            buffers.emplace_back(new psset::command_buffer);
+
+        for (unsigned int round = 0; round < 1000; ++round)
+            for (unsigned int b = 0; b < buffers.size(); ++b)
+                buffers[b]->assign(values, b, round);
+
+        for (auto& buffer : buffers) {
+            REQUIRE( buffer->size() == 1000 );
+            buffer->flush();
+        }
+    }
+
+    REQUIRE( values.size() == 6 );
+    REQUIRE( values.at(5U) == 999 );
+}
+
+TEST_CASE( "sparse_factory creates handles from several threads at once", "[sparse_factory][concurrent]")
+{
+    using EntityFactory = psset::sparse_factory<int>;
+    EntityFactory factory;
+    const unsigned int per_thread = 5000;
+    const unsigned int threads = 4;
+
+    std::vector<EntityFactory::ValueId> first;
+    for (unsigned int i = 0; i < 1000; ++i)
+        first.push_back(factory.create());
+    for (auto id : first)
+        factory.remove(id);
+
+    factory.reserve(per_thread * threads);
+
+    std::vector<std::vector<EntityFactory::ValueId>> created(threads);
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (unsigned int i = 0; i < per_thread; ++i)
+                created[t].push_back(factory.create_concurrent());
+        });
+    }
+    for (auto& t : workers)
+        t.join();
+
+    REQUIRE( factory.size() == per_thread * threads );
+
+    std::vector<EntityFactory::ValueId> all;
+    for (auto& ids : created)
+        all.insert(all.end(), ids.begin(), ids.end());
+    std::sort(all.begin(), all.end());
+    REQUIRE( std::adjacent_find(all.begin(), all.end()) == all.end() );
+
+    std::vector<unsigned long> indices;
+    for (auto id : all) {
+        REQUIRE( factory.exists(id) );
+        indices.push_back(id & 0xFFFFFFFFUL);
+    }
+    std::sort(indices.begin(), indices.end());
+    REQUIRE( std::adjacent_find(indices.begin(), indices.end()) == indices.end() );
+
+    for (auto id : first)
+        REQUIRE_FALSE( factory.exists(id) );
+    REQUIRE( std::count_if(all.begin(), all.end(), [](EntityFactory::ValueId id) { return (id >> 32U) == 1; }) == 1000 );
+
+    factory.remove(all.front());
+    REQUIRE_FALSE( factory.exists(all.front()) );
+    REQUIRE( factory.size() == per_thread * threads - 1 );
+
+    psset::handle_allocator handles;
+    std::vector<psset::handle_allocator::handle> taken;
+    for (int i = 0; i < 1000; ++i)
+        taken.push_back(handles.acquire());
+    for (auto h : taken)
+        handles.release(h);
+    handles.flush();
+    std::vector<psset::handle_allocator::handle> again;
+    for (int i = 0; i < 1000; ++i)
+        again.push_back(handles.acquire());
+    std::sort(again.begin(), again.end());
+    REQUIRE( std::adjacent_find(again.begin(), again.end()) == again.end() );
+    REQUIRE( again.back() < 1024 );
+}
+
+TEST_CASE( "sparse_factory keeps handle indices dense across factories and threads", "[sparse_factory][concurrent]")
+{
+    using EntityFactory = psset::sparse_factory<int>;
+    std::vector<std::unique_ptr<EntityFactory>> factories;
+    for (int f = 0; f < 5; ++f)
+        factories.emplace_back(new EntityFactory);
+
+    unsigned long highest = 0;
+    for (int i = 0; i < 200; ++i)
+        highest = std::max(highest, factories[i % 5]->create() & 0xFFFFFFFFUL);
+    REQUIRE( highest < 64 );
+
+    EntityFactory factory;
+    const unsigned int threads = 33;
+    const unsigned int per_thread = 200;
+    factory.reserve(threads * per_thread, threads);
+
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < threads; ++t) {
+        workers.emplace_back([&] {
+            for (unsigned int i = 0; i < per_thread; ++i)
+                factory.create_concurrent();
+        });
+    }
+    for (auto& w : workers)
+        w.join();
+
+    REQUIRE( factory.size() == threads * per_thread );
+}
+
+TEST_CASE( "sparse_map accumulates values atomically from several threads", "[sparse_map][concurrent]")
+{
+    psset::sparse_map<unsigned int, unsigned long long, UIntHash> hits;
+    psset::sparse_map<unsigned int, double, UIntHash> damage;
+    psset::sparse_map<unsigned int, int, UIntHash> owner;
+
+    for (unsigned int i = 0; i < 64; ++i) {
+        hits.add(i, 0);
+        damage.add(i, 0.0);
+        owner.add(i, -1);
+    }
+
+    const int rounds = 2048;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 4; ++t) {
+        workers.emplace_back([&, t] {
+            for (int r = 0; r < rounds; ++r) {
+                unsigned int k = static_cast<unsigned int>(r) % 64;
+                hits.fetch_add(k, 2ULL);
+                hits.fetch_sub(k, 1ULL);
+                damage.fetch_add(k, 0.5);
+
+                int expected = -1;
+                owner.compare_exchange(k, expected, t);
+            }
+        });
+    }
+    for (auto& t : workers)
+        t.join();
+
+    unsigned long long total = 0;
+    for (auto kv : hits)
+        total += kv.value;
+    REQUIRE( total == 4ULL * rounds );
+    REQUIRE( hits.atomic_load(5U) == 4ULL * rounds / 64 );
+    REQUIRE( damage.at(5U) == Approx(0.5 * 4 * rounds / 64) );
+    for (auto kv : owner)
+        REQUIRE( (kv.value >= 0 && kv.value < 4) );
+
+    int expected = -1;
+    REQUIRE_FALSE( owner.compare_exchange(3U, expected, 9) );
+    REQUIRE( expected == owner.at(3U) );
+    REQUIRE( owner.compare_exchange(3U, expected, 9) );
+    REQUIRE( owner.at(3U) == 9 );
+
+    hits.atomic_store(7U, 42ULL);
+    REQUIRE( hits.at(7U) == 42ULL );
+    REQUIRE( damage.fetch_sub(7U, 1.0) == Approx(0.5 * 4 * rounds / 64) );
+    REQUIRE_THROWS_AS( hits.fetch_add(1000U, 1ULL), std::out_of_range );
+}
+
+TEST_CASE( "sparse_set and sparse_map add values that refer into themselves", "[sparse_set][sparse_map]")
+{
+    psset::sparse_map<unsigned int, std::string, UIntHash> smap;
+    const std::string s(100, 'p');
+
+    smap.add(1U, s);
+    for (unsigned int i = 2; i < 100; ++i)
+        smap.add(i, smap.at(i - 1));
+    for (unsigned int i = 100; i < 200; ++i)
+        smap.insert_or_assign(i, smap.at(1U));
+    for (unsigned int i = 200; i < 300; ++i)
+        smap.try_emplace(i, smap.at(i - 1));
+    for (unsigned int i = 1; i < 300; ++i)
+        REQUIRE( smap.at(i) == s );
+
+    psset::sparse_set<std::string, StringLengthHash> strings;
+    strings.add(std::string(200, 'a'));
+    for (std::size_t len = 1; len < 200; ++len)
+        strings.emplace(strings.data()[0], 0, len);
+    REQUIRE( strings.size() == 200 );
+    REQUIRE( strings.contains(std::string(99, 'a')) );
+}
+
+TEST_CASE( "concurrent_sparse_map keeps pinned blocks alive through growth", "[concurrent]")
+{
+    psset::concurrent_sparse_map<unsigned int, unsigned long long, UIntHash> cmap;
+    cmap.add(0U, 0ULL);
+
+    std::atomic<bool> done(false);
+    std::atomic<unsigned int> wrong(0);
+    std::vector<std::thread> readers;
+
+    for (int t = 0; t < 6; ++t) {
+        readers.emplace_back([&, t] {
+            while (!done) {
+                auto r = cmap.read();
+                for (unsigned int k = 0; k < 256; ++k) {
+                    unsigned int key = k * 13 + static_cast<unsigned int>(t);
+                    const unsigned long long* v = r.find(key);
+                    const unsigned long long* w = cmap.read().find(key);
+                    if ((v != nullptr && *v % 2 != 0) || (w != nullptr && *w % 2 != 0))
+                        ++wrong;
+                }
+            }
+        });
+    }
+
+    for (unsigned int round = 0; round < 50; ++round) {
+        for (unsigned int k = 0; k < 5000; ++k)
+            cmap.insert_or_assign(k, 2ULL * (k + round));
+        for (unsigned int k = 0; k < 5000; k += 3)
+            cmap.remove(k);
+    }
+
+    done = true;
+    for (auto& t : readers)
+        t.join();
+    cmap.reclaim();
+
+    REQUIRE( wrong == 0 );
+    REQUIRE( cmap.at(4999U) == 2ULL * (4999 + 49) );
+}
+
+TEST_CASE( "concurrent_sparse_map updates at a power-of-two-minus-one size stay in place", "[concurrent]")
+{
+    psset::concurrent_sparse_map<unsigned int, unsigned int, UIntHash> cmap;
+    for (unsigned int k = 0; k < 4095; ++k)
+        cmap.add(k, k);
+
+    int moved = 0;
+    for (unsigned int i = 0; i < 200; ++i) { // a guard sees later updates only while they land in its block
+        auto r = cmap.read();
+        cmap.insert_or_assign(i % 4095, i + 1);
+        moved += *r.find(i % 4095) != i + 1;
+    }
+
+    REQUIRE( moved <= 1 );
+    REQUIRE( cmap.size() == 4095 );
+    REQUIRE( cmap.at(199U) == 200 );
+}
+
+TEST_CASE( "concurrent_sparse_map compacts once removed entries outnumber live ones", "[concurrent]")
+{
+    psset::concurrent_sparse_map<unsigned int, std::shared_ptr<int>, UIntHash> cmap;
+    std::shared_ptr<int> value = std::make_shared<int>(7);
+
+    for (unsigned int k = 0; k < 1000; ++k)
+        cmap.add(k, value);
+    for (unsigned int k = 0; k < 900; ++k)
+        cmap.remove(k);
+    cmap.reclaim();
+
+    REQUIRE( cmap.size() == 100 );
+    REQUIRE( value.use_count() <= 1 + 2 * 100 ); // the live entries and at most as many dead slots
+    REQUIRE( *cmap.at(950U) == 7 );
+    REQUIRE_FALSE( cmap.contains(10U) );
+}
+
 TEST_CASE( "sparse_factory mixed creation and deletion of 10k entities", "[sparse_factory]")
 {
     using EntityFactory = psset::sparse_factory<Entity>;
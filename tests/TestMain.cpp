@@ -3,5 +3,6 @@
 //
 
 #define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_NO_POSIX_SIGNALS // catch 2.3 does not build against glibc >= 2.34 otherwise
 
 #include "catch.hpp"
\ No newline at end of file